@@ -0,0 +1,68 @@
+#pragma once
+#include <cfloat>
+#include <algorithm>
+#include "vector.hpp"
+#include "ray.hpp"
+
+/*
+  Axis aligned bounding box, used by the BVH to skip objects a ray can't hit
+
+  An empty box has bound_min > bound_max so that growing it by any point or box gives that point or box
+*/
+struct AABB {
+  Vec3f bound_min, bound_max;
+  AABB() : bound_min(Vec3f(FLT_MAX,FLT_MAX,FLT_MAX)), bound_max(Vec3f(-FLT_MAX,-FLT_MAX,-FLT_MAX)) {};
+  AABB(Vec3f bound_min, Vec3f bound_max) : bound_min(bound_min), bound_max(bound_max) {};
+  // box that contains everything, returned by objects like the infinite checkerboard plane
+  static AABB infinite() {return AABB(Vec3f(-FLT_MAX,-FLT_MAX,-FLT_MAX), Vec3f(FLT_MAX,FLT_MAX,FLT_MAX));};
+  bool is_infinite();
+  void grow(Vec3f p);
+  void grow(AABB box);
+  Vec3f center();
+  float surface_area();
+  /*
+    Slab test, returns the distance at which the ray enters the box or FLT_MAX if it misses.
+    inverse_direction is 1/ray->direction, precomputed once per ray by the caller
+  */
+  float hit(Ray *ray, Vec3f *inverse_direction, float max_t);
+};
+
+bool AABB::is_infinite() {
+  return bound_min.x == -FLT_MAX || bound_min.y == -FLT_MAX || bound_min.z == -FLT_MAX ||
+         bound_max.x ==  FLT_MAX || bound_max.y ==  FLT_MAX || bound_max.z ==  FLT_MAX;
+}
+void AABB::grow(Vec3f p) {
+  bound_min = Vec3f(std::min(bound_min.x, p.x), std::min(bound_min.y, p.y), std::min(bound_min.z, p.z));
+  bound_max = Vec3f(std::max(bound_max.x, p.x), std::max(bound_max.y, p.y), std::max(bound_max.z, p.z));
+}
+void AABB::grow(AABB box) {
+  // min with min and max with max, growing by the corners as points would turn an empty box into an infinite one
+  bound_min = Vec3f(std::min(bound_min.x, box.bound_min.x), std::min(bound_min.y, box.bound_min.y), std::min(bound_min.z, box.bound_min.z));
+  bound_max = Vec3f(std::max(bound_max.x, box.bound_max.x), std::max(bound_max.y, box.bound_max.y), std::max(bound_max.z, box.bound_max.z));
+}
+Vec3f AABB::center() {
+  return (bound_min + bound_max) * 0.5f;
+}
+float AABB::surface_area() {
+  if (bound_min.x > bound_max.x) {return 0.f;} // empty box
+  Vec3f e = bound_max - bound_min;
+  return 2.f * (e.x*e.y + e.y*e.z + e.z*e.x);
+}
+float AABB::hit(Ray *ray, Vec3f *inverse_direction, float max_t) {
+  float tx0 = (bound_min.x - ray->origin.x) * inverse_direction->x;
+  float tx1 = (bound_max.x - ray->origin.x) * inverse_direction->x;
+  float t_min = std::min(tx0, tx1);
+  float t_max = std::max(tx0, tx1);
+  float ty0 = (bound_min.y - ray->origin.y) * inverse_direction->y;
+  float ty1 = (bound_max.y - ray->origin.y) * inverse_direction->y;
+  t_min = std::max(t_min, std::min(ty0, ty1));
+  t_max = std::min(t_max, std::max(ty0, ty1));
+  float tz0 = (bound_min.z - ray->origin.z) * inverse_direction->z;
+  float tz1 = (bound_max.z - ray->origin.z) * inverse_direction->z;
+  t_min = std::max(t_min, std::min(tz0, tz1));
+  t_max = std::min(t_max, std::max(tz0, tz1));
+  if (t_max >= std::max(t_min, 0.f) && t_min < max_t) {
+    return t_min;
+  }
+  return FLT_MAX;
+}
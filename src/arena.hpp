@@ -0,0 +1,194 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+const size_t cache_line_size = 64;
+
+/*
+  Counts every heap allocation of the program when it is compiled with -DCOUNT_ALLOCATIONS,
+  the render loop should not allocate anything once the first frames are done:
+
+    uint64_t before = allocation_count();
+    renderer.threaded_render(...);
+    // allocation_count() - before should be 0
+
+  Without COUNT_ALLOCATIONS allocation_count() is always 0 and operator new is left alone
+*/
+#ifdef COUNT_ALLOCATIONS
+std::atomic<uint64_t> allocations(0);
+// new and delete are not inlined, otherwise gcc sees malloc() and free() and warns that they don't match new and delete
+__attribute__((noinline)) void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) {throw std::bad_alloc();}
+  return p;
+}
+void *operator new[](size_t size) {return operator new(size);}
+__attribute__((noinline)) void operator delete(void *p) noexcept {free(p);}
+void operator delete[](void *p) noexcept {free(p);}
+void operator delete(void *p, size_t) noexcept {free(p);}
+void operator delete[](void *p, size_t) noexcept {free(p);}
+uint64_t allocation_count() {return allocations.load(std::memory_order_relaxed);}
+#else
+uint64_t allocation_count() {return 0;}
+#endif
+
+/*
+  Memory for many small objects that are all freed at once
+
+  Objects are placed one after another in big blocks that start on a cache line, so the objects
+  of a scene end up next to each other in memory instead of all over the heap. Nothing is freed on its own,
+  reset() destroys everything that was created and keeps the blocks for the next use (scratch memory
+  that is refilled every frame), release() also gives the blocks back (or just delete the arena).
+  Destructors run in the opposite order of creation
+*/
+class Arena {
+private:
+  struct Block {
+    Block *next;
+    size_t size; // usable bytes after the header
+  };
+  struct Destructor {
+    void (*destroy)(void *object);
+    void *object;
+    Destructor *next;
+  };
+  Block *blocks = nullptr; // the block that is being filled, then the full ones
+  Block *free_blocks = nullptr; // blocks kept by reset()
+  char *position = nullptr, *block_end = nullptr;
+  Destructor *destructors = nullptr;
+  size_t block_size;
+  size_t used_bytes = 0;
+  void new_block(size_t min_size);
+  void run_destructors();
+  template <typename T> static void destroy(void *object) {static_cast<T*>(object)->~T();}
+  template <typename T> static void destroy_array(void *object);
+public:
+  Arena(size_t block_size = 64*1024) : block_size(block_size) {};
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() {release();};
+  // size bytes aligned to alignment (a power of two up to cache_line_size)
+  void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+  template <typename T, typename... Args> T *create(Args&&... args);
+  // count default constructed objects, the first one starts on a cache line
+  template <typename T> T *create_array(size_t count);
+  // a copy of a zero terminated string
+  char *copy_string(const char *text);
+  void reset();
+  void release();
+  size_t used() {return used_bytes;};
+};
+
+void Arena::new_block(size_t min_size) {
+  size_t header = (sizeof(Block) + cache_line_size-1) / cache_line_size * cache_line_size;
+  Block **previous = &free_blocks;
+  Block *block = free_blocks;
+  while (block && block->size < min_size) {
+    previous = &block->next;
+    block = block->next;
+  }
+  if (block) {
+    *previous = block->next;
+  } else {
+    size_t size = std::max(block_size, (min_size + cache_line_size-1) / cache_line_size * cache_line_size);
+    void *memory = nullptr;
+    if (posix_memalign(&memory, cache_line_size, header + size) != 0) {throw std::bad_alloc();}
+#ifdef COUNT_ALLOCATIONS
+    allocations.fetch_add(1, std::memory_order_relaxed);
+#endif
+    block = static_cast<Block*>(memory);
+    block->size = size;
+  }
+  block->next = blocks;
+  blocks = block;
+  position = reinterpret_cast<char*>(block) + header;
+  block_end = position + block->size;
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+  uintptr_t aligned = (reinterpret_cast<uintptr_t>(position) + alignment-1) & ~(uintptr_t)(alignment-1);
+  if (!position || aligned + size > reinterpret_cast<uintptr_t>(block_end)) {
+    // blocks start on a cache line, so the start of a new block is aligned for everything
+    new_block(size);
+    aligned = reinterpret_cast<uintptr_t>(position);
+  }
+  position = reinterpret_cast<char*>(aligned + size);
+  used_bytes += size;
+  return reinterpret_cast<void*>(aligned);
+}
+
+template <typename T, typename... Args>
+T *Arena::create(Args&&... args) {
+  T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  if (!std::is_trivially_destructible<T>::value) {
+    Destructor *destructor = static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+    *destructor = {destroy<T>, object, destructors};
+    destructors = destructor;
+  }
+  return object;
+}
+
+// the element count is stored right in front of the array
+template <typename T>
+void Arena::destroy_array(void *object) {
+  size_t count = *(static_cast<size_t*>(object) - 1);
+  for (size_t i=count; i>0; i--) {static_cast<T*>(object)[i-1].~T();}
+}
+
+template <typename T>
+T *Arena::create_array(size_t count) {
+  char *memory = static_cast<char*>(allocate(cache_line_size + count*sizeof(T), cache_line_size));
+  *reinterpret_cast<size_t*>(memory + cache_line_size - sizeof(size_t)) = count;
+  T *array = reinterpret_cast<T*>(memory + cache_line_size);
+  for (size_t i=0; i<count; i++) {new (&array[i]) T();}
+  if (!std::is_trivially_destructible<T>::value) {
+    Destructor *destructor = static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+    *destructor = {destroy_array<T>, array, destructors};
+    destructors = destructor;
+  }
+  return array;
+}
+
+char *Arena::copy_string(const char *text) {
+  size_t length = strlen(text);
+  char *copy = static_cast<char*>(allocate(length+1, 1));
+  memcpy(copy, text, length+1);
+  return copy;
+}
+
+void Arena::run_destructors() {
+  while (destructors) {
+    Destructor *destructor = destructors;
+    destructors = destructor->next;
+    destructor->destroy(destructor->object);
+  }
+}
+
+void Arena::reset() {
+  run_destructors();
+  while (blocks) {
+    Block *block = blocks;
+    blocks = block->next;
+    block->next = free_blocks;
+    free_blocks = block;
+  }
+  position = block_end = nullptr;
+  used_bytes = 0;
+}
+
+void Arena::release() {
+  reset();
+  while (free_blocks) {
+    Block *block = free_blocks;
+    free_blocks = block->next;
+    free(block);
+  }
+}
@@ -0,0 +1,321 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "aabb.hpp"
+#include "flat_array.hpp"
+#include "ray.hpp"
+
+/*
+  Bounding volume hierarchy over an array of primitives
+
+  The BVH only knows the bounding box of each primitive, the actual intersection test is passed in
+  as a function so that the same BVH can be used for Object_List or any other collection of primitives.
+  Primitives with an infinite bounding box (like the checkerboard plane) can't be put in a box,
+  they are stored seperately and tested for every ray.
+*/
+struct BVH_Node {
+  AABB bounds;
+  int left_first; // leaf: index of the first primitive in BVH::indices, inner node: index of the left child
+  int count;      // number of primitives in a leaf, 0 for inner nodes
+};
+
+class BVH {
+private:
+  static const int bins = 12;          // number of bins used to evaluate SAH splits
+  static const int max_leaf_size = 2;
+  static const int max_depth = 60;     // keeps the traversal stack below 64 entries
+  std::vector<AABB> boxes;              // bounding box of each primitive
+  std::vector<Vec3f> centers;           // center of the bounding box of each primitive
+  void update_bounds(int node_index);
+  void subdivide(int node_index, int depth);
+  // a split found by find_split(), primitives whose center falls into bin <= last_left_bin go to the left child
+  struct Split {
+    int axis, last_left_bin;
+    float bins_min, scale;
+    AABB left_bounds, right_bounds;
+  };
+  int bin_index(float v, float bins_min, float scale) {return std::min(bins-1, (int)((v - bins_min) * scale));};
+  float find_split(BVH_Node *node, Split *split);
+public:
+  Flat_Array<BVH_Node> nodes;          // nodes[0] is the root, the children of a node are stored next to each other
+  Flat_Array<int> indices;             // primitive indices referenced by the leaves
+  Flat_Array<int> unbounded;           // primitives that have an infinite bounding box
+  /*
+    Builds the tree using binned SAH (surface area heuristic) splits
+  */
+  void build(AABB *primitive_boxes, int n);
+  /*
+    Updates the bounding boxes of all nodes without changing the tree structure.
+    Much cheaper than build() when only a few primitives moved a little bit
+  */
+  void refit(AABB *primitive_boxes);
+  /*
+    Finds the closest intersection.
+    intersect(int primitive, Ray *ray) has to return true on a hit closer than ray->max_t
+    and shrink ray->max_t to the distance of that hit
+  */
+  template <typename Intersect> bool intersection(Ray *ray, Intersect intersect);
+  /*
+    Returns true as soon as any primitive blocks the ray between ray->min_t and ray->max_t.
+    occlude(int primitive, Ray *ray) only has to answer yes or no, the order doesn't matter
+  */
+  template <typename Occlude> bool occluded(Ray *ray, Occlude occlude);
+  /*
+    Checks a tree that wasn't built here (scene_snapshot.hpp): every index has to lie inside its array,
+    children have to come after their parent and the tree can't be deeper than build() makes it,
+    otherwise the traversal would read out of bounds or overflow its stack
+  */
+  bool valid(int primitive_count);
+};
+
+
+void BVH::build(AABB *primitive_boxes, int n) {
+  boxes.assign(primitive_boxes, primitive_boxes+n);
+  centers.clear();
+  indices.clear();
+  unbounded.clear();
+  nodes.clear();
+  for (int i=0; i<n; i++) {
+    centers.push_back(boxes[i].center());
+    if (boxes[i].is_infinite()) {
+      unbounded.push_back(i);
+    } else {
+      indices.push_back(i);
+    }
+  }
+  // a binary tree with k leaves has 2k-1 nodes, reserving that many keeps node pointers valid while building
+  nodes.reserve(2*indices.size()+1);
+  BVH_Node root;
+  root.left_first = 0;
+  root.count = indices.size();
+  nodes.push_back(root);
+  update_bounds(0);
+  if (root.count > 0) {
+    subdivide(0, 0);
+  }
+}
+
+void BVH::update_bounds(int node_index) {
+  BVH_Node *node = &nodes[node_index];
+  node->bounds = AABB();
+  for (int i=0; i<node->count; i++) {
+    node->bounds.grow(boxes[indices[node->left_first+i]]);
+  }
+}
+
+// returns the SAH cost of the best split found
+float BVH::find_split(BVH_Node *node, Split *split) {
+  // bins are placed along the bounds of the primitive centers, not the primitive bounds
+  AABB center_bounds;
+  for (int i=0; i<node->count; i++) {
+    center_bounds.grow(centers[indices[node->left_first+i]]);
+  }
+  float bounds_min[3] = {center_bounds.bound_min.x, center_bounds.bound_min.y, center_bounds.bound_min.z};
+  float bounds_max[3] = {center_bounds.bound_max.x, center_bounds.bound_max.y, center_bounds.bound_max.z};
+  float scale[3];
+  for (int a=0; a<3; a++) {
+    scale[a] = bounds_min[a] == bounds_max[a] ? 0.f : bins / (bounds_max[a] - bounds_min[a]);
+  }
+  // all three axes are binned in the same pass so every primitive is only loaded once
+  AABB bin_bounds[3][bins];
+  int bin_count[3][bins] = {{0}};
+  for (int i=0; i<node->count; i++) {
+    int p = indices[node->left_first+i];
+    float c[3] = {centers[p].x, centers[p].y, centers[p].z};
+    for (int a=0; a<3; a++) {
+      int b = bin_index(c[a], bounds_min[a], scale[a]);
+      bin_count[a][b]++;
+      bin_bounds[a][b].grow(boxes[p]);
+    }
+  }
+  float best_cost = FLT_MAX;
+  for (int a=0; a<3; a++) {
+    if (scale[a] == 0.f) {continue;}
+    // sweep from both sides to get the bounds and count left and right of every bin boundary
+    AABB left_box[bins-1], right_box[bins-1];
+    int left_count[bins-1], right_count[bins-1];
+    AABB left_sum_box, right_sum_box;
+    int left_sum = 0, right_sum = 0;
+    for (int i=0; i<bins-1; i++) {
+      left_sum += bin_count[a][i];
+      left_count[i] = left_sum;
+      left_sum_box.grow(bin_bounds[a][i]);
+      left_box[i] = left_sum_box;
+      right_sum += bin_count[a][bins-1-i];
+      right_count[bins-2-i] = right_sum;
+      right_sum_box.grow(bin_bounds[a][bins-1-i]);
+      right_box[bins-2-i] = right_sum_box;
+    }
+    for (int i=0; i<bins-1; i++) {
+      if (left_count[i] == 0 || right_count[i] == 0) {continue;}
+      float cost = left_count[i]*left_box[i].surface_area() + right_count[i]*right_box[i].surface_area();
+      if (cost < best_cost) {
+        best_cost = cost;
+        split->axis = a;
+        split->last_left_bin = i;
+        split->bins_min = bounds_min[a];
+        split->scale = scale[a];
+        // the children get the bounds of their bins, no need to go over their primitives again
+        split->left_bounds = left_box[i];
+        split->right_bounds = right_box[i];
+      }
+    }
+  }
+  return best_cost;
+}
+
+void BVH::subdivide(int node_index, int depth) {
+  BVH_Node *node = &nodes[node_index];
+  if (node->count <= max_leaf_size || depth >= max_depth) {return;}
+  Split split;
+  float split_cost = find_split(node, &split);
+  float leaf_cost = node->count * node->bounds.surface_area();
+  if (split_cost >= leaf_cost) {return;}
+  // partition the primitives of this node with the same bins find_split() used
+  int i = node->left_first;
+  int j = i + node->count - 1;
+  while (i <= j) {
+    Vec3f c = centers[indices[i]];
+    float v = split.axis == 0 ? c.x : (split.axis == 1 ? c.y : c.z);
+    if (bin_index(v, split.bins_min, split.scale) <= split.last_left_bin) {
+      i++;
+    } else {
+      std::swap(indices[i], indices[j--]);
+    }
+  }
+  int left_count = i - node->left_first;
+  if (left_count == 0 || left_count == node->count) {return;}
+  // create the two children
+  int left_child = nodes.size();
+  BVH_Node left, right;
+  left.left_first = node->left_first;
+  left.count = left_count;
+  right.left_first = i;
+  right.count = node->count - left_count;
+  nodes.push_back(left);
+  nodes.push_back(right);
+  node->left_first = left_child;
+  node->count = 0;
+  nodes[left_child].bounds = split.left_bounds;
+  nodes[left_child+1].bounds = split.right_bounds;
+  subdivide(left_child, depth+1);
+  subdivide(left_child+1, depth+1);
+}
+
+void BVH::refit(AABB *primitive_boxes) {
+  boxes.assign(primitive_boxes, primitive_boxes + indices.size() + unbounded.size());
+  // children are always stored after their parent, so going backwards updates children first
+  for (int i=nodes.size()-1; i>=0; i--) {
+    BVH_Node *node = &nodes[i];
+    if (node->count > 0 || nodes.size() == 1) {
+      update_bounds(i);
+    } else {
+      node->bounds = nodes[node->left_first].bounds;
+      node->bounds.grow(nodes[node->left_first+1].bounds);
+    }
+  }
+}
+
+bool BVH::valid(int primitive_count) {
+  if (nodes.size() > (size_t)INT32_MAX || indices.size() > (size_t)INT32_MAX || unbounded.size() > (size_t)INT32_MAX) {return false;}
+  for (int i=0; i<(int)indices.size(); i++) {
+    if (indices[i] < 0 || indices[i] >= primitive_count) {return false;}
+  }
+  for (int i=0; i<(int)unbounded.size(); i++) {
+    if (unbounded[i] < 0 || unbounded[i] >= primitive_count) {return false;}
+  }
+  // the traversal doesn't look at the nodes without bounded primitives
+  if (indices.empty()) {return true;}
+  if (nodes.empty()) {return false;}
+  // children come after their parent, so going through the nodes in order reaches every parent before its children
+  int node_count = nodes.size();
+  std::vector<int> depth(node_count, -1);
+  depth[0] = 0;
+  for (int i=0; i<node_count; i++) {
+    if (depth[i] < 0) {continue;} // not reachable from the root
+    BVH_Node *node = &nodes[i];
+    if (node->count < 0) {return false;}
+    if (node->count > 0) {
+      if (node->left_first < 0 || node->left_first > (int)indices.size() - node->count) {return false;}
+      continue;
+    }
+    if (node->left_first <= i || node->left_first >= node_count-1 || depth[i] >= max_depth) {return false;}
+    depth[node->left_first] = std::max(depth[node->left_first], depth[i]+1);
+    depth[node->left_first+1] = std::max(depth[node->left_first+1], depth[i]+1);
+  }
+  return true;
+}
+
+template <typename Intersect>
+bool BVH::intersection(Ray *ray, Intersect intersect) {
+  bool any_intersection = false;
+  for (int i=0; i<(int)unbounded.size(); i++) {
+    if (intersect(unbounded[i], ray)) {any_intersection = true;}
+  }
+  if (indices.empty()) {return any_intersection;}
+
+  Vec3f inverse_direction(1.f/ray->direction.x, 1.f/ray->direction.y, 1.f/ray->direction.z);
+  if (nodes[0].bounds.hit(ray, &inverse_direction, ray->max_t) == FLT_MAX) {return any_intersection;}
+  // nodes are visited front to back, a node is skipped when a closer hit was already found
+  int stack[64];
+  float stack_t[64];
+  int stack_size = 0;
+  stack[stack_size] = 0;
+  stack_t[stack_size++] = 0.f;
+  while (stack_size > 0) {
+    stack_size--;
+    if (stack_t[stack_size] >= ray->max_t) {continue;}
+    BVH_Node *node = &nodes[stack[stack_size]];
+    if (node->count > 0) {
+      for (int i=0; i<node->count; i++) {
+        if (intersect(indices[node->left_first+i], ray)) {any_intersection = true;}
+      }
+      continue;
+    }
+    int near_child = node->left_first;
+    int far_child = node->left_first+1;
+    float near_t = nodes[near_child].bounds.hit(ray, &inverse_direction, ray->max_t);
+    float far_t = nodes[far_child].bounds.hit(ray, &inverse_direction, ray->max_t);
+    if (far_t < near_t) {
+      std::swap(near_child, far_child);
+      std::swap(near_t, far_t);
+    }
+    // push the far child first so that the near child gets popped first
+    if (far_t != FLT_MAX) {
+      stack[stack_size] = far_child;
+      stack_t[stack_size++] = far_t;
+    }
+    if (near_t != FLT_MAX) {
+      stack[stack_size] = near_child;
+      stack_t[stack_size++] = near_t;
+    }
+  }
+  return any_intersection;
+}
+
+template <typename Occlude>
+bool BVH::occluded(Ray *ray, Occlude occlude) {
+  for (int i=0; i<(int)unbounded.size(); i++) {
+    if (occlude(unbounded[i], ray)) {return true;}
+  }
+  if (indices.empty()) {return false;}
+
+  Vec3f inverse_direction(1.f/ray->direction.x, 1.f/ray->direction.y, 1.f/ray->direction.z);
+  int stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    BVH_Node *node = &nodes[stack[--stack_size]];
+    if (node->bounds.hit(ray, &inverse_direction, ray->max_t) == FLT_MAX) {continue;}
+    if (node->count > 0) {
+      for (int i=0; i<node->count; i++) {
+        if (occlude(indices[node->left_first+i], ray)) {return true;}
+      }
+      continue;
+    }
+    stack[stack_size++] = node->left_first+1;
+    stack[stack_size++] = node->left_first;
+  }
+  return false;
+}
@@ -1,22 +1,31 @@
 #pragma once
 #include <chrono>
-#include <string>
+#include <cstdio>
+#include <cstdint>
 #include <thread>
+#include "color.hpp"
 
 class Clock {
 private:
   std::chrono::high_resolution_clock::time_point t_start, t_render, t_display, t_frame; 
+  std::chrono::high_resolution_clock::time_point t_created = std::chrono::high_resolution_clock::now();
   int fps_limit = 0;
   int precision = 1; // how many decimal places the frametimes have
 public:
   double rendertime, displaytime, frametime=0.1; // seconds
-  std::string fps_str, rendertime_str, displaytime_str, frametime_str;
+  double worktime = 0.; // seconds the last frame took before the fps limit waited, what it needs of the frametime
+  // fixed buffers so that showing the stats doesn't allocate every frame
+  char fps_str[32] = "", rendertime_str[32] = "", displaytime_str[32] = "", frametime_str[32] = "";
+  char resolution_str[32] = ""; // shown below the other stats unless it is empty, set by the render loop
   Clock() {t_start = std::chrono::high_resolution_clock::now();}; 
   Clock(int fps_limit) : fps_limit(fps_limit) {t_start = std::chrono::high_resolution_clock::now();};
   void calculate_rendertime();
   void calculate_displaytime();
   void calculate_frametime();
-  void show_stats(char *pixels, int *window_width, uint64_t *frame);
+  // seconds since the clock was created, the timestamps of recorded frames
+  double session_time();
+  // colors (optional) is set to white where the stats are, so that they can be read in the color modes of the Window
+  void show_stats(char *pixels, int *window_width, uint64_t *frame, Color *colors = nullptr);
 };
 
 void Clock::calculate_rendertime() {
@@ -30,6 +39,7 @@ void Clock::calculate_displaytime() {
 void Clock::calculate_frametime() {
   t_frame = std::chrono::high_resolution_clock::now();
   frametime = std::chrono::duration_cast<std::chrono::microseconds>(t_frame-t_start).count()/1000000.;
+  worktime = frametime;
 
   // limiting fps
   if (fps_limit != 0) {
@@ -41,32 +51,37 @@ void Clock::calculate_frametime() {
   // start clock again 
   t_start = std::chrono::high_resolution_clock::now();
 }
-void Clock::show_stats(char *pixels, int *window_width, uint64_t *frame) {
+double Clock::session_time() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now()-t_created).count()/1000000.;
+}
+void Clock::show_stats(char *pixels, int *window_width, uint64_t *frame, Color *colors) {
   // only update performance stats every 10 frames so that they are readable and dont flicker
   if (*frame % 10 == 0) {
-    rendertime_str = std::to_string(rendertime*1000);
-    rendertime_str = rendertime_str.substr(0, rendertime_str.find(".")+precision+1);
-    displaytime_str = std::to_string(displaytime*1000);
-    displaytime_str = displaytime_str.substr(0, displaytime_str.find(".")+precision+1);
-    frametime_str = std::to_string(frametime*1000);
-    frametime_str = frametime_str.substr(0, frametime_str.find(".")+precision+1);
-    
-    fps_str = std::string("FPS: ").append(std::to_string((int)(1/frametime))).append(std::string("     "));
-    rendertime_str = std::string("Render: ").append(rendertime_str).append(std::string("ms  "));
-    displaytime_str = std::string("Display: ").append(displaytime_str).append(std::string("ms  "));
-    frametime_str = std::string("Frame: ").append(frametime_str).append(std::string("ms  "));
+    snprintf(fps_str, sizeof(fps_str), "FPS: %d     ", (int)(1/frametime));
+    snprintf(rendertime_str, sizeof(rendertime_str), "Render: %.*fms  ", precision, rendertime*1000);
+    snprintf(displaytime_str, sizeof(displaytime_str), "Display: %.*fms  ", precision, displaytime*1000);
+    snprintf(frametime_str, sizeof(frametime_str), "Frame: %.*fms  ", precision, frametime*1000);
   }
   // write stats to the framebuffer
-  for (int i=0; i<fps_str.length(); i++) {
+  for (int i=0; fps_str[i]; i++) {
     pixels[i] = fps_str[i];
   }
-  for (int i=0; i<frametime_str.length(); i++) {
+  for (int i=0; frametime_str[i]; i++) {
     pixels[*window_width+i] = frametime_str[i];
   }
-  for (int i=0; i<rendertime_str.length(); i++) {
+  for (int i=0; rendertime_str[i]; i++) {
     pixels[(*window_width)*2+i] = rendertime_str[i];
   }
-  for (int i=0; i<displaytime_str.length(); i++) {
+  for (int i=0; displaytime_str[i]; i++) {
     pixels[(*window_width)*3+i] = displaytime_str[i];
   }
+  for (int i=0; resolution_str[i]; i++) {
+    pixels[(*window_width)*4+i] = resolution_str[i];
+  }
+  if (colors) {
+    const char *lines[5] = {fps_str, frametime_str, rendertime_str, displaytime_str, resolution_str};
+    for (int line=0; line<5; line++) {
+      for (int i=0; lines[line][i]; i++) {colors[(*window_width)*line+i] = white;}
+    }
+  }
 }
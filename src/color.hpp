@@ -0,0 +1,51 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include "vector.hpp"
+
+/*
+  Colors for the color output modes of the Window
+
+  A Color is 0xRRGGBB, objects have one (white unless the scene gives them another) and the renderer
+  stores the lit color of every cell next to its character when it is asked to.
+  COLOR_256 sends the closest of the 256 colors xterm has, COLOR_TRUECOLOR sends the 24 bit value
+*/
+typedef uint32_t Color;
+const Color white = 0xFFFFFF;
+
+enum Color_Mode {COLOR_OFF, COLOR_256, COLOR_TRUECOLOR};
+
+inline int color_red(Color c) {return (c >> 16) & 0xFF;}
+inline int color_green(Color c) {return (c >> 8) & 0xFF;}
+inline int color_blue(Color c) {return c & 0xFF;}
+inline Color rgb(int r, int g, int b) {return (Color)r << 16 | (Color)g << 8 | (Color)b;}
+
+// components from 0 to 1, anything outside is clamped
+Color to_color(Vec3f v) {
+  auto channel = [](float f) {return f <= 0.f ? 0 : f >= 1.f ? 255 : (int)(f*255.f + 0.5f);};
+  return rgb(channel(v.x), channel(v.y), channel(v.z));
+}
+
+// brightness from 0 to 1
+inline Color scale_color(Color c, float brightness) {
+  int b = (int)(brightness*256.f);
+  b = b < 0 ? 0 : b > 256 ? 256 : b;
+  return rgb(color_red(c)*b >> 8, color_green(c)*b >> 8, color_blue(c)*b >> 8);
+}
+
+/*
+  Index of the closest color in the xterm palette, either from the 6x6x6 cube (16-231)
+  or from the 24 grays (232-255), the first 16 are left out because every terminal shows them differently
+*/
+int color_256(Color c) {
+  static const int cube_levels[6] = {0, 95, 135, 175, 215, 255};
+  int r = color_red(c), g = color_green(c), b = color_blue(c);
+  auto cube_index = [](int v) {return v < 48 ? 0 : v < 115 ? 1 : (v-35) / 40;};
+  int ri = cube_index(r), gi = cube_index(g), bi = cube_index(b);
+  int cr = cube_levels[ri], cg = cube_levels[gi], cb = cube_levels[bi];
+  int gray_index = std::min(23, std::max(0, ((r+g+b)/3 - 3) / 10));
+  int gray = 8 + gray_index*10;
+  auto distance = [r, g, b](int r2, int g2, int b2) {return (r-r2)*(r-r2) + (g-g2)*(g-g2) + (b-b2)*(b-b2);};
+  if (distance(gray, gray, gray) < distance(cr, cg, cb)) {return 232 + gray_index;}
+  return 16 + 36*ri + 6*gi + bi;
+}
@@ -0,0 +1,658 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "vector.hpp"
+#include "ray.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "flat_array.hpp"
+#include "scene.hpp"
+#include "transform.hpp"
+#include "profiler.hpp"
+
+/*
+  Flattened copy of an Object_List, this is what the renderer traverses
+
+  The object classes in scene.hpp are nice for building a scene, but every intersection with them is
+  a virtual call on an object somewhere on the heap. Compiled_Scene copies every primitive into one array
+  per primitive type, stored as structure of arrays, and builds one BVH over all of them.
+  A primitive is referenced by its type and its index in the array of that type, so the right intersection
+  function is picked by a switch and called directly instead of through the vtable.
+  Objects that are made out of primitives (Cube, Triangle_Mesh) are split up into them,
+  objects of any other type are kept as Object* and are still called virtually.
+
+  An Instance is one primitive that stands for a whole other Compiled_Scene (its model) moved by a transform,
+  so the scene has two levels of BVHs: the one over the primitives of the scene and the ones of the models.
+  Moving an instance only changes its own entry, update_instances() refits the top level for that.
+*/
+enum Primitive_Type {SPHERE, TRIANGLE, MESH_TRIANGLE, PLANE, BOX, INSTANCE, OTHER};
+
+struct Primitive_Ref {
+  uint32_t type : 4;
+  uint32_t index : 28;
+};
+
+/*
+  One array per primitive type
+
+  hit() only finds the distance of the intersection, finalize() fills in the rest of the
+  intersection information and is only called for the closest hit of a ray
+*/
+struct Sphere_Array {
+  Flat_Array<float> center_x, center_y, center_z, radius;
+  Flat_Array<char> reflective;
+  template <typename Visit> void arrays(Visit& visit) {visit(center_x); visit(center_y); visit(center_z); visit(radius); visit(reflective);};
+  int size() {return radius.size();};
+  void add(Sphere *sphere);
+  Vec3f center(int i) {return Vec3f(center_x[i], center_y[i], center_z[i]);};
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int i);
+};
+
+// triangles with precomputed edges and normal, see ray_triangle() in scene.hpp
+struct Triangle_Array {
+  Flat_Array<float> p1_x, p1_y, p1_z;
+  Flat_Array<float> edge1_x, edge1_y, edge1_z, edge2_x, edge2_y, edge2_z;
+  Flat_Array<float> normal_x, normal_y, normal_z;
+  Flat_Array<char> reflective;
+  template <typename Visit> void arrays(Visit& visit) {
+    visit(p1_x); visit(p1_y); visit(p1_z);
+    visit(edge1_x); visit(edge1_y); visit(edge1_z); visit(edge2_x); visit(edge2_y); visit(edge2_z);
+    visit(normal_x); visit(normal_y); visit(normal_z); visit(reflective);
+  };
+  int size() {return reflective.size();};
+  void add(Triangle *triangle);
+  Vec3f p1(int i) {return Vec3f(p1_x[i], p1_y[i], p1_z[i]);};
+  Vec3f edge1(int i) {return Vec3f(edge1_x[i], edge1_y[i], edge1_z[i]);};
+  Vec3f edge2(int i) {return Vec3f(edge2_x[i], edge2_y[i], edge2_z[i]);};
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int i);
+};
+
+// triangles of Triangle_Meshes, they only store indices into the shared vertex arrays
+struct Mesh_Triangle_Array {
+  Flat_Array<float> vertex_x, vertex_y, vertex_z;
+  Flat_Array<int> v1, v2, v3;
+  Flat_Array<char> reflective;
+  template <typename Visit> void arrays(Visit& visit) {
+    visit(vertex_x); visit(vertex_y); visit(vertex_z); visit(v1); visit(v2); visit(v3); visit(reflective);
+  };
+  int size() {return v1.size();};
+  void add(Triangle_Mesh *mesh);
+  Vec3f vertex(int v) {return Vec3f(vertex_x[v], vertex_y[v], vertex_z[v]);};
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int i);
+};
+
+// checkerboard planes
+struct Plane_Array {
+  Flat_Array<float> normal_x, normal_y, normal_z, d;
+  template <typename Visit> void arrays(Visit& visit) {visit(normal_x); visit(normal_y); visit(normal_z); visit(d);};
+  int size() {return d.size();};
+  void add(Checkerboard *checkerboard);
+  Vec3f normal(int i) {return Vec3f(normal_x[i], normal_y[i], normal_z[i]);};
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int /*i*/) {return AABB::infinite();};
+};
+
+// axis aligned boxes (Cube2)
+struct Box_Array {
+  Flat_Array<float> min_x, min_y, min_z, max_x, max_y, max_z;
+  template <typename Visit> void arrays(Visit& visit) {visit(min_x); visit(min_y); visit(min_z); visit(max_x); visit(max_y); visit(max_z);};
+  int size() {return min_x.size();};
+  void add(Cube2 *cube);
+  Vec3f bound_min(int i) {return Vec3f(min_x[i], min_y[i], min_z[i]);};
+  Vec3f bound_max(int i) {return Vec3f(max_x[i], max_y[i], max_z[i]);};
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int i) {return AABB(bound_min(i), bound_max(i));};
+};
+
+class Compiled_Scene;
+class Instance;
+
+/*
+  Instances of models, every model is only stored once (with its own BVH) however many instances use it,
+  an instance itself is just the index of its model and its transforms.
+  A ray is moved into the space of the model instead of moving the model into the scene
+*/
+struct Instance_Array {
+  Flat_Array<int> model;                    // index into models
+  Flat_Array<Transform> to_world, to_model;
+  std::vector<Compiled_Scene*> models;
+  std::vector<AABB> model_bounds;           // bounds of every model in its own space
+  std::vector<Instance*> sources;           // the objects the transforms are copied from
+  int size() {return model.size();};
+  void add(Instance *instance);
+  // copies the transform of instance i again after it moved
+  void update(int i);
+  bool hit(int i, Ray *ray, float max_t, float *t);
+  void finalize(int i, Ray *ray, float t, intersection_information *ii);
+  AABB bounds(int i);
+};
+
+
+class Compiled_Scene : public Object {
+private:
+  Object_List *source;
+  void add(Object *object, Color color);
+  void flatten();
+  // the bounds of every primitive, kept between calls so that refitting every frame doesn't allocate
+  std::vector<AABB> primitive_boxes;
+  // fills primitive_boxes
+  void primitive_bounds();
+public:
+  Sphere_Array spheres;
+  Triangle_Array triangles;
+  Mesh_Triangle_Array mesh_triangles;
+  Plane_Array planes;
+  Box_Array boxes;
+  Instance_Array instances;
+  std::vector<Object*> others;
+  Flat_Array<Primitive_Ref> primitives; // every primitive in the scene, the BVH indexes into this
+  Flat_Array<Color> primitive_colors;   // color of the object every primitive came from, same order as primitives
+  BVH bvh;
+  // goes up whenever something in the scene moves (compile(), refit(), update_instances()), for caches of what depends on it
+  uint64_t geometry_version = 0;
+  // keeps the memory alive that the arrays point into when the scene was loaded from a snapshot (scene_snapshot.hpp)
+  std::shared_ptr<void> snapshot;
+  Compiled_Scene(Object_List *source) : source(source) {compile();};
+  // empty scene without a source, filled in by load_snapshot()
+  Compiled_Scene() : source(nullptr) {};
+  /*
+    Calls visit(array) for every Flat_Array of the scene and its BVH, always in the same order
+  */
+  template <typename Visit> void arrays(Visit& visit);
+  /*
+    Copies all objects of the source Object_List into the arrays and builds the BVH
+  */
+  void compile();
+  /*
+    Copies the objects again after they moved and refits the BVH instead of building a new one,
+    the source Object_List has to contain the same objects in the same order as when it was compiled.
+    Does nothing for a scene that was loaded from a snapshot
+  */
+  void refit();
+  /*
+    Copies the transforms of the instances again and refits the BVH, for scenes in which only instances move.
+    Costs as much as the number of primitives of this scene, the models aren't touched
+  */
+  void update_instances();
+  // index of the closest primitive the ray hits and its distance in t, -1 if there is none
+  int closest_primitive(Ray *ray, float *t);
+  bool intersection(Ray *ray, intersection_information *ii);
+  // occluder is set to the primitive that was hit
+  bool occluded(Ray *ray, float max_t, int *occluder = nullptr);
+  AABB bounds();
+  // functions for a single primitive, primitive is an index into primitives
+  bool primitive_hit(int primitive, Ray *ray, float max_t, float *t);
+  void primitive_finalize(int primitive, Ray *ray, float t, intersection_information *ii);
+  bool intersect_primitive(int primitive, Ray *ray, intersection_information *ii);
+};
+
+/*
+  A model placed into a scene with a transform, the model is a Compiled_Scene that can be shared by any number of instances.
+  Compiled_Scene stores instances in an Instance_Array, call set_transform() and then update_instances() of the scene to move one
+*/
+class Instance : public Object {
+public:
+  Compiled_Scene *model;
+  Transform to_world, to_model;
+  AABB model_bounds; // bounds of the model in its own space
+  Instance(Compiled_Scene *model, Transform transform);
+  void set_transform(Transform transform);
+  bool intersection(Ray *ray, intersection_information *ii);
+  AABB bounds();
+};
+
+
+void Sphere_Array::add(Sphere *sphere) {
+  center_x.push_back(sphere->center.x);
+  center_y.push_back(sphere->center.y);
+  center_z.push_back(sphere->center.z);
+  radius.push_back(sphere->radius);
+  reflective.push_back(sphere->reflective);
+}
+bool Sphere_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  Vec3f c = center(i);
+  float a = dot(ray->direction, ray->direction);
+  float b = 2.f * dot(ray->direction, ray->origin - c);
+  float cc = dot(ray->origin - c, ray->origin - c) - radius[i]*radius[i];
+  float discriminant = b*b - 4.f*a*cc;
+  if (discriminant <= 0.f) {return false;}
+  *t = (-b - sqrtf(discriminant)) / (2.f*a);
+  return *t > ray->min_t && *t < max_t;
+}
+void Sphere_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->normal = (ii->point - center(i)).normalize();
+  ii->reflective_surface = reflective[i];
+}
+AABB Sphere_Array::bounds(int i) {
+  Vec3f r(radius[i], radius[i], radius[i]);
+  return AABB(center(i) - r, center(i) + r);
+}
+
+void Triangle_Array::add(Triangle *triangle) {
+  p1_x.push_back(triangle->p1.x); p1_y.push_back(triangle->p1.y); p1_z.push_back(triangle->p1.z);
+  edge1_x.push_back(triangle->edge1.x); edge1_y.push_back(triangle->edge1.y); edge1_z.push_back(triangle->edge1.z);
+  edge2_x.push_back(triangle->edge2.x); edge2_y.push_back(triangle->edge2.y); edge2_z.push_back(triangle->edge2.z);
+  normal_x.push_back(triangle->normal.x); normal_y.push_back(triangle->normal.y); normal_z.push_back(triangle->normal.z);
+  reflective.push_back(triangle->reflective);
+}
+bool Triangle_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  return ray_triangle(ray, p1(i), edge1(i), edge2(i), max_t, t);
+}
+void Triangle_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->normal = Vec3f(normal_x[i], normal_y[i], normal_z[i]);
+  ii->reflective_surface = reflective[i];
+}
+AABB Triangle_Array::bounds(int i) {
+  AABB box;
+  box.grow(p1(i));
+  box.grow(p1(i) + edge1(i));
+  box.grow(p1(i) + edge2(i));
+  return box;
+}
+
+void Mesh_Triangle_Array::add(Triangle_Mesh *mesh) {
+  int first_vertex = vertex_x.size();
+  for (int i=0; i<(int)mesh->vertices.size(); i++) {
+    vertex_x.push_back(mesh->vertices[i].x);
+    vertex_y.push_back(mesh->vertices[i].y);
+    vertex_z.push_back(mesh->vertices[i].z);
+  }
+  for (int i=0; i<mesh->triangle_count(); i++) {
+    v1.push_back(first_vertex + mesh->indices[3*i]);
+    v2.push_back(first_vertex + mesh->indices[3*i+1]);
+    v3.push_back(first_vertex + mesh->indices[3*i+2]);
+    reflective.push_back(mesh->reflective);
+  }
+}
+bool Mesh_Triangle_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  Vec3f p1 = vertex(v1[i]);
+  return ray_triangle(ray, p1, vertex(v2[i])-p1, vertex(v3[i])-p1, max_t, t);
+}
+void Mesh_Triangle_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  Vec3f p1 = vertex(v1[i]);
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->normal = cross(vertex(v2[i])-p1, vertex(v3[i])-p1).normalize();
+  ii->reflective_surface = reflective[i];
+}
+AABB Mesh_Triangle_Array::bounds(int i) {
+  AABB box;
+  box.grow(vertex(v1[i]));
+  box.grow(vertex(v2[i]));
+  box.grow(vertex(v3[i]));
+  return box;
+}
+
+void Plane_Array::add(Checkerboard *checkerboard) {
+  normal_x.push_back(checkerboard->plane_normal.x);
+  normal_y.push_back(checkerboard->plane_normal.y);
+  normal_z.push_back(checkerboard->plane_normal.z);
+  d.push_back(checkerboard->d);
+}
+bool Plane_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  Vec3f n = normal(i);
+  float denominator = dot(ray->direction, n);
+  if (denominator == 0.f) {return false;}
+  *t = (d[i] - dot(ray->origin, n)) / denominator;
+  if (*t <= ray->min_t || *t >= max_t) {return false;}
+  Vec3f hitpoint = ray->point(*t)/8;
+  // black squares have both coordinates even or both odd
+  return ((int)hitpoint.x % 2 == 0) != ((int)hitpoint.y % 2 == 0);
+}
+void Plane_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->normal = normal(i).normalize();
+  ii->reflective_surface = false;
+}
+
+void Box_Array::add(Cube2 *cube) {
+  min_x.push_back(cube->bound_min.x); min_y.push_back(cube->bound_min.y); min_z.push_back(cube->bound_min.z);
+  max_x.push_back(cube->bound_max.x); max_y.push_back(cube->bound_max.y); max_z.push_back(cube->bound_max.z);
+}
+bool Box_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  Vec3f inverse_direction(1.f/ray->direction.x, 1.f/ray->direction.y, 1.f/ray->direction.z);
+  float t_min = ray->min_t;
+  float t_max = max_t;
+  float t0 = (min_x[i] - ray->origin.x) * inverse_direction.x;
+  float t1 = (max_x[i] - ray->origin.x) * inverse_direction.x;
+  t_min = std::fmax(t_min, std::fmin(t0, t1));
+  t_max = std::fmin(t_max, std::fmax(t0, t1));
+  t0 = (min_y[i] - ray->origin.y) * inverse_direction.y;
+  t1 = (max_y[i] - ray->origin.y) * inverse_direction.y;
+  t_min = std::fmax(t_min, std::fmin(t0, t1));
+  t_max = std::fmin(t_max, std::fmax(t0, t1));
+  t0 = (min_z[i] - ray->origin.z) * inverse_direction.z;
+  t1 = (max_z[i] - ray->origin.z) * inverse_direction.z;
+  t_min = std::fmax(t_min, std::fmin(t0, t1));
+  t_max = std::fmin(t_max, std::fmax(t0, t1));
+  *t = t_min;
+  return t_min < t_max;
+}
+void Box_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->reflective_surface = false;
+  // the normal points along the axis on which the intersection point is furthest from the center
+  Vec3f cti = (ii->point - (bound_min(i) + bound_max(i))*0.5f).normalize();
+  if (std::abs(cti.x) >= std::abs(cti.y) && std::abs(cti.x) >= std::abs(cti.z)) {
+    ii->normal = Vec3f(roundf(cti.x),0.,0.);
+  } else if (std::abs(cti.y) > std::abs(cti.x) && std::abs(cti.y) >= std::abs(cti.z)) {
+    ii->normal = Vec3f(0.,roundf(cti.y),0.);
+  } else {
+    ii->normal = Vec3f(0.,0.,roundf(cti.z));
+  }
+}
+
+// box around a box after it was transformed, the box of its 8 transformed corners
+AABB transformed_bounds(AABB box, Transform *transform) {
+  if (box.is_infinite()) {return box;}
+  AABB result;
+  for (int i=0; i<8; i++) {
+    Vec3f corner(i & 1 ? box.bound_max.x : box.bound_min.x, i & 2 ? box.bound_max.y : box.bound_min.y, i & 4 ? box.bound_max.z : box.bound_min.z);
+    result.grow(transform->apply_point(corner));
+  }
+  return result;
+}
+
+/*
+  The ray in the space of a model, with its direction normalized again.
+  scale is how much longer a distance is there, t in the model is t in the scene times scale
+*/
+Ray model_space_ray(Transform *to_model, Ray *ray, float *scale) {
+  Vec3f direction = to_model->apply_vector(ray->direction);
+  *scale = direction.length();
+  Ray result(to_model->apply_point(ray->origin), direction / *scale);
+  result.min_t = ray->min_t * *scale;
+  result.max_t = ray->max_t * *scale;
+  return result;
+}
+
+// the closest intersection with a model that was moved by the inverse of to_model, ii is in the space of the scene
+bool instance_intersection(Compiled_Scene *model, Transform *to_model, Ray *ray, intersection_information *ii) {
+  float scale;
+  Ray model_ray = model_space_ray(to_model, ray, &scale);
+  intersection_information model_ii;
+  if (!model->intersection(&model_ray, &model_ii)) {return false;}
+  ii->t = model_ii.t / scale;
+  ii->point = ray->point(ii->t);
+  ii->normal = to_model->apply_transposed(model_ii.normal).normalize();
+  ii->reflective_surface = model_ii.reflective_surface;
+  return true;
+}
+
+void Instance_Array::add(Instance *instance) {
+  int index = std::find(models.begin(), models.end(), instance->model) - models.begin();
+  if (index == (int)models.size()) {
+    models.push_back(instance->model);
+    model_bounds.push_back(instance->model_bounds);
+  }
+  model.push_back(index);
+  to_world.push_back(instance->to_world);
+  to_model.push_back(instance->to_model);
+  sources.push_back(instance);
+}
+void Instance_Array::update(int i) {
+  to_world[i] = sources[i]->to_world;
+  to_model[i] = sources[i]->to_model;
+}
+bool Instance_Array::hit(int i, Ray *ray, float max_t, float *t) {
+  float scale;
+  Ray r = model_space_ray(&to_model[i], ray, &scale);
+  r.max_t = max_t * scale;
+  float model_t;
+  if (models[model[i]]->closest_primitive(&r, &model_t) == -1) {return false;}
+  *t = model_t / scale;
+  return *t > ray->min_t && *t < max_t;
+}
+void Instance_Array::finalize(int i, Ray *ray, float t, intersection_information *ii) {
+  // hit() only kept the distance, the model is searched again but only up to a little behind that distance
+  Ray clipped_ray = *ray;
+  clipped_ray.max_t = t*1.0001f + 1e-5f;
+  if (!instance_intersection(models[model[i]], &to_model[i], &clipped_ray, ii)) {
+    // can only happen through rounding, the ray is treated as if it hit head on
+    ii->normal = ray->direction.normalize() * -1.f;
+    ii->reflective_surface = false;
+  }
+  ii->t = t;
+  ii->point = ray->point(t);
+}
+AABB Instance_Array::bounds(int i) {
+  return transformed_bounds(model_bounds[model[i]], &to_world[i]);
+}
+
+
+// color is the color of the object, the triangles of a Cube have their own that is never set
+void Compiled_Scene::add(Object *object, Color color) {
+  Primitive_Ref ref;
+  if (Sphere *sphere = dynamic_cast<Sphere*>(object)) {
+    ref.type = SPHERE;
+    ref.index = spheres.size();
+    spheres.add(sphere);
+  } else if (Triangle *triangle = dynamic_cast<Triangle*>(object)) {
+    ref.type = TRIANGLE;
+    ref.index = triangles.size();
+    triangles.add(triangle);
+  } else if (Checkerboard *checkerboard = dynamic_cast<Checkerboard*>(object)) {
+    ref.type = PLANE;
+    ref.index = planes.size();
+    planes.add(checkerboard);
+  } else if (Cube2 *cube = dynamic_cast<Cube2*>(object)) {
+    ref.type = BOX;
+    ref.index = boxes.size();
+    boxes.add(cube);
+  } else if (Cube *cube = dynamic_cast<Cube*>(object)) {
+    for (int i=0; i<12; i++) {
+      add(&cube->triangles[i], color);
+    }
+    return;
+  } else if (Triangle_Mesh *mesh = dynamic_cast<Triangle_Mesh*>(object)) {
+    ref.type = MESH_TRIANGLE;
+    for (int i=0; i<mesh->triangle_count(); i++) {
+      ref.index = mesh_triangles.size() + i;
+      primitives.push_back(ref);
+      primitive_colors.push_back(color);
+    }
+    mesh_triangles.add(mesh);
+    return;
+  } else if (Instance *instance = dynamic_cast<Instance*>(object)) {
+    ref.type = INSTANCE;
+    ref.index = instances.size();
+    instances.add(instance);
+  } else {
+    ref.type = OTHER;
+    ref.index = others.size();
+    others.push_back(object);
+  }
+  primitives.push_back(ref);
+  primitive_colors.push_back(color);
+}
+
+// copies the objects of the source into the arrays
+void Compiled_Scene::flatten() {
+  spheres = Sphere_Array();
+  triangles = Triangle_Array();
+  mesh_triangles = Mesh_Triangle_Array();
+  planes = Plane_Array();
+  boxes = Box_Array();
+  instances = Instance_Array();
+  others.clear();
+  primitives.clear();
+  primitive_colors.clear();
+  for (int i=0; i<source->n; i++) {
+    add(source->objects[i], source->objects[i]->color);
+  }
+}
+
+void Compiled_Scene::compile() {
+  geometry_version++;
+  flatten();
+  primitive_bounds();
+  bvh.build(primitive_boxes.data(), primitive_boxes.size());
+}
+
+template <typename Visit> void Compiled_Scene::arrays(Visit& visit) {
+  spheres.arrays(visit);
+  triangles.arrays(visit);
+  mesh_triangles.arrays(visit);
+  planes.arrays(visit);
+  boxes.arrays(visit);
+  visit(primitives);
+  visit(primitive_colors);
+  visit(bvh.nodes);
+  visit(bvh.indices);
+  visit(bvh.unbounded);
+}
+
+void Compiled_Scene::refit() {
+  if (!source) {return;}
+  geometry_version++;
+  int primitive_count = primitives.size();
+  flatten();
+  primitive_bounds();
+  if ((int)primitives.size() != primitive_count) {
+    // objects were added or removed, the old tree can't be used anymore
+    bvh.build(primitive_boxes.data(), primitive_boxes.size());
+  } else {
+    bvh.refit(primitive_boxes.data());
+  }
+}
+
+void Compiled_Scene::update_instances() {
+  geometry_version++;
+  for (int i=0; i<instances.size(); i++) {
+    instances.update(i);
+  }
+  primitive_bounds();
+  bvh.refit(primitive_boxes.data());
+}
+
+void Compiled_Scene::primitive_bounds() {
+  // clear() keeps the capacity, only the first call or a bigger scene allocates
+  primitive_boxes.clear();
+  for (int i=0; i<(int)primitives.size(); i++) {
+    Primitive_Ref ref = primitives[i];
+    switch (ref.type) {
+      case SPHERE:        primitive_boxes.push_back(spheres.bounds(ref.index)); break;
+      case TRIANGLE:      primitive_boxes.push_back(triangles.bounds(ref.index)); break;
+      case MESH_TRIANGLE: primitive_boxes.push_back(mesh_triangles.bounds(ref.index)); break;
+      case PLANE:         primitive_boxes.push_back(planes.bounds(ref.index)); break;
+      case BOX:           primitive_boxes.push_back(boxes.bounds(ref.index)); break;
+      case INSTANCE:      primitive_boxes.push_back(instances.bounds(ref.index)); break;
+      default:            primitive_boxes.push_back(others[ref.index]->bounds()); break;
+    }
+  }
+}
+
+bool Compiled_Scene::primitive_hit(int primitive, Ray *ray, float max_t, float *t) {
+  Primitive_Ref ref = primitives[primitive];
+  PROFILE_TEST(ref.type);
+  switch (ref.type) {
+    case SPHERE:        return spheres.hit(ref.index, ray, max_t, t);
+    case TRIANGLE:      return triangles.hit(ref.index, ray, max_t, t);
+    case MESH_TRIANGLE: return mesh_triangles.hit(ref.index, ray, max_t, t);
+    case PLANE:         return planes.hit(ref.index, ray, max_t, t);
+    case BOX:           return boxes.hit(ref.index, ray, max_t, t);
+    case INSTANCE:      return instances.hit(ref.index, ray, max_t, t);
+    default: {
+      intersection_information ii;
+      Ray clipped_ray = *ray;
+      clipped_ray.max_t = max_t;
+      if (!others[ref.index]->intersection(&clipped_ray, &ii)) {return false;}
+      *t = ii.t;
+      return true;
+    }
+  }
+}
+
+void Compiled_Scene::primitive_finalize(int primitive, Ray *ray, float t, intersection_information *ii) {
+  Primitive_Ref ref = primitives[primitive];
+  switch (ref.type) {
+    case SPHERE:        spheres.finalize(ref.index, ray, t, ii); break;
+    case TRIANGLE:      triangles.finalize(ref.index, ray, t, ii); break;
+    case MESH_TRIANGLE: mesh_triangles.finalize(ref.index, ray, t, ii); break;
+    case PLANE:         planes.finalize(ref.index, ray, t, ii); break;
+    case BOX:           boxes.finalize(ref.index, ray, t, ii); break;
+    case INSTANCE:      instances.finalize(ref.index, ray, t, ii); break;
+    default:            others[ref.index]->intersection(ray, ii); break;
+  }
+  ii->primitive = primitive;
+}
+
+bool Compiled_Scene::intersect_primitive(int primitive, Ray *ray, intersection_information *ii) {
+  float t;
+  if (!primitive_hit(primitive, ray, ray->max_t, &t)) {return false;}
+  primitive_finalize(primitive, ray, t, ii);
+  return true;
+}
+
+int Compiled_Scene::closest_primitive(Ray *ray, float *t) {
+  Ray closest_ray = *ray;
+  int closest = -1;
+  bvh.intersection(&closest_ray, [this, &closest](int i, Ray *r) {
+    float t;
+    if (primitive_hit(i, r, r->max_t, &t) && t < r->max_t) {
+      r->max_t = t;
+      closest = i;
+      return true;
+    }
+    return false;
+  });
+  *t = closest_ray.max_t;
+  return closest;
+}
+
+bool Compiled_Scene::intersection(Ray *ray, intersection_information *ii) {
+  float t;
+  int closest = closest_primitive(ray, &t);
+  if (closest == -1) {return false;}
+  primitive_finalize(closest, ray, t, ii);
+  return true;
+}
+
+bool Compiled_Scene::occluded(Ray *ray, float max_t, int *occluder) {
+  Ray clipped_ray = *ray;
+  clipped_ray.max_t = std::fmin(ray->max_t, max_t);
+  return bvh.occluded(&clipped_ray, [this, occluder](int i, Ray *r) {
+    float t;
+    if (!primitive_hit(i, r, r->max_t, &t)) {return false;}
+    if (occluder) {*occluder = i;}
+    return true;
+  });
+}
+
+AABB Compiled_Scene::bounds() {
+  if (!source) {
+    if (!bvh.unbounded.empty()) {return AABB::infinite();}
+    return bvh.nodes.empty() ? AABB() : bvh.nodes[0].bounds;
+  }
+  return source->bounds();
+}
+
+
+Instance::Instance(Compiled_Scene *model, Transform transform) : model(model), model_bounds(model->bounds()) {
+  set_transform(transform);
+}
+void Instance::set_transform(Transform transform) {
+  to_world = transform;
+  to_model = transform.inverse();
+}
+bool Instance::intersection(Ray *ray, intersection_information *ii) {
+  return instance_intersection(model, &to_model, ray, ii);
+}
+AABB Instance::bounds() {
+  return transformed_bounds(model_bounds, &to_world);
+}
@@ -0,0 +1,745 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "compiled_scene.hpp"
+#include "scene_snapshot.hpp"
+#include "renderer.hpp"
+#include "thread_pool.hpp"
+#include "light.hpp"
+#include "color.hpp"
+
+/*
+  Renders frames with worker processes, on this machine or on others
+
+  The coordinator (Distributed_Renderer) sends the Compiled_Scene to every worker once, then for every frame the
+  camera and the lights, and then hands out tiles. A worker renders a tile with its own Renderer and threads and
+  sends the cells back run length encoded (most of a frame are runs of the same character).
+  Every worker holds at most max_in_flight tiles, enough that it doesn't wait for the next one, and fast workers
+  get more tiles because they ask again sooner. Once every tile was handed out, a tile that a worker has had for
+  longer than late_factor times the median time of a tile is also given to an idle worker and whichever
+  result comes first is used. The tiles of a worker that disconnects go to the others.
+
+  Workers are either forked on this machine (spawn_local_workers(), connected through socketpairs) or started
+  anywhere with run_worker() and connected through TCP or a Unix socket (listen_socket(), connect_socket()).
+  Scenes with instances or objects that can't be flattened can't be sent, the same as for snapshots.
+  Antialiasing, temporal and progressive mode need the whole frame and aren't used.
+
+  Every message is a Message_Header followed by size bytes:
+    SCENE   the arrays of the Compiled_Scene, laid out like the array part of a snapshot
+    FRAME   frame number, size, camera, render settings and the lights
+    TILE    frame number, tile number and the cells of the tile
+    RESULT  frame number, tile number, seconds the render took and the encoded cells (and colors)
+    QUIT
+*/
+enum Message_Type {MESSAGE_SCENE, MESSAGE_FRAME, MESSAGE_TILE, MESSAGE_RESULT, MESSAGE_QUIT};
+
+struct Message_Header {
+  uint32_t type;
+  uint32_t size;
+};
+
+const uint32_t max_message_size = 1u << 30;
+
+// a whole message, the header is filled in by send_message()
+struct Message_Writer {
+  std::vector<char> data;
+  Message_Writer(Message_Type type) : data(sizeof(Message_Header)) {
+    Message_Header header = {(uint32_t)type, 0};
+    memcpy(data.data(), &header, sizeof(header));
+  };
+  template <typename T> void put(T value) {put_bytes(&value, sizeof(T));};
+  void put_bytes(const void *bytes, size_t n) {data.insert(data.end(), (const char*)bytes, (const char*)bytes + n);};
+};
+
+// reads the payload of a message, valid turns false when anything is read past the end
+struct Message_Reader {
+  const char *p, *end;
+  bool valid = true;
+  Message_Reader(const char *data, size_t size) : p(data), end(data + size) {};
+  template <typename T> T get() {
+    T value = T();
+    get_bytes(&value, sizeof(T));
+    return value;
+  };
+  void get_bytes(void *bytes, size_t n) {
+    if ((size_t)(end - p) < n) {
+      valid = false;
+      p = end;
+      return;
+    }
+    memcpy(bytes, p, n);
+    p += n;
+  };
+};
+
+// runs of up to 255 equal values, each as a count byte followed by the value
+template <typename T>
+void rle_encode(const T *values, int n, Message_Writer *out) {
+  int i = 0;
+  while (i < n) {
+    int run = 1;
+    while (i+run < n && run < 255 && values[i+run] == values[i]) {run++;}
+    out->put<uint8_t>(run);
+    out->put<T>(values[i]);
+    i += run;
+  }
+}
+template <typename T>
+bool rle_decode(Message_Reader *in, T *values, int n) {
+  int i = 0;
+  while (i < n) {
+    int run = in->get<uint8_t>();
+    T value = in->get<T>();
+    if (!in->valid || run == 0 || run > n-i) {return false;}
+    std::fill(values+i, values+i+run, value);
+    i += run;
+  }
+  return true;
+}
+
+// how long a send to a non blocking socket waits for the other side to read before it gives up on it
+const int send_timeout_ms = 1000;
+
+/*
+  Writes everything, also to non blocking sockets. False when the other side is gone or, on a non blocking socket,
+  hasn't read anything for send_timeout_ms: a worker that hangs but keeps its socket open would otherwise block
+  the coordinator for good once the socket buffer is full
+*/
+bool send_all(int fd, const void *data, size_t size) {
+  const char *p = (const char*)data;
+  while (size > 0) {
+    ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd wait_writable = {fd, POLLOUT, 0};
+      int ready = poll(&wait_writable, 1, send_timeout_ms);
+      if (ready == 0) {return false;}
+      if (ready < 0 && errno != EINTR) {return false;}
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) {continue;}
+    if (sent <= 0) {return false;}
+    p += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool send_message(int fd, Message_Writer *message) {
+  uint32_t size = message->data.size() - sizeof(Message_Header);
+  memcpy(message->data.data() + offsetof(Message_Header, size), &size, sizeof(size));
+  return send_all(fd, message->data.data(), message->data.size());
+}
+
+// blocking, false when the other side is gone or sent something that isn't a message
+bool read_all(int fd, void *data, size_t size) {
+  char *p = (char*)data;
+  while (size > 0) {
+    ssize_t received = read(fd, p, size);
+    if (received < 0 && errno == EINTR) {continue;}
+    if (received <= 0) {return false;}
+    p += received;
+    size -= received;
+  }
+  return true;
+}
+bool receive_message(int fd, Message_Header *header, std::vector<char> *payload) {
+  if (!read_all(fd, header, sizeof(*header)) || header->size > max_message_size) {return false;}
+  payload->resize(header->size);
+  return read_all(fd, payload->data(), header->size);
+}
+
+/*
+  address is host:port for TCP (the host can be left out to listen on every interface)
+  or the path of a Unix socket. Return the socket or -1 and print why
+*/
+int listen_socket(const char *address) {
+  const char *colon = strrchr(address, ':');
+  int fd = -1;
+  if (colon) {
+    std::string host(address, colon - address);
+    addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), colon+1, &hints, &found) != 0) {
+      fprintf(stderr, "%s: unknown address\n", address);
+      return -1;
+    }
+    fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    int yes = 1;
+    if (fd >= 0) {setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));}
+    if (fd >= 0 && bind(fd, found->ai_addr, found->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(found);
+  } else {
+    sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strncpy(local.sun_path, address, sizeof(local.sun_path)-1);
+    unlink(address);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (sockaddr*)&local, sizeof(local)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd < 0 || listen(fd, 64) != 0) {
+    perror(address);
+    if (fd >= 0) {close(fd);}
+    return -1;
+  }
+  return fd;
+}
+
+// tries for timeout seconds, the coordinator might not be listening yet
+int connect_socket(const char *address, double timeout = 10.) {
+  const char *colon = strrchr(address, ':');
+  auto give_up = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+  while (true) {
+    int fd = -1;
+    if (colon) {
+      std::string host(address, colon - address);
+      addrinfo hints, *found;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), colon+1, &hints, &found) == 0) {
+        fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        if (fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) != 0) {
+          close(fd);
+          fd = -1;
+        }
+        freeaddrinfo(found);
+      }
+      int yes = 1;
+      if (fd >= 0) {setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));}
+    } else {
+      sockaddr_un local;
+      memset(&local, 0, sizeof(local));
+      local.sun_family = AF_UNIX;
+      strncpy(local.sun_path, address, sizeof(local.sun_path)-1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, (sockaddr*)&local, sizeof(local)) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (fd >= 0) {return fd;}
+    if (std::chrono::steady_clock::now() > give_up) {
+      perror(address);
+      return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+// the camera, settings and lights of a FRAME message
+struct Frame_Settings {
+  int frame = 0;
+  int width = 0, height = 0;
+  bool packet_tracing = false, with_colors = false, cache_lighting = false;
+  int max_reflection_depth = 8, shadow_depth = 2;
+  float pixel_aspect = 1.f;
+  Camera camera = Camera(Vec3f(), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), 75);
+  std::vector<Light> lights;
+};
+
+void write_frame(Message_Writer *message, Frame_Settings *frame) {
+  message->put<int32_t>(frame->frame);
+  message->put<int32_t>(frame->width);
+  message->put<int32_t>(frame->height);
+  message->put<uint8_t>(frame->packet_tracing);
+  message->put<uint8_t>(frame->with_colors);
+  message->put<uint8_t>(frame->cache_lighting);
+  message->put<int32_t>(frame->max_reflection_depth);
+  message->put<int32_t>(frame->shadow_depth);
+  message->put<float>(frame->pixel_aspect);
+  message->put<Vec3f>(frame->camera.view_point);
+  message->put<Vec3f>(frame->camera.view_direction);
+  message->put<Vec3f>(frame->camera.view_up);
+  message->put<int32_t>(frame->camera.FOV);
+  message->put<uint32_t>(frame->lights.size());
+  // the lights are sent as they are in memory, like in snapshots
+  message->put_bytes(frame->lights.data(), frame->lights.size()*sizeof(Light));
+}
+bool read_frame(Message_Reader *in, Frame_Settings *frame) {
+  frame->frame = in->get<int32_t>();
+  frame->width = in->get<int32_t>();
+  frame->height = in->get<int32_t>();
+  frame->packet_tracing = in->get<uint8_t>();
+  frame->with_colors = in->get<uint8_t>();
+  frame->cache_lighting = in->get<uint8_t>();
+  frame->max_reflection_depth = in->get<int32_t>();
+  frame->shadow_depth = in->get<int32_t>();
+  frame->pixel_aspect = in->get<float>();
+  // set directly, normalizing the vectors again could change the last bit and the picture with it
+  frame->camera.view_point = in->get<Vec3f>();
+  frame->camera.view_direction = in->get<Vec3f>();
+  frame->camera.view_up = in->get<Vec3f>();
+  frame->camera.FOV = in->get<int32_t>();
+  uint32_t light_count = in->get<uint32_t>();
+  if (!in->valid || light_count > (size_t)(in->end - in->p) / sizeof(Light)) {return false;}
+  frame->lights.resize(light_count);
+  in->get_bytes(frame->lights.data(), light_count*sizeof(Light));
+  return in->valid && frame->width > 0 && frame->height > 0 && frame->width <= 1<<16 && frame->height <= 1<<16;
+}
+
+// the cells of a tile, from (x0,y0) up to but not including (x1,y1)
+struct Tile_Bounds {
+  int x0, y0, x1, y1;
+  int cells() {return (x1-x0)*(y1-y0);};
+};
+
+/*
+  What a worker process does: renders the tiles the coordinator on fd asks for until it says QUIT
+  or disconnects. threads is the size of the thread pool of the worker. Returns the exit code
+*/
+int run_worker(int fd, int threads) {
+  std::unique_ptr<Compiled_Scene> scene;
+  std::unique_ptr<Renderer> renderer;
+  Frame_Settings frame;
+  std::vector<char> pixels, tile_pixels;
+  std::vector<Color> colors, tile_colors;
+  Message_Header header;
+  std::vector<char> payload;
+  while (receive_message(fd, &header, &payload)) {
+    Message_Reader in(payload.data(), payload.size());
+    if (header.type == MESSAGE_QUIT) {
+      close(fd);
+      return 0;
+    } else if (header.type == MESSAGE_SCENE) {
+      // the arrays of the scene point straight into the message, it stays alive as long as the scene
+      std::shared_ptr<std::vector<char>> data = std::make_shared<std::vector<char>>();
+      data->swap(payload);
+      scene.reset(new Compiled_Scene());
+      Snapshot_Counter counter;
+      scene->arrays(counter);
+      Message_Reader sections(data->data(), data->size());
+      uint64_t section_count = sections.get<uint64_t>();
+      if (!sections.valid || section_count != counter.count || data->size() < sizeof(uint64_t) + section_count*sizeof(Snapshot_Section)) {break;}
+      Snapshot_Reader reader;
+      reader.file = data->data();
+      reader.file_size = data->size();
+      reader.sections = (const Snapshot_Section*)(data->data() + sizeof(uint64_t));
+      scene->arrays(reader);
+      if (!reader.valid || !snapshot_consistent(scene.get())) {break;}
+      scene->snapshot = data;
+    } else if (header.type == MESSAGE_FRAME) {
+      if (!read_frame(&in, &frame)) {break;}
+      if (!renderer) {renderer.reset(new Renderer(frame.width, frame.height, true));}
+      if (pixels.size() != (size_t)frame.width*frame.height || renderer->window_width != frame.width) {
+        // the terminal was resized or the resolution changed, resizing keeps the lighting cache
+        renderer->resize(frame.width, frame.height);
+        pixels.assign(frame.width*frame.height, ' ');
+        colors.assign(frame.width*frame.height, 0);
+      }
+      renderer->packet_tracing = frame.packet_tracing;
+      renderer->cache_lighting = frame.cache_lighting;
+      renderer->max_reflection_depth = frame.max_reflection_depth;
+      renderer->shadow_depth = frame.shadow_depth;
+      renderer->pixel_aspect = frame.pixel_aspect;
+    } else if (header.type == MESSAGE_TILE) {
+      int frame_number = in.get<int32_t>();
+      int tile = in.get<int32_t>();
+      Tile_Bounds bounds = in.get<Tile_Bounds>();
+      if (!in.valid || !scene || !renderer || bounds.x0 < 0 || bounds.y0 < 0 || bounds.x1 > frame.width ||
+          bounds.y1 > frame.height || bounds.x0 >= bounds.x1 || bounds.y0 >= bounds.y1) {
+        break;
+      }
+      auto t_start = std::chrono::steady_clock::now();
+      renderer->render_region(scene.get(), &frame.camera, &frame.lights, pixels.data(), threads,
+                              bounds.x0, bounds.y0, bounds.x1, bounds.y1, frame.with_colors ? colors.data() : nullptr);
+      float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - t_start).count();
+      // the rows of the tile one after another
+      tile_pixels.clear();
+      tile_colors.clear();
+      for (int y=bounds.y0; y<bounds.y1; y++) {
+        tile_pixels.insert(tile_pixels.end(), pixels.begin() + y*frame.width + bounds.x0, pixels.begin() + y*frame.width + bounds.x1);
+        tile_colors.insert(tile_colors.end(), colors.begin() + y*frame.width + bounds.x0, colors.begin() + y*frame.width + bounds.x1);
+      }
+      Message_Writer result(MESSAGE_RESULT);
+      result.put<int32_t>(frame_number);
+      result.put<int32_t>(tile);
+      result.put<float>(seconds);
+      rle_encode(tile_pixels.data(), bounds.cells(), &result);
+      if (frame.with_colors) {rle_encode(tile_colors.data(), bounds.cells(), &result);}
+      if (!send_message(fd, &result)) {break;}
+    } else {
+      break;
+    }
+  }
+  close(fd);
+  return 1;
+}
+
+
+class Distributed_Renderer {
+private:
+  struct Worker {
+    int fd;
+    pid_t pid;                                 // of a forked worker, 0 for workers that connected
+    bool alive;
+    std::vector<char> input;                   // received bytes that aren't a whole message yet
+    std::vector<std::pair<int, int>> in_flight; // frame and tile of everything the worker still has to send
+  };
+  struct Tile_State {
+    bool done;
+    bool late;       // was handed out a second time
+    int copies;      // workers that have it right now
+    double assigned; // when it was first handed out
+  };
+  std::vector<Worker> workers;
+  std::vector<Tile_State> tiles;
+  std::vector<double> tile_times;   // seconds from handing out to result of the finished tiles of this frame
+  std::vector<double> sorted_times; // scratch for the median
+  std::vector<char> tile_pixels;    // a result decoded before it is copied into the frame
+  std::vector<Color> tile_colors;
+  std::vector<pollfd> poll_fds;
+  std::vector<int> poll_workers;    // worker of every entry in poll_fds
+  double last_median = 0;           // median tile time of the last frame, used until this one has results
+  int tiles_x = 0, tiles_y = 0;
+  int done_count = 0;
+  char *frame_pixels = nullptr;
+  Color *frame_colors = nullptr;
+  Frame_Settings settings;
+  Tile_Bounds tile_bounds(int tile);
+  void assign(int worker, int tile, double now);
+  // a tile that worker should take although it was handed out already, -1 if there is none
+  int late_tile(int worker, double now);
+  // reads what arrived from a worker, false when it is gone or sent something wrong
+  bool receive(int worker, double now);
+  bool handle_result(int worker, Message_Reader *in, double now);
+  void drop(int worker);
+public:
+  int width, height;
+  int tile_width = 64, tile_height = 8;
+  int max_in_flight = 2;
+  float late_factor = 3.f;
+  // sent to the workers with every frame
+  bool packet_tracing = false, cache_lighting = false;
+  int max_reflection_depth = 8, shadow_depth = 2;
+  float pixel_aspect = 1.f;
+  // for the last frame, one entry per worker: seconds it rendered, tiles of it that were used and
+  // how many of those were late tiles it took over
+  std::vector<Worker_Stats> stats;
+  int late_tiles = 0;              // tiles handed out a second time in the last frame
+  uint64_t bytes_received = 0;     // encoded cells of every result
+  uint64_t bytes_uncompressed = 0; // what they would have been without encoding
+  Distributed_Renderer(int width, int height) : width(width), height(height) {};
+  ~Distributed_Renderer() {finish();};
+  // fd is connected to a worker, pid is the process of a worker that was forked
+  void add_worker(int fd, pid_t pid = 0);
+  // forks count workers with threads threads each, returns how many were started
+  int spawn_local_workers(int count, int threads);
+  // waits for count workers to connect to listen_fd
+  int accept_workers(int listen_fd, int count);
+  int worker_count();
+  // has to be called before the first render(), false if the scene can't be sent
+  bool send_scene(Compiled_Scene *scene);
+  // false when there are no workers left
+  bool render(Camera *camera, std::vector<Light> *lights, char *pixels, Color *colors = nullptr);
+  // tells the workers to quit and waits for the forked ones
+  void finish();
+};
+
+void Distributed_Renderer::add_worker(int fd, pid_t pid) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  Worker worker;
+  worker.fd = fd;
+  worker.pid = pid;
+  worker.alive = true;
+  workers.push_back(worker);
+}
+
+int Distributed_Renderer::spawn_local_workers(int count, int threads) {
+  int started = 0;
+  for (int i=0; i<count; i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {break;}
+    pid_t pid = fork();
+    if (pid == 0) {
+      // the child only needs its own end, _exit() doesn't flush stdio buffers it inherited
+      close(fds[0]);
+      for (auto& worker : workers) {close(worker.fd);}
+      _exit(run_worker(fds[1], threads));
+    }
+    close(fds[1]);
+    if (pid < 0) {
+      close(fds[0]);
+      break;
+    }
+    add_worker(fds[0], pid);
+    started++;
+  }
+  return started;
+}
+
+int Distributed_Renderer::accept_workers(int listen_fd, int count) {
+  int accepted = 0;
+  while (accepted < count) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) {continue;}
+      break;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // fails harmlessly on Unix sockets
+    add_worker(fd);
+    accepted++;
+  }
+  return accepted;
+}
+
+int Distributed_Renderer::worker_count() {
+  int count = 0;
+  for (auto& worker : workers) {count += worker.alive;}
+  return count;
+}
+
+bool Distributed_Renderer::send_scene(Compiled_Scene *scene) {
+  if (!snapshot_supported(scene)) {return false;}
+  // the same layout as the arrays of a snapshot: section count, sections, then the arrays at multiples of 64 bytes
+  Snapshot_Counter counter;
+  scene->arrays(counter);
+  Snapshot_Writer writer;
+  writer.offset = sizeof(uint64_t) + counter.count*sizeof(Snapshot_Section);
+  scene->arrays(writer);
+  Message_Writer message(MESSAGE_SCENE);
+  message.put<uint64_t>(counter.count);
+  message.put_bytes(writer.sections.data(), writer.sections.size()*sizeof(Snapshot_Section));
+  for (size_t i=0; i<writer.data.size(); i++) {
+    message.data.resize(sizeof(Message_Header) + writer.sections[i].offset, 0);
+    message.put_bytes(writer.data[i].first, writer.data[i].second);
+  }
+  for (int i=0; i<(int)workers.size(); i++) {
+    if (workers[i].alive && !send_message(workers[i].fd, &message)) {drop(i);}
+  }
+  return worker_count() > 0;
+}
+
+Tile_Bounds Distributed_Renderer::tile_bounds(int tile) {
+  Tile_Bounds bounds;
+  bounds.x0 = (tile % tiles_x) * tile_width;
+  bounds.y0 = (tile / tiles_x) * tile_height;
+  bounds.x1 = std::min(bounds.x0 + tile_width, width);
+  bounds.y1 = std::min(bounds.y0 + tile_height, height);
+  return bounds;
+}
+
+void Distributed_Renderer::assign(int worker, int tile, double now) {
+  Message_Writer message(MESSAGE_TILE);
+  message.put<int32_t>(settings.frame);
+  message.put<int32_t>(tile);
+  message.put<Tile_Bounds>(tile_bounds(tile));
+  if (!send_message(workers[worker].fd, &message)) {
+    drop(worker);
+    return;
+  }
+  Tile_State *state = &tiles[tile];
+  if (state->assigned < 0) {
+    state->assigned = now;
+  } else {
+    state->late = true;
+    late_tiles++;
+  }
+  state->copies++;
+  workers[worker].in_flight.push_back(std::make_pair(settings.frame, tile));
+}
+
+int Distributed_Renderer::late_tile(int worker, double now) {
+  double median = last_median;
+  if (!tile_times.empty()) {
+    sorted_times.assign(tile_times.begin(), tile_times.end());
+    std::nth_element(sorted_times.begin(), sorted_times.begin() + sorted_times.size()/2, sorted_times.end());
+    median = sorted_times[sorted_times.size()/2];
+  }
+  int best = -1;
+  for (int i=0; i<(int)tiles.size(); i++) {
+    Tile_State *state = &tiles[i];
+    if (state->done || state->assigned < 0) {continue;}
+    // a tile nobody has anymore (its worker disconnected) is taken right away
+    bool orphaned = state->copies == 0;
+    bool late = median > 0 && state->copies < 2 && now - state->assigned > late_factor*median;
+    if (!orphaned && !late) {continue;}
+    auto& in_flight = workers[worker].in_flight;
+    if (std::find(in_flight.begin(), in_flight.end(), std::make_pair(settings.frame, i)) != in_flight.end()) {continue;}
+    if (orphaned) {return i;}
+    if (best == -1 || state->assigned < tiles[best].assigned) {best = i;}
+  }
+  return best;
+}
+
+bool Distributed_Renderer::render(Camera *camera, std::vector<Light> *lights, char *pixels, Color *colors) {
+  PROFILE_SCOPE("distributed render");
+  settings.frame++;
+  settings.width = width;
+  settings.height = height;
+  settings.packet_tracing = packet_tracing;
+  settings.cache_lighting = cache_lighting;
+  settings.with_colors = colors != nullptr;
+  settings.max_reflection_depth = max_reflection_depth;
+  settings.shadow_depth = shadow_depth;
+  settings.pixel_aspect = pixel_aspect;
+  settings.camera = *camera;
+  settings.lights = *lights;
+  frame_pixels = pixels;
+  frame_colors = colors;
+  Message_Writer message(MESSAGE_FRAME);
+  write_frame(&message, &settings);
+  for (int i=0; i<(int)workers.size(); i++) {
+    if (workers[i].alive && !send_message(workers[i].fd, &message)) {drop(i);}
+  }
+
+  tiles_x = (width + tile_width-1) / tile_width;
+  tiles_y = (height + tile_height-1) / tile_height;
+  Tile_State unassigned = {false, false, 0, -1.};
+  tiles.assign(tiles_x*tiles_y, unassigned);
+  tile_times.clear();
+  stats.assign(workers.size(), Worker_Stats());
+  late_tiles = 0;
+  done_count = 0;
+  int next_tile = 0;
+  auto t_start = std::chrono::steady_clock::now();
+  while (done_count < (int)tiles.size()) {
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    poll_fds.clear();
+    poll_workers.clear();
+    for (int i=0; i<(int)workers.size(); i++) {
+      Worker *worker = &workers[i];
+      while (worker->alive && (int)worker->in_flight.size() < max_in_flight) {
+        int tile = next_tile < (int)tiles.size() ? next_tile++ : late_tile(i, now);
+        if (tile == -1) {break;}
+        assign(i, tile, now);
+      }
+      if (worker->alive) {
+        pollfd entry = {worker->fd, POLLIN, 0};
+        poll_fds.push_back(entry);
+        poll_workers.push_back(i);
+      }
+    }
+    if (poll_fds.empty()) {return false;}
+    // wakes up every millisecond to look for late tiles
+    if (poll(poll_fds.data(), poll_fds.size(), 1) <= 0) {continue;}
+    now = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    for (size_t i=0; i<poll_fds.size(); i++) {
+      if (poll_fds[i].revents && !receive(poll_workers[i], now)) {drop(poll_workers[i]);}
+    }
+  }
+  if (!tile_times.empty()) {
+    std::nth_element(tile_times.begin(), tile_times.begin() + tile_times.size()/2, tile_times.end());
+    last_median = tile_times[tile_times.size()/2];
+  }
+  return true;
+}
+
+bool Distributed_Renderer::receive(int worker, double now) {
+  Worker *w = &workers[worker];
+  char buffer[65536];
+  while (true) {
+    ssize_t received = read(w->fd, buffer, sizeof(buffer));
+    if (received < 0 && errno == EINTR) {continue;}
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {break;}
+    if (received <= 0) {return false;}
+    w->input.insert(w->input.end(), buffer, buffer + received);
+  }
+  size_t used = 0;
+  while (w->input.size() - used >= sizeof(Message_Header)) {
+    Message_Header header;
+    memcpy(&header, w->input.data() + used, sizeof(header));
+    if (header.type != MESSAGE_RESULT || header.size > max_message_size) {return false;}
+    if (w->input.size() - used - sizeof(header) < header.size) {break;}
+    Message_Reader in(w->input.data() + used + sizeof(header), header.size);
+    if (!handle_result(worker, &in, now)) {return false;}
+    used += sizeof(header) + header.size;
+  }
+  w->input.erase(w->input.begin(), w->input.begin() + used);
+  return true;
+}
+
+bool Distributed_Renderer::handle_result(int worker, Message_Reader *in, double now) {
+  Worker *w = &workers[worker];
+  int frame = in->get<int32_t>();
+  int tile = in->get<int32_t>();
+  float seconds = in->get<float>();
+  auto sent = std::find(w->in_flight.begin(), w->in_flight.end(), std::make_pair(frame, tile));
+  if (!in->valid || sent == w->in_flight.end()) {return false;}
+  w->in_flight.erase(sent);
+  // a tile of an earlier frame that was finished by someone else
+  if (frame != settings.frame) {return true;}
+  stats[worker].busy_time += seconds;
+  Tile_State *state = &tiles[tile];
+  state->copies--;
+  if (state->done) {return true;}
+  Tile_Bounds bounds = tile_bounds(tile);
+  int cells = bounds.cells();
+  int row_length = bounds.x1 - bounds.x0;
+  const char *encoded_start = in->p;
+  tile_pixels.resize(cells);
+  if (!rle_decode(in, tile_pixels.data(), cells)) {return false;}
+  for (int y=bounds.y0; y<bounds.y1; y++) {
+    std::copy(tile_pixels.begin() + (y-bounds.y0)*row_length, tile_pixels.begin() + (y-bounds.y0+1)*row_length, frame_pixels + y*width + bounds.x0);
+  }
+  if (frame_colors) {
+    tile_colors.resize(cells);
+    if (!rle_decode(in, tile_colors.data(), cells)) {return false;}
+    for (int y=bounds.y0; y<bounds.y1; y++) {
+      std::copy(tile_colors.begin() + (y-bounds.y0)*row_length, tile_colors.begin() + (y-bounds.y0+1)*row_length, frame_colors + y*width + bounds.x0);
+    }
+  }
+  bytes_received += in->p - encoded_start;
+  bytes_uncompressed += cells * (frame_colors ? 1 + sizeof(Color) : 1);
+  state->done = true;
+  done_count++;
+  tile_times.push_back(now - state->assigned);
+  stats[worker].tasks++;
+  if (state->late) {stats[worker].stolen++;}
+  return true;
+}
+
+void Distributed_Renderer::drop(int worker) {
+  Worker *w = &workers[worker];
+  if (!w->alive) {return;}
+  close(w->fd);
+  w->alive = false;
+  for (auto& sent : w->in_flight) {
+    if (sent.first == settings.frame && sent.second < (int)tiles.size()) {tiles[sent.second].copies--;}
+  }
+  w->in_flight.clear();
+  fprintf(stderr, "distributed: lost worker %d, %d left\n", worker, worker_count());
+}
+
+void Distributed_Renderer::finish() {
+  for (auto& worker : workers) {
+    if (!worker.alive) {continue;}
+    Message_Writer quit(MESSAGE_QUIT);
+    send_message(worker.fd, &quit);
+    close(worker.fd);
+    worker.alive = false;
+  }
+  for (auto& worker : workers) {
+    if (worker.pid > 0) {waitpid(worker.pid, nullptr, 0);}
+  }
+  workers.clear();
+}
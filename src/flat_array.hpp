@@ -0,0 +1,109 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+/*
+  Array of plain data that either owns its elements (then it works like a std::vector)
+  or points at elements somewhere else, like a scene snapshot that was mapped into memory.
+
+  The scene arrays and the BVH use this so that a snapshot can be used directly without copying it.
+  Elements that are not owned are read only, changing the array (push_back(), clear(), ...)
+  makes it own a copy of them first
+*/
+template <typename T>
+class Flat_Array {
+private:
+  std::vector<T> owned;
+  T *items = nullptr;
+  size_t count = 0;
+  bool external = false;
+  void own();
+public:
+  Flat_Array() {};
+  Flat_Array(const Flat_Array& other);
+  Flat_Array& operator=(const Flat_Array& other);
+  // makes the array use count elements at items without copying them, they have to stay valid as long as the array uses them
+  void attach(const T *items, size_t count);
+  bool is_attached() const {return external;};
+  T& operator[](size_t i) {return items[i];};
+  const T& operator[](size_t i) const {return items[i];};
+  size_t size() const {return count;};
+  bool empty() const {return count == 0;};
+  T *data() {return items;};
+  const T *data() const {return items;};
+  T *begin() {return items;};
+  T *end() {return items + count;};
+  T& back() {return items[count-1];};
+  void push_back(const T& value);
+  void reserve(size_t n);
+  void resize(size_t n);
+  void clear();
+  void assign(const T *first, const T *last);
+};
+
+template <typename T>
+Flat_Array<T>::Flat_Array(const Flat_Array& other) {
+  *this = other;
+}
+template <typename T>
+Flat_Array<T>& Flat_Array<T>::operator=(const Flat_Array& other) {
+  if (this == &other) {return *this;}
+  external = other.external;
+  count = other.count;
+  if (external) {
+    owned.clear();
+    items = other.items;
+  } else {
+    owned = other.owned;
+    items = owned.data();
+  }
+  return *this;
+}
+template <typename T>
+void Flat_Array<T>::attach(const T *items, size_t count) {
+  owned = std::vector<T>();
+  this->items = const_cast<T*>(items);
+  this->count = count;
+  external = true;
+}
+template <typename T>
+void Flat_Array<T>::own() {
+  if (!external) {return;}
+  owned.assign(items, items + count);
+  items = owned.data();
+  external = false;
+}
+template <typename T>
+void Flat_Array<T>::push_back(const T& value) {
+  own();
+  owned.push_back(value);
+  items = owned.data();
+  count = owned.size();
+}
+template <typename T>
+void Flat_Array<T>::reserve(size_t n) {
+  own();
+  owned.reserve(n);
+  items = owned.data();
+}
+template <typename T>
+void Flat_Array<T>::resize(size_t n) {
+  own();
+  owned.resize(n);
+  items = owned.data();
+  count = n;
+}
+template <typename T>
+void Flat_Array<T>::clear() {
+  owned.clear();
+  external = false;
+  items = owned.data();
+  count = 0;
+}
+template <typename T>
+void Flat_Array<T>::assign(const T *first, const T *last) {
+  external = false;
+  owned.assign(first, last);
+  items = owned.data();
+  count = owned.size();
+}
@@ -0,0 +1,213 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "color.hpp"
+#include "window.hpp"
+
+/*
+  Ring of at most capacity items between exactly one producer thread and one consumer thread
+
+  push() and pop() never lock, each side only writes its own index and reads the other one,
+  the release store of an index makes the slot it covers visible to the other side
+*/
+template <typename T>
+class Spsc_Ring {
+private:
+  std::vector<T> slots;
+  alignas(64) std::atomic<size_t> head; // next slot pop() reads, only written by the consumer
+  alignas(64) std::atomic<size_t> tail; // next slot push() writes, only written by the producer
+public:
+  Spsc_Ring(size_t capacity) : slots(capacity), head(0), tail(0) {};
+  bool push(T item);
+  bool pop(T *item);
+  // only meaningful on the consumer side, the producer may push right after
+  bool empty() {return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);};
+};
+
+template <typename T>
+bool Spsc_Ring<T>::push(T item) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  if (t - head.load(std::memory_order_acquire) == slots.size()) {return false;}
+  slots[t % slots.size()] = item;
+  tail.store(t+1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool Spsc_Ring<T>::pop(T *item) {
+  size_t h = head.load(std::memory_order_relaxed);
+  if (h == tail.load(std::memory_order_acquire)) {return false;}
+  *item = slots[h % slots.size()];
+  head.store(h+1, std::memory_order_release);
+  return true;
+}
+
+// everything display() needs of one frame
+struct Frame_Buffer {
+  std::vector<char> pixels;
+  std::vector<Color> colors; // empty without a color mode
+  Color *color_data() {return colors.empty() ? nullptr : colors.data();};
+};
+
+/*
+  Lets the next frame be rendered while the last one is still being written to the terminal
+
+  There are depth frame buffers. The render loop takes a free one with acquire(), renders into it and hands it
+  over with submit(), an output thread displays the submitted frames in order and gives the buffers back.
+  Both hand overs go through a Spsc_Ring, so the two threads never lock while frames are coming, a side that has
+  to wait sleeps in growing steps. An output thread that has nothing to display blocks on a condition variable
+  that submit() notifies, so it doesn't wake up thousands of times a second while the render loop waits for the
+  fps limit.
+  depth is the trade between latency and throughput:
+    1  no output thread, submit() displays the frame right away (render and display take turns)
+    2  the next frame is rendered while the last one is displayed, a frame takes max(render, display)
+    3+ rendering can get further ahead, which evens out frames that take longer than others
+       but every frame shows up that much later
+*/
+class Frame_Pipeline {
+private:
+  Window *window;
+  std::vector<Frame_Buffer> buffers;
+  Spsc_Ring<Frame_Buffer*> free_buffers, ready_buffers;
+  std::thread output_thread;
+  std::atomic<bool> stopping;
+  std::atomic<double> display_time; // seconds the last display() took
+  uint64_t submitted = 0;           // only used by the render loop
+  std::atomic<uint64_t> displayed;
+  // the output thread sleeps on these when ready_buffers stays empty
+  std::mutex idle_mutex;
+  std::condition_variable frame_submitted;
+  void output();
+  void wake_output();
+public:
+  int depth;
+  // pixel_count and color_count are the sizes of the buffers of display(), color_count is 0 without colors
+  Frame_Pipeline(Window *window, int depth, size_t pixel_count, size_t color_count);
+  ~Frame_Pipeline() {finish();};
+  // a buffer that isn't being displayed, waits until there is one
+  Frame_Buffer *acquire();
+  void submit(Frame_Buffer *buffer);
+  // waits until every frame that was submitted has been displayed
+  void wait_displayed();
+  // waits until every frame that was submitted has been displayed and gives the buffers the new sizes,
+  // the window isn't used by the output thread again until the next submit()
+  void resize(size_t pixel_count, size_t color_count);
+  // displays everything that was submitted and stops the output thread
+  void finish();
+  double last_display_time() {return display_time.load(std::memory_order_relaxed);};
+};
+
+// short waits without a lock: yields for a while, then sleeps so that a waiting side doesn't keep a core busy,
+// 50us at first and twice as long every 64 waits up to 1ms, so a long wait doesn't wake up all the time either
+inline void pipeline_wait(int *waited) {
+  if (++*waited < 64) {
+    std::this_thread::yield();
+  } else {
+    int doublings = std::min((*waited - 64) / 64, 5);
+    std::this_thread::sleep_for(std::chrono::microseconds(std::min(50 << doublings, 1000)));
+  }
+}
+
+Frame_Pipeline::Frame_Pipeline(Window *window, int depth, size_t pixel_count, size_t color_count) :
+  window(window), buffers(std::max(1, depth)), free_buffers(std::max(1, depth)), ready_buffers(std::max(1, depth)),
+  stopping(false), display_time(0.), displayed(0), depth(std::max(1, depth)) {
+  for (auto& buffer : buffers) {
+    buffer.pixels.assign(pixel_count, ' ');
+    buffer.colors.assign(color_count, 0);
+    free_buffers.push(&buffer);
+  }
+  if (this->depth > 1) {output_thread = std::thread(&Frame_Pipeline::output, this);}
+}
+
+Frame_Buffer *Frame_Pipeline::acquire() {
+  Frame_Buffer *buffer;
+  int waited = 0;
+  while (!free_buffers.pop(&buffer)) {pipeline_wait(&waited);}
+  return buffer;
+}
+
+void Frame_Pipeline::submit(Frame_Buffer *buffer) {
+  submitted++;
+  if (depth == 1) {
+    auto t_start = std::chrono::steady_clock::now();
+    window->display(buffer->pixels.data(), buffer->color_data());
+    display_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-t_start).count();
+    displayed++;
+    free_buffers.push(buffer);
+    return;
+  }
+  // there are only depth buffers, so the ring always has room for one that came from acquire()
+  ready_buffers.push(buffer);
+  wake_output();
+}
+
+void Frame_Pipeline::wake_output() {
+  // taking the lock makes sure the output thread is either still checking the ring or already waiting
+  std::lock_guard<std::mutex> lock(idle_mutex);
+  frame_submitted.notify_one();
+}
+
+void Frame_Pipeline::output() {
+  int waited = 0;
+  while (true) {
+    Frame_Buffer *buffer;
+    if (!ready_buffers.pop(&buffer)) {
+      if (stopping.load(std::memory_order_acquire)) {
+        // stopping is set after the last submit(), once it is seen that frame can be popped too
+        if (!ready_buffers.pop(&buffer)) {return;}
+      } else if (waited < 64) {
+        // the next frame is usually close, spin a little before going to sleep
+        waited++;
+        std::this_thread::yield();
+        continue;
+      } else {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        frame_submitted.wait(lock, [this]() {return !ready_buffers.empty() || stopping.load(std::memory_order_acquire);});
+        continue;
+      }
+    }
+    waited = 0;
+    auto t_start = std::chrono::steady_clock::now();
+    window->display(buffer->pixels.data(), buffer->color_data());
+    display_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-t_start).count();
+    displayed.fetch_add(1, std::memory_order_release);
+    free_buffers.push(buffer);
+  }
+}
+
+void Frame_Pipeline::wait_displayed() {
+  int waited = 0;
+  while (displayed.load(std::memory_order_acquire) < submitted) {pipeline_wait(&waited);}
+}
+
+void Frame_Pipeline::resize(size_t pixel_count, size_t color_count) {
+  // the render loop holds no buffer between frames, once all of them are free again nothing else touches them
+  std::vector<Frame_Buffer*> taken;
+  int waited = 0;
+  while ((int)taken.size() < depth) {
+    Frame_Buffer *buffer;
+    if (free_buffers.pop(&buffer)) {
+      taken.push_back(buffer);
+    } else {
+      pipeline_wait(&waited);
+    }
+  }
+  for (Frame_Buffer *buffer : taken) {
+    buffer->pixels.assign(pixel_count, ' ');
+    buffer->colors.assign(color_count, 0);
+    free_buffers.push(buffer);
+  }
+}
+
+void Frame_Pipeline::finish() {
+  if (!output_thread.joinable()) {return;}
+  stopping.store(true, std::memory_order_release);
+  wake_output();
+  output_thread.join();
+}
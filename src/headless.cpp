@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "scenes.hpp"
+#include "scene_loader.hpp"
+#include "scene_snapshot.hpp"
+#include "renderer.hpp"
+#include "window.hpp"
+#include "frame_pipeline.hpp"
+#include "distributed.hpp"
+#include "recording.hpp"
+#include "clock.hpp"
+
+/*
+  Renders one of the built in scenes without a terminal, at a fixed resolution and along a fixed camera path,
+  and prints how long the frames took as json or csv so the numbers can be compared between builds
+
+    ./headless --scene 1 --width 200 --height 60 --frames 100 --threads 4 --packets --format csv
+    ./headless --scene scenes/scene2.txt
+
+  Built with -DCOUNT_ALLOCATIONS (make allocation_check) it also reports how many heap allocations the
+  measured frames made, which should be 0.
+  Every frame is also displayed like main.cpp does it, through a Frame_Pipeline with --pipeline depth (default 1)
+  into the file given by --display (default /dev/null), bytes_per_frame is the mean size of what the Window wrote.
+  frames_per_second counts the whole loop, render and display, so it shows how much the pipeline overlaps them.
+  --color 256|truecolor and --half-blocks measure the color modes of the Window,
+  with half blocks the picture is rendered with twice as many rows as --height.
+  Built with -DPROFILING (make profile) --trace file.json writes the rays, intersection tests and the time of every
+  tile of the measured frames as a chrome trace (see profiler.hpp) and prints the totals to stderr
+
+  --scene is the number of a built in scene or a scene file, scene files are loaded through their snapshot
+  (see scene_snapshot.hpp) unless --no-snapshot is given
+
+  --workers n renders the tiles with n worker processes instead (see distributed.hpp), each with --threads threads.
+  They are forked on this machine, or with --listen address the coordinator waits for n workers to connect to it,
+  started anywhere as
+    ./headless --worker address --threads 8
+  where address is host:port or the path of a Unix socket. workers in the output are the worker processes then,
+  late_tiles counts the tiles that were handed to a second worker because the first one took too long
+
+  --lighting-cache turns on the cache of lighting_cache.hpp, cached_shadow_rays is the fraction of the shadow rays
+  of the measured frames that it answered without tracing them
+
+  --record file writes the measured frames as a recording (see recording.hpp), two recordings of the same settings
+  can be compared with ./player a.rec --compare b.rec. How big it got is printed to stderr
+
+  The camera moves by the same angle every frame (what a 60fps frame would move it by) so every run renders
+  exactly the same frames. The frame times are only the render itself
+*/
+
+struct Settings {
+  const char *scene = "1";
+  int width = 200, height = 60;
+  int frames = 100;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  bool packets = false;
+  int aa_budget = 0; // extra rays per frame for antialiasing
+  bool temporal = false;
+  bool lighting_cache = false;
+  int max_reflection_depth = 8;
+  int reflection_budget = 0; // reflection rays per frame, 0 is no limit
+  double progressive = 0; // frame budget in milliseconds, 0 is off
+  Color_Mode color = COLOR_OFF;
+  bool half_blocks = false;
+  int pipeline = 1; // depth of the Frame_Pipeline
+  const char *display = "/dev/null"; // where the frames are written
+  bool snapshot = true;
+  bool csv = false;
+  bool header = true; // if the csv header line is printed
+  const char *trace = nullptr; // where the chrome trace is written, needs a build with -DPROFILING
+  int workers = 0;             // worker processes, 0 renders with the threads of this process
+  const char *listen = nullptr; // where remote workers connect to, local ones are forked without it
+  const char *worker = nullptr; // run as a worker of the coordinator at this address
+  const char *record = nullptr; // where the measured frames are recorded
+};
+
+struct Frame_Stats {
+  double time; // seconds
+  std::vector<Worker_Stats> workers;
+  double imbalance;
+  int aa_samples;
+  int traced; // primary rays, less than width*height in temporal mode
+  uint64_t allocations; // heap allocations during the render, only counted when built with -DCOUNT_ALLOCATIONS
+  int late_tiles;       // with workers
+  uint64_t cached_shadow_rays, traced_shadow_rays; // with the lighting cache, without workers
+};
+
+// numbers for the whole run
+struct Run_Totals {
+  double rays_per_second;
+  double frames_per_second; // render and display
+  double bytes_per_frame;
+  double result_compression; // with workers: size of the encoded tile results divided by the raw cells
+  double cached_shadow_fraction; // shadow rays the lighting cache answered
+};
+
+void usage() {
+  fprintf(stderr, "usage: headless [--scene 1|2|3|file] [--width w] [--height h] [--frames n] [--threads n]\n"
+                  "                [--packets] [--aa budget] [--temporal] [--lighting-cache] [--no-snapshot] [--format json|csv] [--no-header]\n"
+                  "                [--max-depth n] [--reflection-budget rays] [--progressive ms] \n"
+                  "                [--color 256|truecolor] [--half-blocks] [--pipeline depth] [--display file]\n"
+                  "                [--trace file] [--workers n [--listen address]] [--worker address]\n"
+                  "                [--record file]\n");
+  exit(1);
+}
+
+Settings parse_arguments(int argc, char **argv) {
+  Settings settings;
+  for (int i=1; i<argc; i++) {
+    bool has_value = i+1 < argc;
+    if (!strcmp(argv[i], "--scene") && has_value) {settings.scene = argv[++i];}
+    else if (!strcmp(argv[i], "--width") && has_value) {settings.width = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--height") && has_value) {settings.height = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--frames") && has_value) {settings.frames = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--threads") && has_value) {settings.threads = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--aa") && has_value) {settings.aa_budget = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--max-depth") && has_value) {settings.max_reflection_depth = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--reflection-budget") && has_value) {settings.reflection_budget = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--progressive") && has_value) {settings.progressive = atof(argv[++i]);}
+    else if (!strcmp(argv[i], "--trace") && has_value) {settings.trace = argv[++i];}
+    else if (!strcmp(argv[i], "--color") && has_value) {settings.color = !strcmp(argv[++i], "256") ? COLOR_256 : COLOR_TRUECOLOR;}
+    else if (!strcmp(argv[i], "--half-blocks")) {settings.half_blocks = true;}
+    else if (!strcmp(argv[i], "--pipeline") && has_value) {settings.pipeline = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--display") && has_value) {settings.display = argv[++i];}
+    else if (!strcmp(argv[i], "--workers") && has_value) {settings.workers = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--listen") && has_value) {settings.listen = argv[++i];}
+    else if (!strcmp(argv[i], "--worker") && has_value) {settings.worker = argv[++i];}
+    else if (!strcmp(argv[i], "--record") && has_value) {settings.record = argv[++i];}
+    else if (!strcmp(argv[i], "--format") && has_value) {settings.csv = !strcmp(argv[++i], "csv");}
+    else if (!strcmp(argv[i], "--packets")) {settings.packets = true;}
+    else if (!strcmp(argv[i], "--temporal")) {settings.temporal = true;}
+    else if (!strcmp(argv[i], "--lighting-cache")) {settings.lighting_cache = true;}
+    else if (!strcmp(argv[i], "--no-snapshot")) {settings.snapshot = false;}
+    else if (!strcmp(argv[i], "--no-header")) {settings.header = false;}
+    else {usage();}
+  }
+  if (settings.width <= 0 || settings.height <= 0 || settings.frames <= 0 || settings.threads <= 0 || settings.pipeline <= 0 ||
+      settings.workers < 0) {
+    usage();
+  }
+  if (settings.half_blocks && settings.color == COLOR_OFF) {settings.color = COLOR_TRUECOLOR;}
+  return settings;
+}
+
+// value at fraction p (0..1) of the sorted times, nearest rank
+double percentile(const std::vector<double>& sorted_times, double p) {
+  int index = (int)ceil(p * sorted_times.size()) - 1;
+  return sorted_times[std::min(std::max(index, 0), (int)sorted_times.size()-1)];
+}
+
+const char *color_name(Settings *settings) {
+  if (settings->color == COLOR_OFF) {return "off";}
+  if (settings->half_blocks) {return settings->color == COLOR_256 ? "256_half_blocks" : "truecolor_half_blocks";}
+  return settings->color == COLOR_256 ? "256" : "truecolor";
+}
+
+void print_json(Settings *settings, Demo_Scene *demo, double load_time, std::vector<Frame_Stats> *frames, std::vector<double> *sorted_times, Run_Totals *totals) {
+  printf("{\n");
+  printf("  \"scene\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, \"threads\": %d,\n",
+         demo->name, settings->width, settings->height, settings->frames, settings->threads);
+  printf("  \"load_ms\": %.3f, \"primitives\": %d,\n", load_time*1000., (int)demo->scene->primitives.size());
+  printf("  \"packets\": %s, \"packet_backend\": \"%s\", \"packet_width\": %d,\n",
+         settings->packets ? "true" : "false", PACKET_BACKEND, PACKET_WIDTH);
+  printf("  \"min_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f,\n",
+         sorted_times->front()*1000., percentile(*sorted_times, 0.5)*1000.,
+         percentile(*sorted_times, 0.99)*1000., sorted_times->back()*1000.);
+  printf("  \"rays_per_second\": %.0f, \"aa_budget\": %d, \"temporal\": %s,\n",
+         totals->rays_per_second, settings->aa_budget, settings->temporal ? "true" : "false");
+  printf("  \"max_reflection_depth\": %d, \"reflection_budget\": %d, \"progressive_ms\": %.3f,\n",
+         settings->max_reflection_depth, settings->reflection_budget, settings->progressive);
+  printf("  \"color\": \"%s\", \"bytes_per_frame\": %.0f, \"pipeline\": %d, \"frames_per_second\": %.1f,\n",
+         color_name(settings), totals->bytes_per_frame, settings->pipeline, totals->frames_per_second);
+  int late_tiles = 0;
+  for (auto& frame : *frames) {late_tiles += frame.late_tiles;}
+  printf("  \"lighting_cache\": %s, \"cached_shadow_rays\": %.3f,\n",
+         settings->lighting_cache ? "true" : "false", totals->cached_shadow_fraction);
+  printf("  \"worker_processes\": %d, \"late_tiles\": %d, \"result_compression\": %.3f,\n",
+         settings->workers, late_tiles, totals->result_compression);
+  // per thread (or worker process) numbers added up over all frames
+  int worker_count = frames->front().workers.size();
+  std::vector<Worker_Stats> total(worker_count);
+  double imbalance = 0;
+  for (auto& frame : *frames) {
+    for (int i=0; i<worker_count && i<(int)frame.workers.size(); i++) {
+      total[i].busy_time += frame.workers[i].busy_time;
+      total[i].tasks += frame.workers[i].tasks;
+      total[i].stolen += frame.workers[i].stolen;
+    }
+    imbalance += frame.imbalance;
+  }
+  printf("  \"mean_imbalance\": %.3f,\n", imbalance / frames->size());
+#ifdef COUNT_ALLOCATIONS
+  uint64_t allocations = 0;
+  for (auto& frame : *frames) {allocations += frame.allocations;}
+  printf("  \"allocations\": %llu,\n", (unsigned long long)allocations);
+#endif
+  printf("  \"workers\": [\n");
+  for (int i=0; i<worker_count; i++) {
+    printf("    {\"busy_ms\": %.3f, \"tiles\": %d, \"stolen\": %d}%s\n",
+           total[i].busy_time*1000., total[i].tasks, total[i].stolen, i+1 < worker_count ? "," : "");
+  }
+  printf("  ],\n");
+  printf("  \"frame_ms\": [");
+  for (size_t i=0; i<frames->size(); i++) {
+    printf("%s%.3f", i ? ", " : "", (*frames)[i].time*1000.);
+  }
+  printf("]\n}\n");
+}
+
+void print_csv(Settings *settings, Demo_Scene *demo, std::vector<Frame_Stats> *frames, std::vector<double> *sorted_times, Run_Totals *totals) {
+  double imbalance = 0;
+  int stolen = 0, late_tiles = 0;
+  for (auto& frame : *frames) {
+    imbalance += frame.imbalance;
+    late_tiles += frame.late_tiles;
+    for (auto& worker : frame.workers) {stolen += worker.stolen;}
+  }
+  if (settings->header) {
+    printf("scene,width,height,frames,threads,packets,aa_budget,temporal,min_ms,median_ms,p99_ms,max_ms,rays_per_second,mean_imbalance,stolen_tiles,color,bytes_per_frame,pipeline,frames_per_second,worker_processes,late_tiles,lighting_cache,cached_shadow_rays\n");
+  }
+  printf("%s,%d,%d,%d,%d,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.0f,%.3f,%d,%s,%.0f,%d,%.1f,%d,%d,%d,%.3f\n",
+         demo->name, settings->width, settings->height, settings->frames, settings->threads,
+         settings->packets ? PACKET_BACKEND : "off", settings->aa_budget, settings->temporal,
+         sorted_times->front()*1000., percentile(*sorted_times, 0.5)*1000.,
+         percentile(*sorted_times, 0.99)*1000., sorted_times->back()*1000.,
+         totals->rays_per_second, imbalance / frames->size(), stolen, color_name(settings), totals->bytes_per_frame,
+         settings->pipeline, totals->frames_per_second, settings->workers, late_tiles,
+         settings->lighting_cache, totals->cached_shadow_fraction);
+}
+
+int main(int argc, char **argv) {
+  Settings settings = parse_arguments(argc, argv);
+  if (settings.worker) {
+    int fd = connect_socket(settings.worker);
+    return fd < 0 ? 1 : run_worker(fd, settings.threads);
+  }
+  // with half blocks the picture is rendered with twice as many rows
+  int render_height = settings.half_blocks ? settings.height*2 : settings.height;
+  // local workers are forked before any thread is started
+  Distributed_Renderer distributed(settings.width, render_height);
+  if (settings.workers > 0 && settings.listen) {
+    int listen_fd = listen_socket(settings.listen);
+    if (listen_fd < 0) {return 1;}
+    distributed.accept_workers(listen_fd, settings.workers);
+    close(listen_fd);
+  } else if (settings.workers > 0) {
+    distributed.spawn_local_workers(settings.workers, settings.threads);
+  }
+  if (distributed.worker_count() < settings.workers) {
+    fprintf(stderr, "only %d of %d workers could be started\n", distributed.worker_count(), settings.workers);
+    return 1;
+  }
+  auto t_load = std::chrono::high_resolution_clock::now();
+  bool built_in = strspn(settings.scene, "0123456789") == strlen(settings.scene);
+  Demo_Scene *found;
+  if (built_in) {
+    found = demo_scene(atoi(settings.scene));
+  } else {
+    found = settings.snapshot ? load_scene_cached(settings.scene) : load_scene(settings.scene);
+  }
+  if (!found) {usage();}
+  Demo_Scene demo = *found;
+  delete found; // demo shares its arena
+  // time to read the file and build the bvh, or to map the snapshot
+  double load_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now()-t_load).count()/1000000.;
+
+  if (settings.workers > 0 && !distributed.send_scene(demo.scene)) {
+    fprintf(stderr, "%s: the scene can't be sent to workers\n", demo.name);
+    return 1;
+  }
+
+  // with half blocks the picture is rendered into pixels, the pixels of the frame buffers are what the Window
+  // draws over it (nothing here)
+  std::vector<char> pixels(settings.half_blocks ? settings.width * render_height : 0);
+  Window window(settings.width, settings.height, settings.color, settings.half_blocks);
+  window.fd = open(settings.display, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (window.fd < 0) {
+    perror(settings.display);
+    return 1;
+  }
+  Frame_Pipeline pipeline(&window, settings.pipeline, settings.width * settings.height,
+                          settings.color != COLOR_OFF ? settings.width * render_height : 0);
+  Recorder recorder;
+  if (settings.record && !recorder.start(settings.record, settings.width, settings.height,
+                                         settings.color != COLOR_OFF ? settings.width * render_height : 0,
+                                         settings.color, settings.half_blocks)) {
+    return 1;
+  }
+  Renderer renderer(settings.width, render_height, true);
+  renderer.packet_tracing = settings.packets;
+  renderer.aa_sample_budget = settings.aa_budget;
+  renderer.temporal = settings.temporal;
+  renderer.cache_lighting = settings.lighting_cache;
+  renderer.max_reflection_depth = settings.max_reflection_depth;
+  renderer.reflection_budget = settings.reflection_budget;
+  renderer.progressive = settings.progressive > 0;
+  renderer.frame_budget = settings.progressive / 1000.;
+  distributed.packet_tracing = settings.packets;
+  distributed.cache_lighting = settings.lighting_cache;
+  distributed.max_reflection_depth = settings.max_reflection_depth;
+  // renders the next frame into a buffer of the pipeline
+  auto render_frame = [&](Frame_Buffer *buffer) {
+    char *frame_pixels = settings.half_blocks ? pixels.data() : buffer->pixels.data();
+    if (settings.workers == 0) {
+      renderer.threaded_render(demo.scene, &demo.camera, &demo.lights, frame_pixels, settings.threads, buffer->color_data());
+    } else if (!distributed.render(&demo.camera, &demo.lights, frame_pixels, buffer->color_data())) {
+      fprintf(stderr, "all workers are gone\n");
+      exit(1);
+    }
+  };
+
+  // one frame that is not measured so that the thread pool and the caches are warmed up
+  demo.animate(&demo, 0.);
+  Frame_Buffer *buffer = pipeline.acquire();
+  render_frame(buffer);
+  pipeline.submit(buffer);
+  pipeline.wait_displayed();
+
+  profiler.reset();
+  std::vector<Frame_Stats> frames(settings.frames);
+  double total_time = 0;
+  uint64_t bytes_before = window.total_bytes;
+  uint64_t received_before = distributed.bytes_received, uncompressed_before = distributed.bytes_uncompressed;
+  auto t_loop = std::chrono::high_resolution_clock::now();
+  Clock clock;
+  for (int frame=0; frame<settings.frames; frame++) {
+    // moving the scene is part of every frame of the render loop too, it mustn't allocate either
+    uint64_t allocations_before = allocation_count();
+    demo.animate(&demo, frame * demo.angle_speed / 60.f);
+    // waiting for a free buffer is not part of the render
+    buffer = pipeline.acquire();
+    auto t_start = std::chrono::high_resolution_clock::now();
+    render_frame(buffer);
+    auto t_end = std::chrono::high_resolution_clock::now();
+    // the copy for the recording is made after the render was measured, before the buffer can be reused
+    recorder.record(buffer->pixels.data(), buffer->color_data(), settings.width, settings.height, clock.session_time());
+    pipeline.submit(buffer);
+    frames[frame].allocations = allocation_count() - allocations_before;
+    frames[frame].time = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end-t_start).count()/1e9;
+    if (settings.workers > 0) {
+      frames[frame].workers = distributed.stats;
+      frames[frame].imbalance = worker_imbalance(&distributed.stats);
+      frames[frame].aa_samples = 0;
+      frames[frame].traced = settings.width*render_height;
+    } else {
+      frames[frame].workers = renderer.pool.stats;
+      frames[frame].imbalance = renderer.pool.imbalance();
+      frames[frame].aa_samples = renderer.aa_samples_traced;
+      frames[frame].traced = settings.progressive > 0 ? renderer.progressive_traced :
+                             settings.temporal ? renderer.temporal_traced : settings.width*render_height;
+    }
+    frames[frame].late_tiles = distributed.late_tiles;
+    frames[frame].cached_shadow_rays = renderer.lighting.hits;
+    frames[frame].traced_shadow_rays = renderer.lighting.misses;
+    total_time += frames[frame].time;
+  }
+  pipeline.finish();
+  double loop_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now()-t_loop).count()/1e9;
+  close(window.fd);
+  if (recorder.recording()) {
+    recorder.finish();
+    fprintf(stderr, "recorded %llu frames into %s: %.0f bytes per frame, record() waited %llu times\n",
+            (unsigned long long)recorder.frames, settings.record, (double)recorder.bytes_written / recorder.frames,
+            (unsigned long long)recorder.stalls);
+  }
+
+  std::vector<double> sorted_times(settings.frames);
+  for (int i=0; i<settings.frames; i++) {sorted_times[i] = frames[i].time;}
+  std::sort(sorted_times.begin(), sorted_times.end());
+  // primary rays and antialiasing rays only, reflections and shadow rays depend on what is visible
+  double rays = 0;
+  for (auto& frame : frames) {rays += frame.traced + frame.aa_samples;}
+  Run_Totals totals;
+  totals.rays_per_second = rays / total_time;
+  totals.frames_per_second = settings.frames / loop_time;
+  totals.bytes_per_frame = (double)(window.total_bytes - bytes_before) / settings.frames;
+  uint64_t cached_shadow_rays = 0, traced_shadow_rays = 0;
+  for (auto& frame : frames) {
+    cached_shadow_rays += frame.cached_shadow_rays;
+    traced_shadow_rays += frame.traced_shadow_rays;
+  }
+  totals.cached_shadow_fraction = cached_shadow_rays ? (double)cached_shadow_rays / (cached_shadow_rays + traced_shadow_rays) : 0.;
+  uint64_t uncompressed = distributed.bytes_uncompressed - uncompressed_before;
+  totals.result_compression = uncompressed ? (double)(distributed.bytes_received - received_before) / uncompressed : 0.;
+
+  if (settings.csv) {
+    print_csv(&settings, &demo, &frames, &sorted_times, &totals);
+  } else {
+    print_json(&settings, &demo, load_time, &frames, &sorted_times, &totals);
+  }
+  if (settings.trace) {
+#ifdef PROFILING
+    profiler.print_summary(stderr);
+    if (!profiler.write_chrome_trace(settings.trace)) {fprintf(stderr, "%s: couldn't write trace\n", settings.trace);}
+#else
+    fprintf(stderr, "--trace needs a build with -DPROFILING\n");
+#endif
+  }
+  distributed.finish();
+  delete demo.arena;
+}
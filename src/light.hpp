@@ -0,0 +1,66 @@
+#pragma once
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "vector.hpp"
+
+/*
+  Light sources
+
+  Every light has an intensity (1 lights a surface facing it fully) and a range, beyond the range the light
+  doesn't reach anything and is skipped before any shadow ray is traced. The light fades out smoothly
+  towards the end of its range, a range of 0 means it reaches everything at full strength.
+
+    point light  shines in every direction from position
+    spot light   shines from position along direction, full strength inside inner_angle and nothing
+                 outside outer_angle (stored as cosines)
+    area light   parallelogram position + edge_u*s + edge_v*t (s and t in 0..1), shadows are traced to
+                 samples*samples points on it so they get soft edges
+*/
+enum Light_Type {POINT_LIGHT, SPOT_LIGHT, AREA_LIGHT};
+
+struct Light {
+  Light_Type type;
+  Vec3f position;
+  float intensity;
+  float range;
+  Vec3f direction;          // spot lights
+  float cos_inner, cos_outer;
+  Vec3f edge_u, edge_v;     // area lights
+  int samples;
+  // where the light is for shading, the middle of an area light
+  Vec3f center() {return type == AREA_LIGHT ? position + (edge_u + edge_v)*0.5f : position;};
+};
+
+Light point_light(Vec3f position, float intensity = 1.f, float range = 0.f) {
+  Light light = Light();
+  light.type = POINT_LIGHT;
+  light.position = position;
+  light.intensity = intensity;
+  light.range = range;
+  return light;
+}
+
+// the angles are in degrees, measured from direction to the edge of the cone
+Light spot_light(Vec3f position, Vec3f direction, float inner_angle, float outer_angle, float intensity = 1.f, float range = 0.f) {
+  Light light = point_light(position, intensity, range);
+  light.type = SPOT_LIGHT;
+  light.direction = direction.normalize();
+  light.cos_inner = cos(inner_angle*3.14159265/180.);
+  light.cos_outer = cos(outer_angle*3.14159265/180.);
+  return light;
+}
+
+Light area_light(Vec3f corner, Vec3f edge_u, Vec3f edge_v, int samples, float intensity = 1.f, float range = 0.f) {
+  Light light = point_light(corner, intensity, range);
+  light.type = AREA_LIGHT;
+  light.edge_u = edge_u;
+  light.edge_v = edge_v;
+  light.samples = samples < 1 ? 1 : samples;
+  return light;
+}
+
+// lights are plain data, so two lists are the same if their bytes are
+bool same_lights(const std::vector<Light>& a, const std::vector<Light>& b) {
+  return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size()*sizeof(Light)) == 0);
+}
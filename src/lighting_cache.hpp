@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "vector.hpp"
+#include "light.hpp"
+
+/*
+  Remembers which points can see which light, so that a camera moving through a scene that stays where it is
+  doesn't trace the same shadow rays again every frame
+
+  Space is split into cubes of cell_size, an entry is the visibility of one light (or one sample of an area light)
+  from the part of one primitive inside one cube. Lookups of an entry trace their shadow ray and add the result
+  to it until it has rays from octants_to_settle of the 8 octants of the cube that all agree, then the entry
+  answers by itself. Neighbouring pixels hit the same corner of a cube, asking for rays from different octants
+  keeps them from settling a cube that only looks lit from one corner. If the rays disagree the cube lies on the
+  edge of a shadow and its points keep tracing, so only cubes that are lit or shadowed all over are skipped.
+  The lambertian term is cheap and is still computed for every point, only the rays are cached.
+  A shadow edge that crosses a cube without reaching the rays it settled on is missed, so now and then a cell
+  differs from the one traced without the cache (on scenes/lights.txt the soft edges of the area light, with
+  0.25 and 4 octants up to about 40 of 12000 cells, while about 80% of the shadow rays are skipped)
+
+  The table is a fixed number of 64 bit words that the threads update with compare and swap, a lost race only loses
+  a sample. Every word holds the generation it was written in, when a light or the geometry moves the generation
+  goes up and every entry is empty at once. begin_frame() notices that: the cache is only used in frames that have
+  the same lights and geometry as the frame before, so a scene in which they move all the time doesn't pay for it
+*/
+class Lighting_Cache {
+private:
+  // layout of an entry: generation in bits 0-7, the octants rays came from in 8-15, whether one of them was lit
+  // in 16 and whether one was shadowed in 17, tag in 18-63
+  static const int generation_bits = 8;
+  static const int octants_shift = generation_bits, lit_shift = generation_bits + 8, shadowed_shift = lit_shift + 1;
+  static const int tag_shift = shadowed_shift + 1;
+  static const int max_probes = 8;
+  std::unique_ptr<std::atomic<uint64_t>[]> entries; // allocated by the first begin_frame()
+  int size_log2;
+  uint64_t mask;
+  uint64_t generation = 1;
+  // what the entries belong to
+  const void *scene = nullptr;
+  uint64_t geometry_version = 0;
+  std::vector<Light> lights;
+  float inverse_cell_size;
+  uint64_t entry_generation(uint64_t entry) {return entry & ((1 << generation_bits) - 1);};
+  int octant_count(uint64_t entry) {return __builtin_popcount((entry >> octants_shift) & 0xFF);};
+public:
+  float cell_size;
+  int octants_to_settle = 4;
+  bool active = false; // false in frames in which the cache isn't used
+  std::atomic<uint64_t> hits, misses; // lookups answered by an entry and shadow rays traced, since begin_frame()
+  // size_log2 is the log2 of the number of entries, 8 bytes each
+  Lighting_Cache(float cell_size = 0.25f, int size_log2 = 20) :
+    size_log2(size_log2), mask(((uint64_t)1 << size_log2) - 1), inverse_cell_size(1.f / cell_size), cell_size(cell_size),
+    hits(0), misses(0) {};
+  /*
+    Called before every frame with what is rendered, geometry_version has to change whenever something moves
+    (Compiled_Scene::geometry_version)
+  */
+  void begin_frame(const void *scene, uint64_t geometry_version, std::vector<Light> *lights);
+  // the key of the entry of a point, light_sample is the light index and the sample of area lights.
+  // octant is set to the octant of the cube the point is in
+  uint64_t key(Vec3f point, int primitive, int light_sample, int *octant);
+  // whether the point of key can see the light, trace() traces the shadow ray and returns true if it is blocked
+  template <typename Trace> bool visible(uint64_t key, int octant, Trace trace);
+};
+
+void Lighting_Cache::begin_frame(const void *scene, uint64_t geometry_version, std::vector<Light> *lights) {
+  hits = 0;
+  misses = 0;
+  if (!entries) {
+    entries.reset(new std::atomic<uint64_t>[(size_t)1 << size_log2]);
+    for (uint64_t i=0; i<=mask; i++) {entries[i].store(0, std::memory_order_relaxed);}
+  }
+  // a new cell size makes the keys mean something else
+  if (1.f / cell_size != inverse_cell_size) {this->scene = nullptr;}
+  inverse_cell_size = 1.f / cell_size;
+  bool unchanged = scene == this->scene && geometry_version == this->geometry_version && same_lights(*lights, this->lights);
+  if (unchanged) {
+    active = true;
+    return;
+  }
+  this->scene = scene;
+  this->geometry_version = geometry_version;
+  this->lights = *lights;
+  active = false;
+  generation++;
+  if (generation == (1 << generation_bits)) {
+    // entries from 255 generations ago would look valid again
+    for (uint64_t i=0; i<=mask; i++) {entries[i].store(0, std::memory_order_relaxed);}
+    generation = 1;
+  }
+}
+
+uint64_t Lighting_Cache::key(Vec3f point, int primitive, int light_sample, int *octant) {
+  // in half cells, the lowest bit is the octant
+  int64_t x = (int64_t)floorf(point.x * inverse_cell_size * 2.f);
+  int64_t y = (int64_t)floorf(point.y * inverse_cell_size * 2.f);
+  int64_t z = (int64_t)floorf(point.z * inverse_cell_size * 2.f);
+  *octant = (x & 1) | (y & 1) << 1 | (z & 1) << 2;
+  x >>= 1;
+  y >>= 1;
+  z >>= 1;
+  // splitmix64 over the parts one after another
+  uint64_t h = (uint64_t)primitive << 16 ^ (uint64_t)light_sample;
+  uint64_t parts[3] = {(uint64_t)x, (uint64_t)y, (uint64_t)z};
+  for (int i=0; i<3; i++) {
+    h ^= parts[i] + 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+template <typename Trace>
+bool Lighting_Cache::visible(uint64_t key, int octant, Trace trace) {
+  if (!active) {
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return !trace();
+  }
+  // the low bits pick the slot, the high bits are stored to tell keys apart
+  uint64_t tag = key >> tag_shift;
+  for (int probe=0; probe<max_probes; probe++) {
+    std::atomic<uint64_t> *slot = &entries[(key + probe) & mask];
+    uint64_t stored = slot->load(std::memory_order_relaxed);
+    bool empty = entry_generation(stored) != generation;
+    if (!empty && stored >> tag_shift != tag) {continue;}
+    uint64_t entry = empty ? 0 : stored;
+    bool lit = entry >> lit_shift & 1, shadowed = entry >> shadowed_shift & 1;
+    if (lit != shadowed && octant_count(entry) >= octants_to_settle) {
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return lit;
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    bool is_visible = !trace();
+    // edges stay edges, there is nothing more to learn about them
+    if (!(lit && shadowed)) {
+      uint64_t updated = tag << tag_shift | (entry & ~(uint64_t)0xFF) | (uint64_t)1 << (octants_shift + octant) |
+                         (uint64_t)1 << (is_visible ? lit_shift : shadowed_shift) | generation;
+      slot->compare_exchange_strong(stored, updated, std::memory_order_relaxed);
+    }
+    return is_visible;
+  }
+  // every slot around this one belongs to other keys
+  misses.fetch_add(1, std::memory_order_relaxed);
+  return !trace();
+}
@@ -1,67 +1,201 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "scenes.hpp"
+#include "scene_loader.hpp"
+#include "scene_snapshot.hpp"
 #include "window.hpp"
+#include "frame_pipeline.hpp"
 #include "renderer.hpp"
+#include "distributed.hpp"
 #include "clock.hpp"
+#include "recording.hpp"
+#include "resolution.hpp"
 #define PI 3.14159265
 
-int main() {
+// set by SIGWINCH, the render loop resizes everything between two frames
+volatile sig_atomic_t terminal_resized = 0;
+void on_terminal_resize(int) {terminal_resized = 1;}
+
+// the size of the terminal without the row the cursor is left in, at least big enough for the stats
+void terminal_size(int *width, int *height) {
+  struct winsize w;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 || w.ws_col == 0) {
+    *width = 80;
+    *height = 23;
+    return;
+  }
+  *width = std::max((int)w.ws_col, 24);
+  *height = std::max(w.ws_row-1, 5);
+}
+
+int main(int argc, char **argv) {
   int fps_limit = 60;
   int threads = std::thread::hardware_concurrency();
+  // ./output [scene file] [--progressive] [--temporal] [--lighting-cache] [--color 256|truecolor] [--half-blocks] [--pipeline depth] [--workers n] [--record file]
+  const char *scene_path = nullptr;
+  bool progressive = false;
+  // reuses the cells of the last frame where it can (see Renderer::temporal), faster but not exactly a full render
+  bool temporal = false;
+  // skips shadow rays while only the camera moves (see lighting_cache.hpp), a few cells on shadow edges can differ
+  bool lighting_cache = false;
+  // frames that can be in flight between the renderer and the terminal, see frame_pipeline.hpp.
+  // 2 renders the next frame while the last one is written, 1 has the least latency
+  int pipeline_depth = 2;
+  Color_Mode color_mode = COLOR_OFF;
+  bool half_blocks = false;
+  // worker processes that render the tiles instead of the threads of this one, see distributed.hpp
+  int worker_processes = 0;
+  // every frame is also written to this file, ./player plays it back (see recording.hpp)
+  const char *record_path = nullptr;
+  for (int i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "--progressive")) {progressive = true;}
+    else if (!strcmp(argv[i], "--temporal")) {temporal = true;}
+    else if (!strcmp(argv[i], "--lighting-cache")) {lighting_cache = true;}
+    else if (!strcmp(argv[i], "--color") && i+1 < argc) {color_mode = !strcmp(argv[++i], "256") ? COLOR_256 : COLOR_TRUECOLOR;}
+    else if (!strcmp(argv[i], "--half-blocks")) {half_blocks = true;}
+    else if (!strcmp(argv[i], "--pipeline") && i+1 < argc) {pipeline_depth = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--workers") && i+1 < argc) {worker_processes = atoi(argv[++i]);}
+    else if (!strcmp(argv[i], "--record") && i+1 < argc) {record_path = argv[++i];}
+    else {scene_path = argv[i];}
+  }
+  // half blocks need colors, without them both halves would look the same
+  if (half_blocks && color_mode == COLOR_OFF) {color_mode = COLOR_TRUECOLOR;}
 
   /* Get Terminal Size */
-  struct winsize w;
-  ioctl(STDOUT_FILENO,   TIOCGWINSZ, &w);
-  int window_width = w.ws_col;
-  int window_height = w.ws_row-1;
+  int window_width, window_height;
+  terminal_size(&window_width, &window_height);
 
-  /* Framebuffer */
-  char pixels[window_width * window_height];
+  /* Framebuffers */
+  // with half blocks every cell shows two pixels, the picture is rendered into render_pixels and
+  // the pixels of the frame buffers only hold the stats that are drawn over it
+  int render_height = half_blocks ? window_height*2 : window_height;
+  std::vector<char> render_pixels(half_blocks ? window_width * render_height : 0);
+
+  // the workers are forked before any thread is started, the cores are split between them
+  Distributed_Renderer distributed(window_width, render_height);
+  distributed.packet_tracing = true;
+  distributed.cache_lighting = lighting_cache;
+  distributed.spawn_local_workers(worker_processes, std::max(1, threads / std::max(1, worker_processes)));
 
   /* Init Window */
-  Window window(window_width, window_height);
-  window.fill(pixels);
+  Window window(window_width, window_height, color_mode, half_blocks);
+  // the frame buffers, the window writes them to the terminal on its own thread
+  Frame_Pipeline pipeline(&window, pipeline_depth, window_width * window_height,
+                          color_mode != COLOR_OFF ? window_width * render_height : 0);
+  Recorder recorder;
+  if (record_path && !recorder.start(record_path, window_width, window_height, color_mode != COLOR_OFF ? window_width * render_height : 0,
+                                     color_mode, half_blocks)) {
+    return 1;
+  }
   /* Init Renderer */
-  Renderer renderer(window_width, window_height, true);
+  Renderer renderer(window_width, render_height, true);
+  renderer.packet_tracing = true;
+  renderer.aa_sample_budget = window_width * render_height / 2; // at most an eighth of the cells get refined
+  renderer.temporal = temporal;
+  renderer.reflection_budget = window_width * render_height; // mirrors facing each other can't take more than a ray per cell
+  renderer.cache_lighting = lighting_cache;
+  // progressive: every frame is shown after at most 3/4 of a frame at fps_limit, however expensive the scene is
+  renderer.progressive = progressive;
+  renderer.frame_budget = 0.75 / fps_limit;
 
   /* Creating Scene */
-  Camera camera(Vec3f(30.,-30.,10.), Vec3f(-1.,1.,0.), Vec3f(0.,0.,1.), 75);
-  Vec3f light(10.,-20.,30.);
-  Object *objects[] = {
-    new Triangle(Vec3f(-20.,-20.,0.), Vec3f(20.,-20.,0.), Vec3f(20.,20.,0.), false),
-    new Triangle(Vec3f(-20.,-20.,0.), Vec3f(20.,20.,0.), Vec3f(-20.,20.,0.), false),
-    new Triangle(Vec3f(-20.,20.,2.), Vec3f(20.,20.,2.), Vec3f(20.,20.,10.), true),
-    new Triangle(Vec3f(-20.,20.,2.), Vec3f(-20.,20.,10.), Vec3f(20.,20.,10.), true),
-    new Cube2(Vec3f(-3.,-3.,0.), Vec3f(3.,3.,6.), false),
-    new Sphere(Vec3f(-8.,15.,2.), 2., false),
-    new Sphere(Vec3f(13.,10.,2.), 2., false),
-    new Sphere(Vec3f(-10.,-14.,2.), 2., false)
-  };
-  Object_List scene(objects, 8);
+  // ./output scenes/scene2.txt renders that file instead of the built in scene
+  Demo_Scene *loaded = scene_path ? load_scene_cached(scene_path) : new Demo_Scene(demo_scene1());
+  if (!loaded) {return 1;}
+  Demo_Scene demo = *loaded;
+  bool use_workers = distributed.worker_count() > 0 && distributed.send_scene(demo.scene);
+  if (worker_processes > 0 && !use_workers) {
+    fprintf(stderr, "the scene can't be rendered by workers, rendering it here\n");
+    distributed.finish();
+  }
 
+  /* Dynamic Resolution */
+  // below full resolution the renderer draws into the scaled buffers, which are scaled up into the frame buffer
+  Resolution_Controller resolution(fps_limit);
+  if (progressive) {resolution.enabled = false;} // progressive mode keeps to its time budget by itself
+  std::vector<char> scaled_pixels;
+  std::vector<Color> scaled_colors;
+  Clock clock(fps_limit);
+  // after the terminal was resized or the resolution changed
+  auto set_render_size = [&]() {
+    int width = resolution.scaled_width(window_width), height = resolution.scaled_height(render_height);
+    renderer.resize(width, height);
+    renderer.pixel_aspect = resolution.pixel_aspect();
+    renderer.aa_sample_budget = width * height / 2;
+    renderer.reflection_budget = width * height;
+    distributed.width = width;
+    distributed.height = height;
+    distributed.pixel_aspect = resolution.pixel_aspect();
+    scaled_pixels.resize(width * height);
+    scaled_colors.resize(color_mode != COLOR_OFF ? width * height : 0);
+    resolution.describe(clock.resolution_str, sizeof(clock.resolution_str));
+  };
+  struct sigaction resize_action;
+  memset(&resize_action, 0, sizeof(resize_action));
+  resize_action.sa_handler = on_terminal_resize;
+  resize_action.sa_flags = SA_RESTART; // the write() of a frame to the terminal goes on
+  sigaction(SIGWINCH, &resize_action, nullptr);
 
   /* Main Loop */
-  Clock clock(fps_limit);
   window.show_cursor(false);
   float cam_angle = 0.;
   uint64_t frame = 0;
   while (cam_angle <= 360*4.) {
     frame++;
+    if (terminal_resized) {
+      terminal_resized = 0;
+      int new_width, new_height;
+      terminal_size(&new_width, &new_height);
+      if (new_width != window_width || new_height != window_height) {
+        window_width = new_width;
+        window_height = new_height;
+        render_height = half_blocks ? window_height*2 : window_height;
+        // the frames that are still in flight are displayed at the old size before the buffers change
+        pipeline.resize(window_width * window_height, color_mode != COLOR_OFF ? window_width * render_height : 0);
+        window.resize(window_width, window_height);
+        render_pixels.resize(half_blocks ? window_width * render_height : 0);
+        resolution.reset();
+        set_render_size();
+      }
+    }
     // change camera position
-    camera.view_point.x = sin(cam_angle)*30.;
-    camera.view_point.y = cos(cam_angle)*30.;
-    camera.view_point.z = (cos(cam_angle)+2.0)*5.;
-    camera.view_direction = (Vec3f(0.,0,0.5)-camera.view_point).normalize();
-    cam_angle += 0.8*clock.frametime;
-    // render and display
-    renderer.threaded_render(&scene, &camera, &light, pixels, threads);
+    demo.animate(&demo, cam_angle);
+    cam_angle += demo.angle_speed*clock.frametime;
+    // render and display, waits here if the terminal is still busy with the frames before
+    Frame_Buffer *buffer = pipeline.acquire();
+    char *pixels = buffer->pixels.data();
+    Color *frame_colors = buffer->color_data();
+    char *picture = half_blocks ? render_pixels.data() : pixels;
+    bool scaled = resolution.level > 0;
+    char *rendered = scaled ? scaled_pixels.data() : picture;
+    Color *rendered_colors = scaled && frame_colors ? scaled_colors.data() : frame_colors;
+    if (!use_workers || !distributed.render(&demo.camera, &demo.lights, rendered, rendered_colors)) {
+      use_workers = false;
+      renderer.threaded_render(demo.scene, &demo.camera, &demo.lights, rendered, threads, rendered_colors);
+    }
+    if (scaled) {resolution.upscale(rendered, rendered_colors, picture, frame_colors, window_width, render_height);}
     clock.calculate_rendertime();
-    clock.show_stats(pixels, &window_width, &frame);
-    window.display(pixels);
+    clock.show_stats(pixels, &window_width, &frame, half_blocks ? nullptr : frame_colors);
+    recorder.record(pixels, frame_colors, window_width, window_height, clock.session_time());
+    pipeline.submit(buffer);
     clock.calculate_displaytime();
+    // with an output thread submit() returns right away, the stats show how long the display itself took
+    if (pipeline.depth > 1) {clock.displaytime = pipeline.last_display_time();}
 
     clock.calculate_frametime();
+    if (resolution.update(clock.worktime)) {set_render_size();}
   }
+  pipeline.finish();
+  distributed.finish();
+  recorder.finish();
   window.show_cursor(true);
+#ifdef PROFILING
+  profiler.write_chrome_trace("trace.json");
+#endif
+  free_demo_scene(loaded);
 }
@@ -0,0 +1,385 @@
+#pragma once
+#include <cstring>
+#include <vector>
+#include "vector.hpp"
+#include "ray.hpp"
+#include "compiled_scene.hpp"
+
+/*
+  Packet tracing: PACKET_WIDTH rays are traced at once using SIMD instructions
+
+  The backend is picked at build time from the instruction sets the compiler is allowed to use
+  (-mavx512f, -mavx2, SSE2 is always there on x86-64), compile with -DNO_SIMD to force the scalar fallback.
+  Rays and hits are stored as structure of arrays, one SIMD register per component, so each
+  intersection kernel below reads like the scalar version in compiled_scene.hpp but works on all rays at once.
+*/
+#if defined(__AVX512F__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define PACKET_WIDTH 16
+#define PACKET_BACKEND "AVX-512"
+struct Packet_Mask {
+  __mmask16 m;
+  Packet_Mask(__mmask16 m) : m(m) {};
+};
+struct Packet_Float {
+  __m512 v;
+  Packet_Float() {};
+  Packet_Float(__m512 v) : v(v) {};
+  Packet_Float(float s) : v(_mm512_set1_ps(s)) {};
+  static Packet_Float load(float *p) {return _mm512_loadu_ps(p);};
+  void store(float *p) {_mm512_storeu_ps(p, v);};
+};
+inline Packet_Float operator + (Packet_Float a, Packet_Float b) {return _mm512_add_ps(a.v, b.v);}
+inline Packet_Float operator - (Packet_Float a, Packet_Float b) {return _mm512_sub_ps(a.v, b.v);}
+inline Packet_Float operator * (Packet_Float a, Packet_Float b) {return _mm512_mul_ps(a.v, b.v);}
+inline Packet_Float operator / (Packet_Float a, Packet_Float b) {return _mm512_div_ps(a.v, b.v);}
+inline Packet_Float packet_min(Packet_Float a, Packet_Float b) {return _mm512_min_ps(a.v, b.v);}
+inline Packet_Float packet_max(Packet_Float a, Packet_Float b) {return _mm512_max_ps(a.v, b.v);}
+inline Packet_Float packet_sqrt(Packet_Float a) {return _mm512_sqrt_ps(a.v);}
+inline Packet_Mask operator <  (Packet_Float a, Packet_Float b) {return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ);}
+inline Packet_Mask operator >  (Packet_Float a, Packet_Float b) {return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ);}
+inline Packet_Mask operator <= (Packet_Float a, Packet_Float b) {return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ);}
+inline Packet_Mask operator >= (Packet_Float a, Packet_Float b) {return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ);}
+inline Packet_Mask operator != (Packet_Float a, Packet_Float b) {return _mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ);}
+inline Packet_Mask operator & (Packet_Mask a, Packet_Mask b) {return (__mmask16)(a.m & b.m);}
+inline Packet_Mask operator | (Packet_Mask a, Packet_Mask b) {return (__mmask16)(a.m | b.m);}
+inline Packet_Mask operator ^ (Packet_Mask a, Packet_Mask b) {return (__mmask16)(a.m ^ b.m);}
+inline int packet_bits(Packet_Mask a) {return a.m;}
+// per lane: mask ? a : b
+inline Packet_Float packet_select(Packet_Mask mask, Packet_Float a, Packet_Float b) {return _mm512_mask_blend_ps(mask.m, b.v, a.v);}
+// lanes where (int)a is odd
+inline Packet_Mask packet_odd(Packet_Float a) {
+  return _mm512_test_epi32_mask(_mm512_cvttps_epi32(a.v), _mm512_set1_epi32(1));
+}
+
+#elif defined(__AVX2__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define PACKET_WIDTH 8
+#define PACKET_BACKEND "AVX2"
+struct Packet_Mask {
+  __m256 m;
+  Packet_Mask(__m256 m) : m(m) {};
+};
+struct Packet_Float {
+  __m256 v;
+  Packet_Float() {};
+  Packet_Float(__m256 v) : v(v) {};
+  Packet_Float(float s) : v(_mm256_set1_ps(s)) {};
+  static Packet_Float load(float *p) {return _mm256_loadu_ps(p);};
+  void store(float *p) {_mm256_storeu_ps(p, v);};
+};
+inline Packet_Float operator + (Packet_Float a, Packet_Float b) {return _mm256_add_ps(a.v, b.v);}
+inline Packet_Float operator - (Packet_Float a, Packet_Float b) {return _mm256_sub_ps(a.v, b.v);}
+inline Packet_Float operator * (Packet_Float a, Packet_Float b) {return _mm256_mul_ps(a.v, b.v);}
+inline Packet_Float operator / (Packet_Float a, Packet_Float b) {return _mm256_div_ps(a.v, b.v);}
+inline Packet_Float packet_min(Packet_Float a, Packet_Float b) {return _mm256_min_ps(a.v, b.v);}
+inline Packet_Float packet_max(Packet_Float a, Packet_Float b) {return _mm256_max_ps(a.v, b.v);}
+inline Packet_Float packet_sqrt(Packet_Float a) {return _mm256_sqrt_ps(a.v);}
+inline Packet_Mask operator <  (Packet_Float a, Packet_Float b) {return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);}
+inline Packet_Mask operator >  (Packet_Float a, Packet_Float b) {return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ);}
+inline Packet_Mask operator <= (Packet_Float a, Packet_Float b) {return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);}
+inline Packet_Mask operator >= (Packet_Float a, Packet_Float b) {return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ);}
+inline Packet_Mask operator != (Packet_Float a, Packet_Float b) {return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ);}
+inline Packet_Mask operator & (Packet_Mask a, Packet_Mask b) {return _mm256_and_ps(a.m, b.m);}
+inline Packet_Mask operator | (Packet_Mask a, Packet_Mask b) {return _mm256_or_ps(a.m, b.m);}
+inline Packet_Mask operator ^ (Packet_Mask a, Packet_Mask b) {return _mm256_xor_ps(a.m, b.m);}
+inline int packet_bits(Packet_Mask a) {return _mm256_movemask_ps(a.m);}
+inline Packet_Float packet_select(Packet_Mask mask, Packet_Float a, Packet_Float b) {return _mm256_blendv_ps(b.v, a.v, mask.m);}
+inline Packet_Mask packet_odd(Packet_Float a) {
+  __m256i one = _mm256_set1_epi32(1);
+  __m256i odd = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_cvttps_epi32(a.v), one), one);
+  return _mm256_castsi256_ps(odd);
+}
+
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#define PACKET_WIDTH 4
+#define PACKET_BACKEND "SSE2"
+struct Packet_Mask {
+  __m128 m;
+  Packet_Mask(__m128 m) : m(m) {};
+};
+struct Packet_Float {
+  __m128 v;
+  Packet_Float() {};
+  Packet_Float(__m128 v) : v(v) {};
+  Packet_Float(float s) : v(_mm_set1_ps(s)) {};
+  static Packet_Float load(float *p) {return _mm_loadu_ps(p);};
+  void store(float *p) {_mm_storeu_ps(p, v);};
+};
+inline Packet_Float operator + (Packet_Float a, Packet_Float b) {return _mm_add_ps(a.v, b.v);}
+inline Packet_Float operator - (Packet_Float a, Packet_Float b) {return _mm_sub_ps(a.v, b.v);}
+inline Packet_Float operator * (Packet_Float a, Packet_Float b) {return _mm_mul_ps(a.v, b.v);}
+inline Packet_Float operator / (Packet_Float a, Packet_Float b) {return _mm_div_ps(a.v, b.v);}
+inline Packet_Float packet_min(Packet_Float a, Packet_Float b) {return _mm_min_ps(a.v, b.v);}
+inline Packet_Float packet_max(Packet_Float a, Packet_Float b) {return _mm_max_ps(a.v, b.v);}
+inline Packet_Float packet_sqrt(Packet_Float a) {return _mm_sqrt_ps(a.v);}
+inline Packet_Mask operator <  (Packet_Float a, Packet_Float b) {return _mm_cmplt_ps(a.v, b.v);}
+inline Packet_Mask operator >  (Packet_Float a, Packet_Float b) {return _mm_cmpgt_ps(a.v, b.v);}
+inline Packet_Mask operator <= (Packet_Float a, Packet_Float b) {return _mm_cmple_ps(a.v, b.v);}
+inline Packet_Mask operator >= (Packet_Float a, Packet_Float b) {return _mm_cmpge_ps(a.v, b.v);}
+inline Packet_Mask operator != (Packet_Float a, Packet_Float b) {return _mm_cmpneq_ps(a.v, b.v);}
+inline Packet_Mask operator & (Packet_Mask a, Packet_Mask b) {return _mm_and_ps(a.m, b.m);}
+inline Packet_Mask operator | (Packet_Mask a, Packet_Mask b) {return _mm_or_ps(a.m, b.m);}
+inline Packet_Mask operator ^ (Packet_Mask a, Packet_Mask b) {return _mm_xor_ps(a.m, b.m);}
+inline int packet_bits(Packet_Mask a) {return _mm_movemask_ps(a.m);}
+// SSE2 has no blend instruction
+inline Packet_Float packet_select(Packet_Mask mask, Packet_Float a, Packet_Float b) {
+  return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+inline Packet_Mask packet_odd(Packet_Float a) {
+  __m128i one = _mm_set1_epi32(1);
+  __m128i odd = _mm_cmpeq_epi32(_mm_and_si128(_mm_cvttps_epi32(a.v), one), one);
+  return _mm_castsi128_ps(odd);
+}
+
+#else
+#define PACKET_WIDTH 4
+#define PACKET_BACKEND "scalar"
+// one bit per lane
+struct Packet_Mask {
+  int m;
+  Packet_Mask(int m) : m(m) {};
+};
+struct Packet_Float {
+  float v[PACKET_WIDTH];
+  Packet_Float() {};
+  Packet_Float(float s) {for (int i=0; i<PACKET_WIDTH; i++) v[i] = s;};
+  static Packet_Float load(float *p) {Packet_Float r; for (int i=0; i<PACKET_WIDTH; i++) r.v[i] = p[i]; return r;};
+  void store(float *p) {for (int i=0; i<PACKET_WIDTH; i++) p[i] = v[i];};
+};
+#define PACKET_LANEWISE(expression) Packet_Float r; for (int i=0; i<PACKET_WIDTH; i++) {r.v[i] = expression;} return r;
+#define PACKET_COMPARE(expression) int m = 0; for (int i=0; i<PACKET_WIDTH; i++) {m |= (expression) << i;} return m;
+inline Packet_Float operator + (Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] + b.v[i])}
+inline Packet_Float operator - (Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] - b.v[i])}
+inline Packet_Float operator * (Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] * b.v[i])}
+inline Packet_Float operator / (Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] / b.v[i])}
+inline Packet_Float packet_min(Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] < b.v[i] ? a.v[i] : b.v[i])}
+inline Packet_Float packet_max(Packet_Float a, Packet_Float b) {PACKET_LANEWISE(a.v[i] > b.v[i] ? a.v[i] : b.v[i])}
+inline Packet_Float packet_sqrt(Packet_Float a) {PACKET_LANEWISE(sqrtf(a.v[i]))}
+inline Packet_Mask operator <  (Packet_Float a, Packet_Float b) {PACKET_COMPARE(a.v[i] <  b.v[i])}
+inline Packet_Mask operator >  (Packet_Float a, Packet_Float b) {PACKET_COMPARE(a.v[i] >  b.v[i])}
+inline Packet_Mask operator <= (Packet_Float a, Packet_Float b) {PACKET_COMPARE(a.v[i] <= b.v[i])}
+inline Packet_Mask operator >= (Packet_Float a, Packet_Float b) {PACKET_COMPARE(a.v[i] >= b.v[i])}
+inline Packet_Mask operator != (Packet_Float a, Packet_Float b) {PACKET_COMPARE(a.v[i] != b.v[i])}
+inline Packet_Mask operator & (Packet_Mask a, Packet_Mask b) {return a.m & b.m;}
+inline Packet_Mask operator | (Packet_Mask a, Packet_Mask b) {return a.m | b.m;}
+inline Packet_Mask operator ^ (Packet_Mask a, Packet_Mask b) {return a.m ^ b.m;}
+inline int packet_bits(Packet_Mask a) {return a.m;}
+inline Packet_Float packet_select(Packet_Mask mask, Packet_Float a, Packet_Float b) {PACKET_LANEWISE((mask.m >> i) & 1 ? a.v[i] : b.v[i])}
+inline Packet_Mask packet_odd(Packet_Float a) {PACKET_COMPARE(((int)a.v[i] & 1) != 0)}
+#undef PACKET_LANEWISE
+#undef PACKET_COMPARE
+#endif
+
+
+/*
+  3D vector where every component holds PACKET_WIDTH values
+*/
+struct Packet_Vec3 {
+  Packet_Float x, y, z;
+  Packet_Vec3() {};
+  Packet_Vec3(Packet_Float x, Packet_Float y, Packet_Float z) : x(x), y(y), z(z) {};
+  Packet_Vec3(Vec3f v) : x(v.x), y(v.y), z(v.z) {}; // same vector in every lane
+};
+inline Packet_Vec3 operator + (Packet_Vec3 a, Packet_Vec3 b) {return Packet_Vec3(a.x+b.x, a.y+b.y, a.z+b.z);}
+inline Packet_Vec3 operator - (Packet_Vec3 a, Packet_Vec3 b) {return Packet_Vec3(a.x-b.x, a.y-b.y, a.z-b.z);}
+inline Packet_Vec3 operator * (Packet_Vec3 a, Packet_Float s) {return Packet_Vec3(a.x*s, a.y*s, a.z*s);}
+inline Packet_Float dot(Packet_Vec3 a, Packet_Vec3 b) {return a.x*b.x + a.y*b.y + a.z*b.z;}
+inline Packet_Vec3 cross(Packet_Vec3 a, Packet_Vec3 b) {
+  return Packet_Vec3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+struct Ray_Packet {
+  Packet_Vec3 origin, direction;
+  Packet_Float min_t, max_t;
+  Packet_Vec3 point(Packet_Float t) {return origin + direction*t;};
+};
+
+/*
+  Closest hit of every ray in a packet, primitive is the index into Compiled_Scene::primitives
+  or -1 if the ray hit nothing. It is stored as the bits of an int in a float lane so that it can be
+  selected with the same masks as t, use packet_id() to create it and Hit_Packet::store_primitives() to read it
+*/
+struct Hit_Packet {
+  Packet_Float t;
+  Packet_Float primitive;
+  void store_primitives(int *p) {
+    float f[PACKET_WIDTH];
+    primitive.store(f);
+    memcpy(p, f, sizeof(f));
+  };
+};
+inline Packet_Float packet_id(int id) {
+  float f;
+  memcpy(&f, &id, sizeof(f));
+  return Packet_Float(f);
+}
+
+
+/*
+  Packet versions of the intersections in compiled_scene.hpp
+  Every lane that hits the primitive closer than its current hit gets its t and primitive updated
+*/
+void packet_intersection(Sphere_Array *spheres, int i, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  Packet_Vec3 oc = rays->origin - Packet_Vec3(spheres->center(i));
+  Packet_Float a = dot(rays->direction, rays->direction);
+  Packet_Float b = Packet_Float(2.f) * dot(rays->direction, oc);
+  Packet_Float c = dot(oc, oc) - Packet_Float(spheres->radius[i]*spheres->radius[i]);
+  Packet_Float discriminant = b*b - Packet_Float(4.f)*a*c;
+  Packet_Mask mask = discriminant > Packet_Float(0.f);
+  if (!packet_bits(mask)) {return;}
+  Packet_Float t = (Packet_Float(0.f) - b - packet_sqrt(packet_max(discriminant, Packet_Float(0.f)))) / (Packet_Float(2.f) * a);
+  mask = mask & (t > rays->min_t) & (t < hits->t);
+  hits->t = packet_select(mask, t, hits->t);
+  hits->primitive = packet_select(mask, packet_id(id), hits->primitive);
+}
+
+// Möller–Trumbore, same as ray_triangle() in scene.hpp
+void packet_triangle(Vec3f p1, Vec3f edge1, Vec3f edge2, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  Packet_Vec3 e1(edge1), e2(edge2);
+  Packet_Vec3 p = cross(rays->direction, e2);
+  Packet_Float determinant = dot(e1, p);
+  Packet_Float inverse_determinant = Packet_Float(1.f) / determinant;
+  Packet_Vec3 origin_to_p1 = rays->origin - Packet_Vec3(p1);
+  Packet_Float u = dot(origin_to_p1, p) * inverse_determinant;
+  Packet_Float zero(0.f), one(1.f);
+  Packet_Mask mask = (determinant != zero) & (u >= zero) & (u <= one);
+  if (!packet_bits(mask)) {return;}
+  Packet_Vec3 q = cross(origin_to_p1, e1);
+  Packet_Float v = dot(rays->direction, q) * inverse_determinant;
+  Packet_Float t = dot(e2, q) * inverse_determinant;
+  mask = mask & (v >= zero) & (u + v <= one) & (t >= rays->min_t) & (t < hits->t);
+  hits->t = packet_select(mask, t, hits->t);
+  hits->primitive = packet_select(mask, packet_id(id), hits->primitive);
+}
+
+void packet_intersection(Triangle_Array *triangles, int i, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  packet_triangle(triangles->p1(i), triangles->edge1(i), triangles->edge2(i), id, rays, hits);
+}
+
+void packet_intersection(Mesh_Triangle_Array *triangles, int i, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  Vec3f p1 = triangles->vertex(triangles->v1[i]);
+  packet_triangle(p1, triangles->vertex(triangles->v2[i])-p1, triangles->vertex(triangles->v3[i])-p1, id, rays, hits);
+}
+
+void packet_intersection(Plane_Array *planes, int i, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  Packet_Vec3 n(planes->normal(i));
+  Packet_Float denominator = dot(rays->direction, n);
+  Packet_Float t = (Packet_Float(planes->d[i]) - dot(rays->origin, n)) / denominator;
+  Packet_Mask mask = (denominator != Packet_Float(0.f)) & (t > rays->min_t) & (t < hits->t);
+  if (!packet_bits(mask)) {return;}
+  Packet_Vec3 hitpoint = rays->point(t) * Packet_Float(1.f/8);
+  // white squares have one odd and one even coordinate
+  mask = mask & (packet_odd(hitpoint.x) ^ packet_odd(hitpoint.y));
+  hits->t = packet_select(mask, t, hits->t);
+  hits->primitive = packet_select(mask, packet_id(id), hits->primitive);
+}
+
+void packet_intersection(Box_Array *boxes, int i, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  Packet_Float t_min = rays->min_t;
+  Packet_Float t_max = hits->t;
+  Packet_Float one(1.f);
+  Packet_Float t0 = (Packet_Float(boxes->min_x[i]) - rays->origin.x) * (one / rays->direction.x);
+  Packet_Float t1 = (Packet_Float(boxes->max_x[i]) - rays->origin.x) * (one / rays->direction.x);
+  t_min = packet_max(t_min, packet_min(t0, t1));
+  t_max = packet_min(t_max, packet_max(t0, t1));
+  t0 = (Packet_Float(boxes->min_y[i]) - rays->origin.y) * (one / rays->direction.y);
+  t1 = (Packet_Float(boxes->max_y[i]) - rays->origin.y) * (one / rays->direction.y);
+  t_min = packet_max(t_min, packet_min(t0, t1));
+  t_max = packet_min(t_max, packet_max(t0, t1));
+  t0 = (Packet_Float(boxes->min_z[i]) - rays->origin.z) * (one / rays->direction.z);
+  t1 = (Packet_Float(boxes->max_z[i]) - rays->origin.z) * (one / rays->direction.z);
+  t_min = packet_max(t_min, packet_min(t0, t1));
+  t_max = packet_min(t_max, packet_max(t0, t1));
+  Packet_Mask mask = t_min < t_max;
+  hits->t = packet_select(mask, t_min, hits->t);
+  hits->primitive = packet_select(mask, packet_id(id), hits->primitive);
+}
+
+// unpacks the rays and intersects them one by one, used for primitives without a packet kernel
+void packet_intersection_lanewise(Compiled_Scene *scene, int id, Ray_Packet *rays, Hit_Packet *hits) {
+  float ox[PACKET_WIDTH], oy[PACKET_WIDTH], oz[PACKET_WIDTH];
+  float dx[PACKET_WIDTH], dy[PACKET_WIDTH], dz[PACKET_WIDTH];
+  float min_t[PACKET_WIDTH], t[PACKET_WIDTH], ids[PACKET_WIDTH];
+  rays->origin.x.store(ox); rays->origin.y.store(oy); rays->origin.z.store(oz);
+  rays->direction.x.store(dx); rays->direction.y.store(dy); rays->direction.z.store(dz);
+  rays->min_t.store(min_t); hits->t.store(t); hits->primitive.store(ids);
+  float id_bits;
+  memcpy(&id_bits, &id, sizeof(id_bits));
+  for (int lane=0; lane<PACKET_WIDTH; lane++) {
+    Ray ray(Vec3f(ox[lane], oy[lane], oz[lane]), Vec3f(dx[lane], dy[lane], dz[lane]));
+    ray.min_t = min_t[lane];
+    ray.max_t = t[lane];
+    intersection_information ii;
+    if (scene->intersect_primitive(id, &ray, &ii) && ii.t < t[lane]) {
+      t[lane] = ii.t;
+      ids[lane] = id_bits;
+    }
+  }
+  hits->t = Packet_Float::load(t);
+  hits->primitive = Packet_Float::load(ids);
+}
+
+void packet_intersect_primitive(Compiled_Scene *scene, int primitive, Ray_Packet *rays, Hit_Packet *hits) {
+  Primitive_Ref ref = scene->primitives[primitive];
+  // instances and other primitives are tested one lane at a time and counted by primitive_hit()
+  PROFILE_TESTS(ref.type, ref.type == INSTANCE || ref.type == OTHER ? 0 : PACKET_WIDTH);
+  switch (ref.type) {
+    case SPHERE:        packet_intersection(&scene->spheres, ref.index, primitive, rays, hits); break;
+    case TRIANGLE:      packet_intersection(&scene->triangles, ref.index, primitive, rays, hits); break;
+    case MESH_TRIANGLE: packet_intersection(&scene->mesh_triangles, ref.index, primitive, rays, hits); break;
+    case PLANE:         packet_intersection(&scene->planes, ref.index, primitive, rays, hits); break;
+    case BOX:           packet_intersection(&scene->boxes, ref.index, primitive, rays, hits); break;
+    default:            packet_intersection_lanewise(scene, primitive, rays, hits); break;
+  }
+}
+
+// true if any ray of the packet enters the box before its t_max
+bool packet_hits_box(AABB *box, Ray_Packet *rays, Packet_Vec3 *inverse_direction, Packet_Float t_max) {
+  Packet_Float t0 = (Packet_Float(box->bound_min.x) - rays->origin.x) * inverse_direction->x;
+  Packet_Float t1 = (Packet_Float(box->bound_max.x) - rays->origin.x) * inverse_direction->x;
+  Packet_Float t_enter = packet_min(t0, t1);
+  Packet_Float t_exit = packet_max(t0, t1);
+  t0 = (Packet_Float(box->bound_min.y) - rays->origin.y) * inverse_direction->y;
+  t1 = (Packet_Float(box->bound_max.y) - rays->origin.y) * inverse_direction->y;
+  t_enter = packet_max(t_enter, packet_min(t0, t1));
+  t_exit = packet_min(t_exit, packet_max(t0, t1));
+  t0 = (Packet_Float(box->bound_min.z) - rays->origin.z) * inverse_direction->z;
+  t1 = (Packet_Float(box->bound_max.z) - rays->origin.z) * inverse_direction->z;
+  t_enter = packet_max(t_enter, packet_min(t0, t1));
+  t_exit = packet_min(t_exit, packet_max(t0, t1));
+  return packet_bits((t_exit >= packet_max(t_enter, Packet_Float(0.f))) & (t_enter < t_max)) != 0;
+}
+
+/*
+  Traces a packet through the BVH of a Compiled_Scene, the whole packet goes down a node
+  if at least one of its rays hits that node
+*/
+void packet_intersection(Compiled_Scene *scene, Ray_Packet *rays, Hit_Packet *hits) {
+  hits->t = rays->max_t;
+  hits->primitive = packet_id(-1);
+  BVH *bvh = &scene->bvh;
+  for (int i=0; i<(int)bvh->unbounded.size(); i++) {
+    packet_intersect_primitive(scene, bvh->unbounded[i], rays, hits);
+  }
+  if (bvh->indices.empty()) {return;}
+
+  Packet_Float one(1.f);
+  Packet_Vec3 inverse_direction(one/rays->direction.x, one/rays->direction.y, one/rays->direction.z);
+  int stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    BVH_Node *node = &bvh->nodes[stack[--stack_size]];
+    if (!packet_hits_box(&node->bounds, rays, &inverse_direction, hits->t)) {continue;}
+    if (node->count > 0) {
+      for (int i=0; i<node->count; i++) {
+        packet_intersect_primitive(scene, bvh->indices[node->left_first+i], rays, hits);
+      }
+      continue;
+    }
+    stack[stack_size++] = node->left_first+1;
+    stack[stack_size++] = node->left_first;
+  }
+}
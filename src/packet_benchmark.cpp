@@ -0,0 +1,57 @@
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "renderer.hpp"
+
+/*
+  Renders the scene from main.cpp without displaying it, once tracing every ray on its own
+  and once tracing packets, and prints how many primary rays per second each path reaches
+*/
+double benchmark(Renderer *renderer, Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels, int frames) {
+  auto t_start = std::chrono::high_resolution_clock::now();
+  for (int frame=0; frame<frames; frame++) {
+    float cam_angle = frame * 0.05f;
+    camera->view_point.x = sin(cam_angle)*30.;
+    camera->view_point.y = cos(cam_angle)*30.;
+    camera->view_point.z = (cos(cam_angle)+2.0)*5.;
+    camera->view_direction = (Vec3f(0.,0,0.5)-camera->view_point).normalize();
+    renderer->threaded_render(scene, camera, lights, pixels, 1);
+  }
+  auto t_end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration_cast<std::chrono::microseconds>(t_end-t_start).count()/1000000.;
+  return (double)renderer->window_width * renderer->window_height * frames / seconds;
+}
+
+int main() {
+  int window_width = 200;
+  int window_height = 60;
+  int frames = 200;
+  std::vector<char> pixels(window_width * window_height);
+
+  Camera camera(Vec3f(30.,-30.,10.), Vec3f(-1.,1.,0.), Vec3f(0.,0.,1.), 75);
+  std::vector<Light> lights = {point_light(Vec3f(10.,-20.,30.))};
+  Object *objects[] = {
+    new Triangle(Vec3f(-20.,-20.,0.), Vec3f(20.,-20.,0.), Vec3f(20.,20.,0.), false),
+    new Triangle(Vec3f(-20.,-20.,0.), Vec3f(20.,20.,0.), Vec3f(-20.,20.,0.), false),
+    new Triangle(Vec3f(-20.,20.,2.), Vec3f(20.,20.,2.), Vec3f(20.,20.,10.), true),
+    new Triangle(Vec3f(-20.,20.,2.), Vec3f(-20.,20.,10.), Vec3f(20.,20.,10.), true),
+    new Cube2(Vec3f(-3.,-3.,0.), Vec3f(3.,3.,6.), false),
+    new Sphere(Vec3f(-8.,15.,2.), 2., false),
+    new Sphere(Vec3f(13.,10.,2.), 2., false),
+    new Sphere(Vec3f(-10.,-14.,2.), 2., false)
+  };
+  Object_List object_list(objects, 8);
+  Compiled_Scene scene(&object_list);
+
+  Renderer renderer(window_width, window_height, true);
+  renderer.packet_tracing = false;
+  double scalar_rays = benchmark(&renderer, &scene, &camera, &lights, pixels.data(), frames);
+  renderer.packet_tracing = true;
+  double packet_rays = benchmark(&renderer, &scene, &camera, &lights, pixels.data(), frames);
+
+  printf("%dx%d, %d frames, 1 thread\n", window_width, window_height, frames);
+  printf("scalar:          %10.0f rays/sec\n", scalar_rays);
+  printf("packet (%s x%d): %10.0f rays/sec (%.2fx)\n", PACKET_BACKEND, PACKET_WIDTH, packet_rays, packet_rays/scalar_rays);
+}
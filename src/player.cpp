@@ -0,0 +1,143 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "window.hpp"
+#include "recording.hpp"
+
+/*
+  Plays a recording (see recording.hpp) made with --record by main.cpp or headless.cpp in the terminal,
+  at the rate it was recorded or --speed times that, without rendering anything
+
+    ./player session.rec --speed 2 --loop
+
+  Frames are decoded one after the other, a frame that is already late when it is decoded is not displayed
+  so a slow terminal doesn't make the whole recording slower.
+  --info prints how many frames the recording has, how long it is and how big the frames are.
+  --compare other.rec compares two recordings frame by frame instead, prints the frames that differ
+  and exits with 1 if any do, the timestamps are left out. Two runs of headless with the same settings
+  render the same frames, so this shows what a change does to the picture
+*/
+
+struct Settings {
+  const char *path = nullptr;
+  const char *compare = nullptr;
+  double speed = 1.;
+  bool loop = false;
+  bool info = false;
+};
+
+void usage() {
+  fprintf(stderr, "usage: player file [--speed factor] [--loop] [--info] [--compare other_file]\n");
+  exit(2);
+}
+
+Settings parse_arguments(int argc, char **argv) {
+  Settings settings;
+  for (int i=1; i<argc; i++) {
+    bool has_value = i+1 < argc;
+    if (!strcmp(argv[i], "--speed") && has_value) {settings.speed = atof(argv[++i]);}
+    else if (!strcmp(argv[i], "--loop")) {settings.loop = true;}
+    else if (!strcmp(argv[i], "--info")) {settings.info = true;}
+    else if (!strcmp(argv[i], "--compare") && has_value) {settings.compare = argv[++i];}
+    else if (argv[i][0] != '-' && !settings.path) {settings.path = argv[i];}
+    else {usage();}
+  }
+  if (!settings.path || settings.speed <= 0) {usage();}
+  return settings;
+}
+
+int print_info(Recording_Reader *reader) {
+  uint64_t keyframes = 0, bytes = 0;
+  double first_time = 0, last_time = 0;
+  while (reader->next()) {
+    if (reader->frame_index == 1) {first_time = reader->frame.time;}
+    last_time = reader->frame.time;
+    keyframes += reader->frame.keyframe;
+    bytes += sizeof(Recording_Frame) + reader->frame.size;
+  }
+  uint64_t frames = reader->frame_index;
+  size_t raw = reader->pixels.size() + reader->colors.size()*sizeof(Color);
+  printf("%ux%u cells, %u colors per frame\n", reader->header.width, reader->header.height, reader->header.color_count);
+  printf("%llu frames (%llu keyframes) over %.2fs\n", (unsigned long long)frames, (unsigned long long)keyframes, last_time - first_time);
+  if (frames > 0) {
+    printf("%.0f bytes per frame, %.1f%% of the raw %zu\n", (double)bytes / frames, 100. * bytes / frames / raw, raw);
+  }
+  return 0;
+}
+
+int compare(Recording_Reader *a, Recording_Reader *b) {
+  if (a->header.width != b->header.width || a->header.height != b->header.height ||
+      a->header.color_count != b->header.color_count) {
+    printf("the recordings have different sizes\n");
+    return 1;
+  }
+  uint64_t differing_frames = 0;
+  int most_cells = 0;
+  while (true) {
+    bool has_a = a->next(), has_b = b->next();
+    if (!has_a || !has_b) {
+      if (has_a || has_b) {
+        printf("%s recording ends after %llu frames\n", has_a ? "the second" : "the first",
+               (unsigned long long)std::min(a->frame_index, b->frame_index));
+        return 1;
+      }
+      break;
+    }
+    int cells = 0;
+    for (size_t i=0; i<a->pixels.size(); i++) {cells += a->pixels[i] != b->pixels[i];}
+    for (size_t i=0; i<a->colors.size(); i++) {cells += a->colors[i] != b->colors[i];}
+    if (cells == 0) {continue;}
+    if (differing_frames < 10) {printf("frame %llu: %d cells differ\n", (unsigned long long)a->frame_index, cells);}
+    differing_frames++;
+    most_cells = std::max(most_cells, cells);
+  }
+  printf("%llu of %llu frames differ", (unsigned long long)differing_frames, (unsigned long long)a->frame_index);
+  if (differing_frames > 0) {printf(", at most %d cells", most_cells);}
+  printf("\n");
+  return differing_frames > 0;
+}
+
+int play(Recording_Reader *reader, Settings *settings) {
+  Window window(reader->header.width, reader->header.height, (Color_Mode)reader->header.color_mode, reader->header.half_blocks);
+  window.show_cursor(false);
+  uint64_t skipped = 0;
+  do {
+    reader->rewind();
+    window.invalidate();
+    auto t_start = std::chrono::steady_clock::now();
+    double first_time = 0;
+    while (reader->next()) {
+      if (reader->frame_index == 1) {first_time = reader->frame.time;}
+      double due = (reader->frame.time - first_time) / settings->speed;
+      double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+      if (now < due) {
+        std::this_thread::sleep_for(std::chrono::microseconds((int64_t)((due - now) * 1e6)));
+      } else if (now > due + 1./30) {
+        // the terminal can't keep up, the next frame redraws what changed since the last one that was displayed
+        skipped++;
+        continue;
+      }
+      window.display(reader->pixels.data(), reader->color_data());
+    }
+  } while (settings->loop);
+  // the last frame, in case it was skipped
+  window.display(reader->pixels.data(), reader->color_data());
+  window.show_cursor(true);
+  printf("\n%llu frames, %llu skipped\n", (unsigned long long)reader->frame_index, (unsigned long long)skipped);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  Settings settings = parse_arguments(argc, argv);
+  Recording_Reader reader;
+  if (!reader.open(settings.path)) {return 2;}
+  if (settings.info) {return print_info(&reader);}
+  if (settings.compare) {
+    Recording_Reader other;
+    if (!other.open(settings.compare)) {return 2;}
+    return compare(&reader, &other);
+  }
+  return play(&reader, &settings);
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+  Counters and timers for the hot paths of the renderer, only compiled in with -DPROFILING
+
+    PROFILE_SCOPE("tile");            // times the rest of the block, shows up as a slice in the trace
+    PROFILE_RAY(SHADOW_RAY);          // counts a ray of that type
+    PROFILE_TESTS(type, n);           // counts n intersection tests against primitives of a Primitive_Type
+    PROFILE_REFLECTION(depth);        // counts a reflection ray, depth 1 is the first bounce
+    PROFILE_FRAME_END();              // adds the counters of this frame to the trace
+
+  Without PROFILING all of these are empty, nothing is counted or timed.
+  Every thread counts into its own Profile_Thread so the counters need no atomics, they are only
+  added up at the end of a frame when the workers are idle.
+  profiler.write_chrome_trace() writes everything in the trace event format, open it in
+  chrome://tracing or https://ui.perfetto.dev
+*/
+enum Ray_Type {PRIMARY_RAY, SHADOW_RAY, REFLECTION_RAY, ANTIALIAS_RAY, RAY_TYPE_COUNT};
+const char *const ray_type_names[RAY_TYPE_COUNT] = {"primary", "shadow", "reflection", "antialias"};
+// same order as Primitive_Type in compiled_scene.hpp
+const int profile_primitive_types = 7;
+const char *const profile_primitive_names[profile_primitive_types] = {"sphere", "triangle", "mesh_triangle", "plane", "box", "instance", "other"};
+// rays deeper than this are counted in the last bucket of the depth histogram
+const int profile_max_depth = 8;
+// events a thread keeps at most, the rest is dropped so that a long run can't fill the memory
+const size_t profile_max_events = 1 << 20;
+
+struct Profile_Counters {
+  uint64_t rays[RAY_TYPE_COUNT] = {0};
+  uint64_t tests[profile_primitive_types] = {0};
+  uint64_t depths[profile_max_depth] = {0}; // rays that were traced at every reflection depth, 0 are camera rays
+  void add(const Profile_Counters& other);
+};
+
+struct Profile_Event {
+  const char *name;
+  int64_t start, duration; // nanoseconds since the profiler started
+};
+
+struct Profile_Thread {
+  int id;
+  Profile_Counters counters;
+  std::vector<Profile_Event> events;
+  uint64_t dropped = 0;
+  void add_event(const char *name, int64_t start, int64_t duration);
+};
+
+// counters of all threads added up at the end of a frame, the trace shows them as graphs
+struct Profile_Frame {
+  int64_t time;
+  Profile_Counters counters;
+};
+
+class Profiler {
+private:
+  std::chrono::steady_clock::time_point start_time;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Profile_Thread>> threads;
+  std::vector<Profile_Frame> frames;
+  Profile_Counters last_total; // sum at the end of the last frame, so that every frame gets only its own counts
+public:
+  Profiler() : start_time(std::chrono::steady_clock::now()) {};
+  int64_t now() {return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start_time).count();};
+  Profile_Thread *register_thread();
+  // adds up the counters of every thread, only call it while no other thread is counting
+  Profile_Counters total();
+  void frame_end();
+  // throws away everything counted so far, for example the warm up frames of a benchmark
+  void reset();
+  bool write_chrome_trace(const char *path);
+  void print_summary(FILE *file);
+};
+
+Profiler profiler;
+thread_local Profile_Thread *profile_current_thread = nullptr;
+
+inline Profile_Thread *profile_thread() {
+  if (!profile_current_thread) {profile_current_thread = profiler.register_thread();}
+  return profile_current_thread;
+}
+
+struct Profile_Scope {
+  const char *name;
+  int64_t start;
+  Profile_Scope(const char *name) : name(name), start(profiler.now()) {};
+  ~Profile_Scope() {profile_thread()->add_event(name, start, profiler.now()-start);};
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef PROFILING
+#define PROFILE_SCOPE(name) Profile_Scope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_RAYS(type, n) do { \
+    Profile_Thread *profile_t = profile_thread(); \
+    profile_t->counters.rays[type] += (n); \
+    if ((type) == PRIMARY_RAY || (type) == ANTIALIAS_RAY) {profile_t->counters.depths[0] += (n);} \
+  } while (0)
+#define PROFILE_TESTS(type, n) (profile_thread()->counters.tests[type] += (n))
+#define PROFILE_REFLECTION(depth) do { \
+    Profile_Thread *profile_t = profile_thread(); \
+    profile_t->counters.rays[REFLECTION_RAY]++; \
+    profile_t->counters.depths[std::min((int)(depth), profile_max_depth-1)]++; \
+  } while (0)
+#define PROFILE_FRAME_END() profiler.frame_end()
+#else
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_RAYS(type, n) ((void)0)
+#define PROFILE_TESTS(type, n) ((void)0)
+#define PROFILE_REFLECTION(depth) ((void)0)
+#define PROFILE_FRAME_END() ((void)0)
+#endif
+#define PROFILE_RAY(type) PROFILE_RAYS(type, 1)
+#define PROFILE_TEST(type) PROFILE_TESTS(type, 1)
+
+void Profile_Counters::add(const Profile_Counters& other) {
+  for (int i=0; i<RAY_TYPE_COUNT; i++) {rays[i] += other.rays[i];}
+  for (int i=0; i<profile_primitive_types; i++) {tests[i] += other.tests[i];}
+  for (int i=0; i<profile_max_depth; i++) {depths[i] += other.depths[i];}
+}
+
+void Profile_Thread::add_event(const char *name, int64_t start, int64_t duration) {
+  if (events.size() >= profile_max_events) {
+    dropped++;
+    return;
+  }
+  Profile_Event event = {name, start, duration};
+  events.push_back(event);
+}
+
+Profile_Thread *Profiler::register_thread() {
+  std::lock_guard<std::mutex> lock(mutex);
+  threads.push_back(std::unique_ptr<Profile_Thread>(new Profile_Thread()));
+  Profile_Thread *thread = threads.back().get();
+  thread->id = threads.size()-1;
+  thread->events.reserve(1 << 14);
+  return thread;
+}
+
+Profile_Counters Profiler::total() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Profile_Counters sum;
+  for (auto& thread : threads) {sum.add(thread->counters);}
+  return sum;
+}
+
+void Profiler::frame_end() {
+  Profile_Counters sum = total();
+  Profile_Frame frame;
+  frame.time = now();
+  frame.counters = sum;
+  for (int i=0; i<RAY_TYPE_COUNT; i++) {frame.counters.rays[i] -= last_total.rays[i];}
+  for (int i=0; i<profile_primitive_types; i++) {frame.counters.tests[i] -= last_total.tests[i];}
+  for (int i=0; i<profile_max_depth; i++) {frame.counters.depths[i] -= last_total.depths[i];}
+  last_total = sum;
+  frames.push_back(frame);
+}
+
+void Profiler::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& thread : threads) {
+    thread->counters = Profile_Counters();
+    thread->events.clear();
+    thread->dropped = 0;
+  }
+  frames.clear();
+  last_total = Profile_Counters();
+}
+
+bool Profiler::write_chrome_trace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {return false;}
+  std::lock_guard<std::mutex> lock(mutex);
+  // timestamps in the trace are microseconds
+  fprintf(file, "{\"traceEvents\": [\n");
+  const char *separator = "";
+  for (auto& thread : threads) {
+    fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            separator, thread->id, thread->id);
+    separator = ",\n";
+    for (auto& event : thread->events) {
+      fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+              event.name, thread->id, event.start/1000., event.duration/1000.);
+    }
+  }
+  for (auto& frame : frames) {
+    fprintf(file, "%s{\"name\": \"rays\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {", separator, frame.time/1000.);
+    for (int i=0; i<RAY_TYPE_COUNT; i++) {
+      fprintf(file, "%s\"%s\": %llu", i ? ", " : "", ray_type_names[i], (unsigned long long)frame.counters.rays[i]);
+    }
+    fprintf(file, "}},\n{\"name\": \"intersection tests\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {", frame.time/1000.);
+    for (int i=0; i<profile_primitive_types; i++) {
+      fprintf(file, "%s\"%s\": %llu", i ? ", " : "", profile_primitive_names[i], (unsigned long long)frame.counters.tests[i]);
+    }
+    fprintf(file, "}}");
+    separator = ",\n";
+  }
+  // the totals go into otherData, the trace viewers show them as metadata
+  Profile_Counters sum;
+  uint64_t dropped = 0;
+  for (auto& thread : threads) {
+    sum.add(thread->counters);
+    dropped += thread->dropped;
+  }
+  fprintf(file, "\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": {\"frames\": %d, \"dropped_events\": %llu",
+          (int)frames.size(), (unsigned long long)dropped);
+  for (int i=0; i<RAY_TYPE_COUNT; i++) {
+    fprintf(file, ", \"%s_rays\": %llu", ray_type_names[i], (unsigned long long)sum.rays[i]);
+  }
+  for (int i=0; i<profile_primitive_types; i++) {
+    fprintf(file, ", \"%s_tests\": %llu", profile_primitive_names[i], (unsigned long long)sum.tests[i]);
+  }
+  fprintf(file, ", \"rays_per_depth\": \"");
+  for (int i=0; i<profile_max_depth; i++) {
+    fprintf(file, "%s%llu", i ? " " : "", (unsigned long long)sum.depths[i]);
+  }
+  fprintf(file, "\"}\n}\n");
+  return fclose(file) == 0;
+}
+
+void Profiler::print_summary(FILE *file) {
+  Profile_Counters sum = total();
+  fprintf(file, "rays:");
+  for (int i=0; i<RAY_TYPE_COUNT; i++) {
+    fprintf(file, " %s %llu", ray_type_names[i], (unsigned long long)sum.rays[i]);
+  }
+  fprintf(file, "\nintersection tests:");
+  for (int i=0; i<profile_primitive_types; i++) {
+    fprintf(file, " %s %llu", profile_primitive_names[i], (unsigned long long)sum.tests[i]);
+  }
+  fprintf(file, "\nrays per reflection depth:");
+  for (int i=0; i<profile_max_depth; i++) {
+    fprintf(file, " %llu", (unsigned long long)sum.depths[i]);
+  }
+  fprintf(file, "\n");
+}
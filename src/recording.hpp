@@ -0,0 +1,365 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "color.hpp"
+#include "frame_pipeline.hpp"
+
+/*
+  Recording of a session: every frame that was given to the Window, so it can be played back (player.cpp)
+  or compared with another run without rendering anything again
+
+  The file starts with a Recording_Header, then every frame is a Recording_Frame followed by size bytes of runs
+  over its cells, first the characters, then the colors if the recording has them. A run is a varint of
+  count*4 + kind:
+    RUN_SKIP    the next count cells didn't change since the frame before
+    RUN_REPEAT  the next count cells are all the one value that follows
+    RUN_COPY    the count values that follow
+  Keyframes have no skips, they can be decoded without the frames before, every keyframe_interval-th frame is one.
+  Most cells of a frame are the same as in the one before, so a frame is a few skips around the cells
+  that changed. time is the seconds since the recording started, taken from the Clock of the render loop.
+  Values are stored in the byte order of the machine that recorded them, like snapshots
+*/
+const uint32_t recording_version = 1;
+
+struct Recording_Header {
+  char magic[8];              // "ARTREC"
+  uint32_t version;
+  uint32_t byte_order;        // 0x01020304 as written by the machine that recorded it
+  uint32_t width, height;     // cells of the window
+  uint32_t color_count;       // colors per frame, 0 without colors (with half blocks there are two per cell)
+  uint32_t color_mode;        // the Color_Mode and half blocks of the window, the player uses the same
+  uint32_t half_blocks;
+  uint32_t keyframe_interval;
+};
+
+struct Recording_Frame {
+  double time;
+  uint32_t size;              // bytes of runs that follow
+  uint32_t keyframe;
+};
+
+enum Run_Kind {RUN_SKIP, RUN_REPEAT, RUN_COPY};
+
+inline void put_varint(std::vector<uint8_t> *out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back((uint8_t)value | 0x80);
+    value >>= 7;
+  }
+  out->push_back((uint8_t)value);
+}
+
+// false when the varint doesn't end before end
+inline bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+  *value = 0;
+  for (int shift=0; *p < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*p)++;
+    *value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {return true;}
+  }
+  return false;
+}
+
+inline void put_run(std::vector<uint8_t> *out, Run_Kind kind, int count) {put_varint(out, (uint64_t)count*4 + kind);}
+
+/*
+  Appends the runs of n values to out, previous is the frame before or nullptr for a keyframe.
+  A value that is only repeated twice is cheaper as part of a copy, and a single unchanged character
+  is as big as its skip, so both just go into the copy around them
+*/
+template <typename T>
+void encode_runs(const T *values, const T *previous, int n, std::vector<uint8_t> *out) {
+  int copy_start = 0;
+  auto flush_copy = [&](int end) {
+    if (end == copy_start) {return;}
+    put_run(out, RUN_COPY, end - copy_start);
+    const uint8_t *bytes = (const uint8_t*)(values + copy_start);
+    out->insert(out->end(), bytes, bytes + (end - copy_start)*sizeof(T));
+  };
+  int i = 0;
+  while (i < n) {
+    int skip = 0;
+    if (previous) {
+      while (i+skip < n && values[i+skip] == previous[i+skip]) {skip++;}
+    }
+    if (skip >= 2 || (skip == 1 && sizeof(T) > 1)) {
+      flush_copy(i);
+      put_run(out, RUN_SKIP, skip);
+      i += skip;
+      copy_start = i;
+      continue;
+    }
+    int repeat = 1;
+    while (i+repeat < n && values[i+repeat] == values[i]) {repeat++;}
+    if (repeat >= 3) {
+      flush_copy(i);
+      put_run(out, RUN_REPEAT, repeat);
+      const uint8_t *bytes = (const uint8_t*)(values + i);
+      out->insert(out->end(), bytes, bytes + sizeof(T));
+      i += repeat;
+      copy_start = i;
+      continue;
+    }
+    i++;
+  }
+  flush_copy(n);
+}
+
+// decodes n values into values, which has to hold the frame before unless it is a keyframe, advances *p past them
+template <typename T>
+bool decode_runs(const uint8_t **p, const uint8_t *end, T *values, int n, bool keyframe) {
+  int i = 0;
+  while (i < n) {
+    uint64_t run;
+    if (!get_varint(p, end, &run)) {return false;}
+    uint64_t count = run / 4;
+    if (count == 0 || count > (uint64_t)(n - i)) {return false;}
+    switch (run % 4) {
+      case RUN_SKIP:
+        if (keyframe) {return false;}
+        break;
+      case RUN_REPEAT: {
+        if ((size_t)(end - *p) < sizeof(T)) {return false;}
+        T value;
+        memcpy(&value, *p, sizeof(T));
+        *p += sizeof(T);
+        for (uint64_t j=0; j<count; j++) {values[i+j] = value;}
+        break;
+      }
+      case RUN_COPY:
+        if ((uint64_t)(end - *p) < count*sizeof(T)) {return false;}
+        memcpy(values + i, *p, count*sizeof(T));
+        *p += count*sizeof(T);
+        break;
+      default:
+        return false;
+    }
+    i += count;
+  }
+  return true;
+}
+
+/*
+  Writes a recording while the render loop goes on
+
+  record() copies the frame into a free slot and hands it to an encoder thread through a Spsc_Ring, so all
+  the render loop pays is a memcpy. The encoder keeps the frame before, builds the runs and writes them to the
+  file. If the encoder is so far behind that every slot is waiting record() waits for one, stalls counts how often
+*/
+class Recorder {
+private:
+  struct Slot {
+    std::vector<char> pixels;
+    std::vector<Color> colors;
+    double time;
+  };
+  FILE *file = nullptr;
+  Recording_Header header;
+  std::vector<Slot> slots;
+  Spsc_Ring<Slot*> free_slots, ready_slots;
+  std::thread encoder_thread;
+  std::atomic<bool> stopping;
+  // only used by the encoder thread
+  std::vector<char> previous_pixels;
+  std::vector<Color> previous_colors;
+  std::vector<uint8_t> runs;
+  uint64_t encoded = 0;
+  void encode();
+  void write_frame(Slot *slot);
+public:
+  uint64_t frames = 0;               // frames given to record()
+  uint64_t stalls = 0;               // times record() had to wait for the encoder
+  std::atomic<uint64_t> bytes_written; // the size of the file so far
+  Recorder(int slot_count = 4) : slots(slot_count), free_slots(slot_count), ready_slots(slot_count), stopping(false), bytes_written(0) {};
+  ~Recorder() {finish();};
+  // creates the file and starts the encoder thread, false if the file can't be written
+  bool start(const char *path, int width, int height, size_t color_count, Color_Mode color_mode, bool half_blocks,
+             int keyframe_interval = 300);
+  bool recording() {return file != nullptr;};
+  // pixels has width*height characters, colors as many colors per cell as the recording or is nullptr when color_count is 0.
+  // A frame of another size than the recording (the terminal was resized) is cut off or filled up with empty cells
+  void record(char *pixels, Color *colors, int width, int height, double time);
+  // encodes every frame that was recorded and closes the file
+  void finish();
+};
+
+bool Recorder::start(const char *path, int width, int height, size_t color_count, Color_Mode color_mode, bool half_blocks,
+                     int keyframe_interval) {
+  file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, "ARTREC");
+  header.version = recording_version;
+  header.byte_order = 0x01020304;
+  header.width = width;
+  header.height = height;
+  header.color_count = color_count;
+  header.color_mode = color_mode;
+  header.half_blocks = half_blocks;
+  header.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+  fwrite(&header, sizeof(header), 1, file);
+  bytes_written = sizeof(header);
+  for (auto& slot : slots) {
+    slot.pixels.resize(width * height);
+    slot.colors.resize(color_count);
+    free_slots.push(&slot);
+  }
+  previous_pixels.resize(width * height);
+  previous_colors.resize(color_count);
+  encoder_thread = std::thread(&Recorder::encode, this);
+  return true;
+}
+
+// copies the top left of a width x height frame into one of target_width x target_height, the rest is fill
+template <typename T>
+void copy_cropped(const T *values, int width, int height, T *target, int target_width, int target_height, T fill) {
+  for (int y=0; y<target_height; y++) {
+    int copied = y < height ? std::min(width, target_width) : 0;
+    if (copied > 0) {std::copy(values + y*width, values + y*width + copied, target + y*target_width);}
+    std::fill(target + y*target_width + copied, target + (y+1)*target_width, fill);
+  }
+}
+
+void Recorder::record(char *pixels, Color *colors, int width, int height, double time) {
+  if (!file) {return;}
+  Slot *slot;
+  if (!free_slots.pop(&slot)) {
+    stalls++;
+    int waited = 0;
+    while (!free_slots.pop(&slot)) {pipeline_wait(&waited);}
+  }
+  if ((uint32_t)width == header.width && (uint32_t)height == header.height) {
+    memcpy(slot->pixels.data(), pixels, slot->pixels.size());
+    if (colors) {memcpy(slot->colors.data(), colors, slot->colors.size()*sizeof(Color));}
+  } else {
+    copy_cropped(pixels, width, height, slot->pixels.data(), header.width, header.height, ' ');
+    // with half blocks there are two rows of colors for every row of cells
+    int color_rows = header.color_count / (header.width*header.height);
+    if (colors) {copy_cropped(colors, width, height*color_rows, slot->colors.data(), header.width, header.height*color_rows, (Color)0);}
+  }
+  slot->time = time;
+  frames++;
+  ready_slots.push(slot);
+}
+
+void Recorder::encode() {
+  int waited = 0;
+  while (true) {
+    Slot *slot;
+    if (!ready_slots.pop(&slot)) {
+      if (stopping.load(std::memory_order_acquire)) {
+        // stopping is set after the last record(), once it is seen that frame can be popped too
+        if (!ready_slots.pop(&slot)) {return;}
+      } else {
+        pipeline_wait(&waited);
+        continue;
+      }
+    }
+    waited = 0;
+    write_frame(slot);
+    free_slots.push(slot);
+  }
+}
+
+void Recorder::write_frame(Slot *slot) {
+  bool keyframe = encoded % header.keyframe_interval == 0;
+  runs.clear();
+  encode_runs(slot->pixels.data(), keyframe ? nullptr : previous_pixels.data(), slot->pixels.size(), &runs);
+  if (header.color_count) {
+    encode_runs(slot->colors.data(), keyframe ? nullptr : previous_colors.data(), slot->colors.size(), &runs);
+  }
+  Recording_Frame frame = {slot->time, (uint32_t)runs.size(), keyframe};
+  fwrite(&frame, sizeof(frame), 1, file);
+  fwrite(runs.data(), 1, runs.size(), file);
+  bytes_written += sizeof(frame) + runs.size();
+  std::swap(previous_pixels, slot->pixels);
+  std::swap(previous_colors, slot->colors);
+  encoded++;
+}
+
+void Recorder::finish() {
+  if (!file) {return;}
+  stopping.store(true, std::memory_order_release);
+  encoder_thread.join();
+  fclose(file);
+  file = nullptr;
+}
+
+/*
+  Reads a recording one frame at a time, so a long one is never in memory as a whole.
+  pixels and colors are the frame that next() decoded last
+*/
+class Recording_Reader {
+private:
+  FILE *file = nullptr;
+  std::vector<uint8_t> runs;
+  bool decoded_keyframe = false; // skips need a frame before them
+public:
+  Recording_Header header;
+  std::vector<char> pixels;
+  std::vector<Color> colors;
+  Recording_Frame frame;
+  uint64_t frame_index = 0;      // of the frame in pixels, counted from 1
+  ~Recording_Reader() {if (file) {fclose(file);}};
+  // false (with a message) if the file isn't a recording this build can read
+  bool open(const char *path);
+  // false at the end of the recording or when the rest of it is broken
+  bool next();
+  // goes back to the first frame
+  void rewind();
+  Color *color_data() {return colors.empty() ? nullptr : colors.data();};
+};
+
+bool Recording_Reader::open(const char *path) {
+  file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  if (fread(&header, sizeof(header), 1, file) != 1 || strncmp(header.magic, "ARTREC", sizeof(header.magic)) ||
+      header.version != recording_version || header.byte_order != 0x01020304) {
+    fprintf(stderr, "%s: not a recording of this version\n", path);
+    return false;
+  }
+  // the same limits as the frames sent to workers, in 64 bits so that the cell count can't wrap around.
+  // The colors are the ones of a Window of that size: none, one per cell or two with half blocks
+  uint64_t cells = (uint64_t)header.width * header.height;
+  uint64_t window_colors = header.half_blocks ? 2*cells : cells;
+  if (header.width == 0 || header.height == 0 || header.width > 1<<16 || header.height > 1<<16 ||
+      (header.color_count != 0 && header.color_count != window_colors)) {
+    fprintf(stderr, "%s: broken header\n", path);
+    return false;
+  }
+  pixels.assign(cells, ' ');
+  colors.assign(header.color_count, 0);
+  return true;
+}
+
+bool Recording_Reader::next() {
+  if (fread(&frame, sizeof(frame), 1, file) != 1) {return false;}
+  runs.resize(frame.size);
+  if (fread(runs.data(), 1, frame.size, file) != frame.size) {return false;}
+  if (!frame.keyframe && !decoded_keyframe) {return false;}
+  const uint8_t *p = runs.data(), *end = runs.data() + runs.size();
+  if (!decode_runs(&p, end, pixels.data(), pixels.size(), frame.keyframe) ||
+      !decode_runs(&p, end, colors.data(), colors.size(), frame.keyframe) || p != end) {
+    return false;
+  }
+  decoded_keyframe = true;
+  frame_index++;
+  return true;
+}
+
+void Recording_Reader::rewind() {
+  fseek(file, sizeof(header), SEEK_SET);
+  decoded_keyframe = false;
+  frame_index = 0;
+}
@@ -1,95 +1,805 @@
+#pragma once
 #include "scene.hpp"
+#include "compiled_scene.hpp"
 #include "vector.hpp"
 #include "ray.hpp"
+#include "packet.hpp"
+#include "lighting_cache.hpp"
+#include "thread_pool.hpp"
+#include "arena.hpp"
+#include "profiler.hpp"
+#include "light.hpp"
+#include "color.hpp"
+#include <atomic>
+#include <chrono>
 #include <vector>
 #include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+
+// the characters used for brightness, from dark to bright
+const char grayscale_ramp[] = " .:-=+*#%@";
 
 class Renderer {
 public:
   int window_width, window_height;
   bool shadows; // if shadows should be rendered
+  bool packet_tracing = false; // if primary rays are traced PACKET_WIDTH at a time
+  // the frame is split into tiles of this size which the threads of the pool take one after another,
+  // tile_width is a multiple of every PACKET_WIDTH so that packets never cross a tile border
+  int tile_width = 32, tile_height = 4;
+  Thread_Pool pool; // pool.stats holds the time each thread spent on the last frame
+  // adaptive antialiasing: after every cell got its ray, cells on an edge (a neighbour shows a different
+  // character or a different primitive) get 4 more rays and show the average brightness.
+  // aa_sample_budget is the most extra rays one frame may trace, 0 turns antialiasing off.
+  // If there are more edge cells than the budget allows the ones with the highest contrast are refined
+  int aa_sample_budget = 0;
+  int aa_samples_traced = 0; // extra rays traced in the last frame
+  // temporal mode: every cell remembers what its ray hit, the next frame moves those hit points to where
+  // they are seen from the new camera position and only traces the cells that didn't get a usable point.
+  // A cached point is used when it lands at most temporal_error cells away from the center of a cell
+  // (0.5 takes every point that lands in the cell, smaller values trace more cells but are closer to a full render),
+  // temporal_refresh is the fraction of cells that are traced again every frame anyway (a different
+  // set of cells each frame). Reflective surfaces and object edges are always traced, and the whole
+  // cache is thrown away when the scene, its geometry (Compiled_Scene::geometry_version) or a light changes
+  // or invalidate_temporal() is called
+  bool temporal = false;
+  float temporal_error = 0.5f;
+  float temporal_refresh = 0.125f;
+  int temporal_traced = 0; // cells traced in the last frame
+  // reflections are followed for at most max_reflection_depth bounces, the surface where a ray stops
+  // is shaded as if it wasn't reflective. Bounces deeper than shadow_depth don't trace a shadow ray.
+  // reflection_budget is the most reflection rays one frame may trace (0 is no limit), when it is used up
+  // the rest of the mirrors in the frame are shaded like that too, so the frame time stays bounded
+  int max_reflection_depth = 8;
+  int shadow_depth = 2;
+  int reflection_budget = 0;
+  int reflections_traced = 0; // reflection rays traced in the last frame, only counted when there is a budget
+  // progressive mode: every frame has to be done frame_budget seconds after threaded_render() was called.
+  // The frame is first covered with one ray per progressive_block x progressive_block cells, then the blocks
+  // are halved again and again until every cell has its own ray. On every level the blocks that differ most from
+  // their neighbours come first, whatever isn't done at the deadline stays coarse. As long as the camera,
+  // the light and the scene (including its geometry_version) stay the same the next frames continue where the last one stopped.
+  // The first coarse pass is always finished, it needs 1/(progressive_block^2) of the rays of a full frame.
+  // Replaces temporal mode and antialiasing while it is on
+  bool progressive = false;
+  double frame_budget = 1./60;
+  int progressive_block = 8; // a power of two
+  bool progressive_complete = false; // every cell has its own ray
+  int progressive_traced = 0; // rays traced in the last frame
+  // lighting cache: remembers which points can see which light (see lighting_cache.hpp), so that while only the
+  // camera moves the shadow rays are only traced near the edges of shadows. lighting.hits and lighting.misses
+  // count the shadow rays of the last frame that were skipped and traced
+  bool cache_lighting = false;
+  Lighting_Cache lighting;
+  // how many cells wide a rendered pixel is for every cell it is high, 2 when only every other column of the
+  // terminal gets a ray (see resolution.hpp), so that the picture covers the same field of view at any size
+  float pixel_aspect = 1.f;
+  // call this after the scene changed
+  void invalidate_temporal() {temporal_valid = false;};
+  // changes the size of the frame between two frames, what temporal and progressive mode kept of the old size is dropped
+  void resize(int window_width, int window_height);
   Renderer(int window_width, int window_height, bool shadows) : 
-    window_width(window_width), window_height(window_height), shadows(shadows) {};
+    window_width(window_width), window_height(window_height), shadows(shadows),
+    pool(std::max(1u, std::thread::hardware_concurrency())), reflection_rays(0), progressive_rays(0), progressive_interrupted(false) {};
+private:
+  std::vector<int> primary_hits;  // primitive the ray of every cell hit first, -1 for the background
+  std::vector<int> edge_cells;    // cells that get refined this frame
+  std::vector<int> edge_contrast; // how much a cell differs from its neighbours, same size as the frame
+  bool antialiasing() {return aa_sample_budget > 0;};
+  // the direction of the ray through the corner of the first cell and how far the next cell in x and y is from it
+  void frame_vectors(Camera *camera, Vec3f *pixel0, Vec3f *pixel_step_x, Vec3f *pixel_step_y, Vec3f *half_screen_x, Vec3f *half_screen_y);
+  Color *cell_color(int cell) {return frame_colors ? &frame_colors[cell] : nullptr;};
+  // what the ray of a cell hit in the last frame, for the background point is the direction of the ray
+  struct Cached_Cell {
+    Vec3f point;
+    int primitive;
+    char pixel;
+    Color color;
+    bool reusable; // false for reflective surfaces, their "color" changes with the camera
+  };
+  std::vector<Cached_Cell> temporal_cache, next_temporal_cache;
+  std::vector<int> reprojected;      // cache index that landed in every cell, -1 for none
+  std::vector<float> reprojected_depth;
+  std::vector<int> retrace_cells;
+  bool temporal_valid = false;
+  std::vector<Light> temporal_lights;
+  Compiled_Scene *temporal_scene = nullptr;
+  uint64_t temporal_geometry_version = 0;
+  int temporal_frame = 0;
+  // memory that is only needed during one frame, reset at the start of every frame so that
+  // rendering doesn't allocate once the first frame is done
+  Arena frame_scratch;
+  Color *frame_colors = nullptr; // where threaded_render() stores the color of every cell, nullptr when it shouldn't
+  std::atomic<int> reflection_rays; // counts against reflection_budget
+  std::vector<char> progressive_pixels;
+  std::vector<Color> progressive_colors;
+  std::vector<unsigned char> cell_block; // size of the block whose ray a cell shows, 1 when it has its own ray, 0 for none yet
+  std::vector<int> refine_cells, sorted_refine_cells;
+  std::vector<int> refine_priority; // contrast of every cell in refine_cells, same size as the frame
+  bool progressive_valid = false;
+  Compiled_Scene *progressive_scene = nullptr;
+  uint64_t progressive_geometry_version = 0;
+  Vec3f progressive_view[3]; // view_point, view_direction and view_up the progress belongs to
+  std::vector<Light> progressive_lights;
+  int progressive_fov = 0;
+  std::atomic<int> progressive_rays;
+  std::atomic<bool> progressive_interrupted;
+public:
   /*
     Traces a ray through the scene and and returns the "color" of that pixel.
-    In this ray tracer colors are displayed using characters
+    In this ray tracer colors are displayed using characters, if color isn't nullptr the real color is stored there too
+  */
+  char trace_ray(Compiled_Scene *scene, Ray *ray, std::vector<Light> *lights, Color *color = nullptr);
+  /*
+    Calculates the "color" of an intersection that was already found
+  */
+  char shade(Compiled_Scene *scene, Ray *ray, intersection_information *ii, std::vector<Light> *lights, Color *color = nullptr);
+  /*
+    Adds up the light that reaches an intersection, 1 is a fully lit surface
   */
-  char trace_ray(Object_List *scene, Ray *ray, Vec3f *light);
+  float direct_light(Compiled_Scene *scene, intersection_information *ii, std::vector<Light> *lights, bool cast_shadows);
+  /*
+    If anything is between the start of the ray and max_t, light_index picks the entry of the shadow cache
+  */
+  bool shadowed(Compiled_Scene *scene, Ray *ray, float max_t, int light_index);
+  /*
+    If anything is between the intersection and a light (sample is the sample of an area light) that is
+    distance away in direction, answered by the lighting cache when it can
+  */
+  bool light_blocked(Compiled_Scene *scene, intersection_information *ii, Vec3f direction, float distance, int light_index, int sample);
   /*
     Renders the Scene by calcuating what character each pixel should display.
-    render_framepart() renders a specified part of the frame
+    render_tile() renders the pixels from (x0,y0) up to but not including (x1,y1)
+  */
+  void render_tile(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                   Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1);
+  /*
+    Same as render_tile() but the primary rays of neighbouring pixels are traced together as a packet
   */
-  void render_framepart(Object_List *scene, Camera *camera, Vec3f *light, char *pixels,
-                        Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int thread_amount, int part);
+  void render_tile_packets(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                           Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1);
   /*
-    creates threads and  calls render_framepart()
+    Splits the frame into tiles and lets the thread pool render them with render_tile().
+    The pool is only recreated when thread_amount changes.
+    colors (the same size as pixels) gets the color of every cell for the color modes of the Window,
+    without it no colors are calculated
   */
-  void threaded_render(Object_List *scene, Camera *camera, Vec3f *light, char *pixels, int thread_amount);
+  void threaded_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels, int thread_amount,
+                       Color *colors = nullptr);
+  /*
+    Renders only the cells from (x0,y0) up to but not including (x1,y1) of the frame, the rest of pixels and colors
+    is left as it is. Used by the workers of distributed rendering (distributed.hpp),
+    antialiasing, temporal and progressive mode need the whole frame and don't apply here
+  */
+  void render_region(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels, int thread_amount,
+                     int x0, int y0, int x1, int y1, Color *colors = nullptr);
+  /*
+    Used by threaded_render() in temporal mode instead of rendering the tiles,
+    reprojects the cells of the last frame and traces the rest
+  */
+  void temporal_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                       Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, Vec3f half_screen_x, Vec3f half_screen_y);
+  // renders the tiles that cover the cells from (x0,y0) up to but not including (x1,y1)
+  void render_tiles(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                    Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1);
+  /*
+    Used by threaded_render() in progressive mode, refines the frame until frame_budget after frame_start
+  */
+  void progressive_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                          Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, std::chrono::steady_clock::time_point frame_start);
+  /*
+    Finds the cells on edges after the frame has been rendered and traces the extra rays for them
+  */
+  void antialias(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                 Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y);
 };
 
+// position of every character in grayscale_ramp, characters that aren't in it count as background
+struct Ramp_Lookup {
+  unsigned char index[256];
+  Ramp_Lookup() {
+    memset(index, 0, sizeof(index));
+    for (int i=0; grayscale_ramp[i]; i++) {index[(unsigned char)grayscale_ramp[i]] = i;}
+  };
+};
+const Ramp_Lookup ramp_lookup;
+inline int ramp_index(char c) {
+  return ramp_lookup.index[(unsigned char)c];
+}
+
 
-char Renderer::trace_ray(Object_List *scene, Ray *ray, Vec3f *light) {
-  char grayscale[] = " .:-=+*#%@";
-  int grayscale_length = sizeof(grayscale)/sizeof(grayscale[0])-1;
 
+char Renderer::trace_ray(Compiled_Scene *scene, Ray *ray, std::vector<Light> *lights, Color *color) {
   char pixel = ' '; // default background pixel
   intersection_information ii;
   if (scene->intersection(ray, &ii)) {
-    if (ii.reflective_surface) {
-      // if the object that we just hit is reflective we shoot a new ray from that intersection point
-      Vec3f reflected_ray_direction = ray->direction - ii.normal * 2.f*dot(ray->direction,ii.normal);
-      Ray reflected_ray(ii.point + reflected_ray_direction*0.11f, reflected_ray_direction);
-      pixel = trace_ray(scene, &reflected_ray, light);
-    } else {
-      // if the object is not refelctive we do shading
-      Vec3f l = (*light - ii.point).normalize();
-      if (shadows) {
-        // check if the ray going to the light hits anything
-        Ray light_ray(ii.point+l*0.01f, l);
-        if (scene->intersection(&light_ray, &ii)) {
-          // if it does the pixel is in shade
-          //pixel = grayscale[0];
-          pixel = ' ';
-          return pixel;
-        } 
-      } 
-      // if the pixel is getting light calculate lambertain lighting model
-      float diffuse = std::max(0.f, dot(ii.normal, l));
-      pixel = grayscale[(int)(diffuse*(grayscale_length))];
-    }
+    pixel = shade(scene, ray, &ii, lights, color);
+  } else if (color) {
+    *color = 0;
   }
   return pixel;
 }
 
-void Renderer::render_framepart(Object_List *scene, Camera *camera, Vec3f *light, char *pixels,
-                                Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int thread_amount, int part) {
-  // assign each thread a part of the frame
-  int y = window_height * (1./thread_amount) * part;
-  int y_max = window_height * (1./thread_amount) * (part+1);
-  // go through each pixel of that part and call trace_ray()
-  for (y; y<y_max; y++) {
-    for (int x=0; x<window_width; x++) {
+char Renderer::shade(Compiled_Scene *scene, Ray *ray, intersection_information *ii, std::vector<Light> *lights, Color *color) {
+  const char *grayscale = grayscale_ramp;
+  int grayscale_length = sizeof(grayscale_ramp)/sizeof(grayscale_ramp[0])-1;
+
+  // if the object that we hit is reflective we shoot a new ray from that intersection point,
+  // this is a loop instead of calling trace_ray() again so that two mirrors facing each other can't recurse forever
+  Ray bounce_ray = *ray;
+  intersection_information bounce_ii;
+  int depth = 0;
+  while (ii->reflective_surface && depth < max_reflection_depth) {
+    if (reflection_budget > 0 && reflection_rays.fetch_add(1, std::memory_order_relaxed) >= reflection_budget) {break;}
+    Vec3f reflected_ray_direction = bounce_ray.direction - ii->normal * 2.f*dot(bounce_ray.direction,ii->normal);
+    bounce_ray = Ray(ii->point + reflected_ray_direction*0.11f, reflected_ray_direction);
+    depth++;
+    PROFILE_REFLECTION(depth);
+    bounce_ii = intersection_information();
+    if (!scene->intersection(&bounce_ray, &bounce_ii)) {
+      if (color) {*color = 0;}
+      return ' ';
+    }
+    ii = &bounce_ii;
+  }
+
+  // the object is not reflective (or we stopped following the reflection), so we do shading
+  float brightness = direct_light(scene, ii, lights, shadows && depth <= shadow_depth);
+  if (color) {*color = scale_color(scene->primitive_colors[ii->primitive], std::min(brightness, 1.f));}
+  return grayscale[(int)(std::min(brightness, 1.f)*(grayscale_length))];
+}
+
+float Renderer::direct_light(Compiled_Scene *scene, intersection_information *ii, std::vector<Light> *lights, bool cast_shadows) {
+  float brightness = 0.f;
+  for (int i=0; i<(int)lights->size(); i++) {
+    // more light than 1 shows the same character, the other lights don't matter anymore
+    if (brightness >= 1.f) {break;}
+    Light *light = &(*lights)[i];
+    Vec3f to_light = light->center() - ii->point;
+    float distance_squared = dot(to_light, to_light);
+    // lights that can't reach the point are skipped before anything is traced
+    if (light->range > 0.f && distance_squared >= light->range*light->range) {continue;}
+    float light_distance = sqrtf(distance_squared);
+    Vec3f l = to_light / light_distance;
+    // lambertian lighting model
+    float strength = light->intensity * dot(ii->normal, l);
+    if (light->range > 0.f) {
+      float fade = 1.f - distance_squared/(light->range*light->range);
+      strength *= fade*fade;
+    }
+    if (light->type == SPOT_LIGHT) {
+      float cos_angle = -dot(l, light->direction);
+      if (cos_angle <= light->cos_outer) {continue;}
+      if (cos_angle < light->cos_inner) {
+        float s = (cos_angle - light->cos_outer) / (light->cos_inner - light->cos_outer);
+        strength *= s*s*(3.f - 2.f*s);
+      }
+    }
+    if (strength <= 0.f) {continue;}
+    if (cast_shadows) {
+      // check if anything is between the intersection point and the light
+      if (light->type == AREA_LIGHT) {
+        int samples = light->samples, visible = 0;
+        for (int u=0; u<samples; u++) {
+          for (int v=0; v<samples; v++) {
+            Vec3f sample = light->position + light->edge_u*((u+0.5f)/samples) + light->edge_v*((v+0.5f)/samples);
+            Vec3f to_sample = sample - ii->point;
+            float sample_distance = to_sample.length();
+            visible += !light_blocked(scene, ii, to_sample / sample_distance, sample_distance, i, u*samples + v);
+          }
+        }
+        strength *= (float)visible / (samples*samples);
+      } else {
+        if (light_blocked(scene, ii, l, light_distance, i, 0)) {continue;}
+      }
+    }
+    brightness += strength;
+  }
+  return brightness;
+}
+
+/*
+  Every thread remembers for each light the primitive that blocked the last shadow ray towards it.
+  Neighbouring pixels are usually shadowed by the same primitive, so that one is tested before the BVH.
+  It is only a guess that gets tested, so it doesn't matter which scene or renderer it came from
+*/
+const int shadow_cache_size = 64;
+thread_local int shadow_cache[shadow_cache_size]; // primitive+1, 0 for none
+
+bool Renderer::shadowed(Compiled_Scene *scene, Ray *ray, float max_t, int light_index) {
+  PROFILE_RAY(SHADOW_RAY);
+  int *cached = light_index < shadow_cache_size ? &shadow_cache[light_index] : nullptr;
+  if (cached && *cached > 0 && *cached <= (int)scene->primitives.size()) {
+    float t;
+    if (scene->primitive_hit(*cached-1, ray, std::fmin(ray->max_t, max_t), &t)) {return true;}
+  }
+  int occluder = -1;
+  bool occluded = scene->occluded(ray, max_t, &occluder);
+  // a lit point forgets the occluder, its neighbours are probably lit too and shouldn't test it for nothing
+  if (cached) {*cached = occluder+1;}
+  return occluded;
+}
+
+bool Renderer::light_blocked(Compiled_Scene *scene, intersection_information *ii, Vec3f direction, float distance, int light_index, int sample) {
+  Ray light_ray(ii->point+direction*0.01f, direction);
+  if (!cache_lighting) {return shadowed(scene, &light_ray, distance, light_index);}
+  int octant;
+  uint64_t key = lighting.key(ii->point, ii->primitive, light_index << 16 | sample, &octant);
+  return !lighting.visible(key, octant, [&]() {return shadowed(scene, &light_ray, distance, light_index);});
+}
+
+void Renderer::render_tile(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                           Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1) {
+  // go through each pixel of the tile and call trace_ray()
+  for (int y=y0; y<y1; y++) {
+    PROFILE_RAYS(PRIMARY_RAY, x1-x0);
+    for (int x=x0; x<x1; x++) {
       Vec3f pixel = pixel0 + pixel_step_x*x + pixel_step_y*y;
       Ray ray(camera->view_point, pixel.normalize());
-      pixels[window_width*y+x] = trace_ray(scene, &ray, light);
+      if (antialiasing()) {
+        // same as trace_ray() but remembers what was hit for the edge detection
+        intersection_information ii;
+        char c = ' ';
+        if (scene->intersection(&ray, &ii)) {
+          c = shade(scene, &ray, &ii, lights, cell_color(window_width*y+x));
+        } else if (frame_colors) {
+          frame_colors[window_width*y+x] = 0;
+        }
+        pixels[window_width*y+x] = c;
+        primary_hits[window_width*y+x] = ii.primitive;
+      } else {
+        pixels[window_width*y+x] = trace_ray(scene, &ray, lights, cell_color(window_width*y+x));
+      }
     }
   }
 }
-void Renderer::threaded_render(Object_List *scene, Camera *camera, Vec3f *light, char *pixels, int thread_amount) {
+void Renderer::render_tile_packets(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                                   Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1) {
+  float lane_offset[PACKET_WIDTH];
+  for (int i=0; i<PACKET_WIDTH; i++) lane_offset[i] = i;
+  Packet_Vec3 lane_step = Packet_Vec3(pixel_step_x) * Packet_Float::load(lane_offset);
+  for (int y=y0; y<y1; y++) {
+    PROFILE_RAYS(PRIMARY_RAY, x1-x0);
+    for (int x=x0; x<x1; x+=PACKET_WIDTH) {
+      // the packet covers PACKET_WIDTH pixels next to each other in the same row
+      Ray_Packet rays;
+      Packet_Vec3 pixel = Packet_Vec3(pixel0 + pixel_step_x*x + pixel_step_y*y) + lane_step;
+      Packet_Float inverse_length = Packet_Float(1.f) / packet_sqrt(dot(pixel, pixel));
+      rays.origin = Packet_Vec3(camera->view_point);
+      rays.direction = pixel * inverse_length;
+      rays.min_t = Packet_Float(0.f);
+      rays.max_t = Packet_Float(9999.f);
+      Hit_Packet hits;
+      packet_intersection(scene, &rays, &hits);
+      int primitives[PACKET_WIDTH];
+      hits.store_primitives(primitives);
+      // shading is done one ray at a time by intersecting only the primitive that was hit
+      for (int lane=0; lane<PACKET_WIDTH && x+lane<x1; lane++) {
+        Vec3f pixel = pixel0 + pixel_step_x*(x+lane) + pixel_step_y*y;
+        Ray ray(camera->view_point, pixel.normalize());
+        char c = ' ';
+        Color *color = cell_color(window_width*y+x+lane);
+        intersection_information ii;
+        if (primitives[lane] >= 0) {
+          if (scene->intersect_primitive(primitives[lane], &ray, &ii)) {
+            c = shade(scene, &ray, &ii, lights, color);
+          } else {
+            c = trace_ray(scene, &ray, lights, color);
+          }
+        } else if (color) {
+          *color = 0;
+        }
+        pixels[window_width*y+x+lane] = c;
+        if (antialiasing()) {primary_hits[window_width*y+x+lane] = primitives[lane];}
+      }
+    }
+  }
+}
+void Renderer::frame_vectors(Camera *camera, Vec3f *pixel0, Vec3f *pixel_step_x, Vec3f *pixel_step_y,
+                             Vec3f *half_screen_x, Vec3f *half_screen_y) {
+  *half_screen_x = cross(camera->view_direction, camera->view_up); 
+  *half_screen_y = cross(camera->view_direction, *half_screen_x)*2.f;
+  *half_screen_x = *half_screen_x * (float)tan((camera->FOV/2.)*3.141592/180.);
+  *half_screen_y = *half_screen_y * (float)tan(((camera->FOV*((float)window_height/(window_width*pixel_aspect)))/2.)*3.141592/180.);
+  *pixel0 = camera->view_direction - *half_screen_x - *half_screen_y;
+  *pixel_step_x = *half_screen_x / ((float)window_width/2);
+  *pixel_step_y = *half_screen_y / ((float)window_height/2);
+}
+void Renderer::resize(int window_width, int window_height) {
+  if (window_width == this->window_width && window_height == this->window_height) {return;}
+  this->window_width = window_width;
+  this->window_height = window_height;
+  // the buffers follow on their own when their size doesn't match, but a frame with as many cells in a different shape would reuse them
+  temporal_valid = false;
+  progressive_valid = false;
+}
+void Renderer::threaded_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels, int thread_amount,
+                               Color *colors) {
   // calculating different camera vectors
-  Vec3f half_screen_x = cross(camera->view_direction, camera->view_up); 
-  Vec3f half_screen_y = cross(camera->view_direction, half_screen_x)*2.f;
-  half_screen_x = half_screen_x * (float)tan((camera->FOV/2.)*3.141592/180.);
-  half_screen_y = half_screen_y * (float)tan(((camera->FOV*((float)window_height/window_width))/2.)*3.141592/180.);
-  Vec3f pixel0 = camera->view_direction - half_screen_x - half_screen_y;
-  Vec3f pixel_step_x = half_screen_x / ((float)window_width/2);
-  Vec3f pixel_step_y = half_screen_y / ((float)window_height/2);
-
-  // each thread renders its own part of the frame
-  std::vector<std::thread> threads;
+  Vec3f pixel0, pixel_step_x, pixel_step_y, half_screen_x, half_screen_y;
+  frame_vectors(camera, &pixel0, &pixel_step_x, &pixel_step_y, &half_screen_x, &half_screen_y);
+
+  PROFILE_SCOPE("render");
+  auto t_start = std::chrono::steady_clock::now();
+  frame_scratch.reset();
+  frame_colors = colors;
+  reflection_rays = 0;
+  if (cache_lighting) {lighting.begin_frame(scene, scene->geometry_version, lights);}
+  thread_amount = std::max(1, thread_amount); // hardware_concurrency() returns 0 if it doesn't know
+  if (pool.size() != thread_amount) {
+    pool.resize(thread_amount);
+  }
+  if (antialiasing() && primary_hits.size() != (size_t)window_width*window_height) {
+    primary_hits.resize(window_width*window_height);
+    edge_contrast.resize(window_width*window_height);
+  }
+  if (progressive) {
+    temporal_valid = false;
+    progressive_render(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, t_start);
+    reflections_traced = std::min(reflection_rays.load(), reflection_budget);
+    PROFILE_FRAME_END();
+    return;
+  }
+  progressive_valid = false;
+  if (temporal) {
+    temporal_render(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, half_screen_x, half_screen_y);
+  } else {
+    temporal_valid = false;
+    render_tiles(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, 0, 0, window_width, window_height);
+  }
+  aa_samples_traced = 0;
+  if (antialiasing()) {
+    antialias(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y);
+  }
+  reflections_traced = std::min(reflection_rays.load(), reflection_budget);
+  PROFILE_FRAME_END();
+}
+void Renderer::render_region(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels, int thread_amount,
+                             int x0, int y0, int x1, int y1, Color *colors) {
+  Vec3f pixel0, pixel_step_x, pixel_step_y, half_screen_x, half_screen_y;
+  frame_vectors(camera, &pixel0, &pixel_step_x, &pixel_step_y, &half_screen_x, &half_screen_y);
+  PROFILE_SCOPE("render");
+  frame_colors = colors;
+  reflection_rays = 0;
+  if (cache_lighting) {lighting.begin_frame(scene, scene->geometry_version, lights);}
+  thread_amount = std::max(1, thread_amount);
+  if (pool.size() != thread_amount) {
+    pool.resize(thread_amount);
+  }
+  temporal_valid = false;
+  progressive_valid = false;
+  render_tiles(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, x0, y0, x1, y1);
+}
+void Renderer::render_tiles(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                            Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, int x0, int y0, int x1, int y1) {
+  int tiles_x = (x1-x0 + tile_width-1) / tile_width;
+  int tiles_y = (y1-y0 + tile_height-1) / tile_height;
+  pool.run(tiles_x*tiles_y, [&](int tile, int /*worker*/) {
+    PROFILE_SCOPE("tile");
+    int tile_x0 = x0 + (tile % tiles_x) * tile_width;
+    int tile_y0 = y0 + (tile / tiles_x) * tile_height;
+    int tile_x1 = std::min(tile_x0 + tile_width, x1);
+    int tile_y1 = std::min(tile_y0 + tile_height, y1);
+    if (packet_tracing) {
+      render_tile_packets(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, tile_x0, tile_y0, tile_x1, tile_y1);
+    } else {
+      render_tile(scene, camera, lights, pixels, pixel0, pixel_step_x, pixel_step_y, tile_x0, tile_y0, tile_x1, tile_y1);
+    }
+  });
+}
+void Renderer::progressive_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                                  Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, std::chrono::steady_clock::time_point frame_start) {
+  auto deadline = frame_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(frame_budget));
+  int cells = window_width*window_height;
+  Vec3f view[3] = {camera->view_point, camera->view_direction, camera->view_up};
+  bool same_view = progressive_valid && scene == progressive_scene && scene->geometry_version == progressive_geometry_version &&
+                   camera->FOV == progressive_fov && cell_block.size() == (size_t)cells && same_lights(*lights, progressive_lights);
+  for (int i=0; i<3 && same_view; i++) {
+    same_view = view[i].x == progressive_view[i].x && view[i].y == progressive_view[i].y && view[i].z == progressive_view[i].z;
+  }
+  if (!same_view) {
+    cell_block.assign(cells, 0);
+    progressive_pixels.assign(cells, ' ');
+    progressive_colors.assign(cells, 0);
+    refine_priority.resize(cells);
+    std::copy(view, view+3, progressive_view);
+    progressive_lights = *lights;
+    progressive_scene = scene;
+    progressive_geometry_version = scene->geometry_version;
+    progressive_fov = camera->FOV;
+    progressive_valid = true;
+  }
+  progressive_rays = 0;
+  progressive_interrupted = false;
+
+  for (int block=progressive_block; block>=1; block/=2) {
+    // the cell in the top left corner of every block traces the ray for the whole block
+    refine_cells.clear();
+    for (int y=0; y<window_height; y+=block) {
+      for (int x=0; x<window_width; x+=block) {
+        if (cell_block[window_width*y+x] != 1) {refine_cells.push_back(window_width*y+x);}
+      }
+    }
+    if (refine_cells.empty()) {continue;}
+    bool coarsest = block == progressive_block;
+    if (!coarsest) {
+      // a block whose coarse value differs a lot from the blocks around it is probably on an edge, those go first
+      for (int cell : refine_cells) {
+        int x = cell % window_width, y = cell / window_width;
+        int brightness = ramp_index(progressive_pixels[cell]);
+        int neighbours[4][2] = {{x-block,y}, {x+block,y}, {x,y-block}, {x,y+block}};
+        int contrast = 0;
+        for (auto& n : neighbours) {
+          if (n[0] < 0 || n[0] >= window_width || n[1] < 0 || n[1] >= window_height) {continue;}
+          contrast = std::max(contrast, std::abs(ramp_index(progressive_pixels[window_width*n[1]+n[0]]) - brightness));
+        }
+        refine_priority[cell] = contrast;
+      }
+      // the contrast is a difference of two ramp positions, so a counting sort is enough
+      const int levels = sizeof(grayscale_ramp);
+      int starts[levels+1] = {0};
+      for (int cell : refine_cells) {starts[levels-1-refine_priority[cell] + 1]++;}
+      for (int i=0; i<levels; i++) {starts[i+1] += starts[i];}
+      sorted_refine_cells.resize(refine_cells.size());
+      for (int cell : refine_cells) {sorted_refine_cells[starts[levels-1-refine_priority[cell]]++] = cell;}
+      std::swap(refine_cells, sorted_refine_cells);
+      if (std::chrono::steady_clock::now() >= deadline) {
+        progressive_interrupted = true;
+        break;
+      }
+    }
+
+    const int cells_per_task = 32;
+    int tasks = (refine_cells.size() + cells_per_task-1) / cells_per_task;
+    // the blocks of one level don't overlap, so the tasks never write the same cells
+    pool.run(tasks, [&](int task, int /*worker*/) {
+      if (!coarsest && std::chrono::steady_clock::now() >= deadline) {
+        progressive_interrupted = true;
+        return;
+      }
+      PROFILE_SCOPE("progressive");
+      int end = std::min((int)refine_cells.size(), (task+1)*cells_per_task);
+      PROFILE_RAYS(PRIMARY_RAY, end - task*cells_per_task);
+      for (int i=task*cells_per_task; i<end; i++) {
+        int cell = refine_cells[i];
+        int x0 = cell % window_width, y0 = cell / window_width;
+        Vec3f pixel = pixel0 + pixel_step_x*x0 + pixel_step_y*y0;
+        Ray ray(camera->view_point, pixel.normalize());
+        Color color = 0;
+        char c = trace_ray(scene, &ray, lights, &color);
+        // cells that already got a value from a smaller block keep it
+        int x1 = std::min(x0+block, window_width), y1 = std::min(y0+block, window_height);
+        for (int y=y0; y<y1; y++) {
+          for (int x=x0; x<x1; x++) {
+            unsigned char *size = &cell_block[window_width*y+x];
+            if (*size == 0 || *size > block) {
+              *size = block;
+              progressive_pixels[window_width*y+x] = c;
+              progressive_colors[window_width*y+x] = color;
+            }
+          }
+        }
+        cell_block[cell] = 1;
+        progressive_pixels[cell] = c;
+        progressive_colors[cell] = color;
+      }
+      progressive_rays += end - task*cells_per_task;
+    });
+    if (progressive_interrupted) {break;}
+  }
+  progressive_traced = progressive_rays;
+  progressive_complete = !progressive_interrupted;
+  std::copy(progressive_pixels.begin(), progressive_pixels.end(), pixels);
+  if (frame_colors) {std::copy(progressive_colors.begin(), progressive_colors.end(), frame_colors);}
+}
+void Renderer::temporal_render(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                               Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y, Vec3f half_screen_x, Vec3f half_screen_y) {
+  PROFILE_SCOPE("reproject");
+  int cells = window_width*window_height;
+  // the cached points are where things were, once something moved they can't be reused
+  if (temporal_cache.size() != (size_t)cells || !same_lights(*lights, temporal_lights) || scene != temporal_scene ||
+      scene->geometry_version != temporal_geometry_version) {
+    temporal_valid = false;
+    temporal_cache.resize(cells);
+    next_temporal_cache.resize(cells);
+    reprojected.resize(cells);
+    reprojected_depth.resize(cells);
+  }
+  temporal_lights = *lights;
+  temporal_scene = scene;
+  temporal_geometry_version = scene->geometry_version;
+  temporal_frame++;
+
+  // move every cached point to the cell it is seen in now, when several land in the same cell the closest one wins.
+  // A point p is seen in cell (x,y) when p-view_point points along view_direction + half_screen_x*(2x/w-1) + half_screen_y*(2y/h-1)
+  std::fill(reprojected.begin(), reprojected.end(), -1);
+  if (temporal_valid) {
+    float half_x_squared = dot(half_screen_x, half_screen_x);
+    float half_y_squared = dot(half_screen_y, half_screen_y);
+    for (int i=0; i<cells; i++) {
+      Cached_Cell *cached = &temporal_cache[i];
+      if (!cached->reusable) {continue;}
+      // the background is infinitely far away so only its direction matters
+      Vec3f to_point = cached->primitive >= 0 ? cached->point - camera->view_point : cached->point;
+      float depth = dot(to_point, camera->view_direction);
+      if (depth <= 0.f) {continue;}
+      float x = (dot(to_point, half_screen_x) / (depth*half_x_squared) + 1.f) * window_width/2.f;
+      float y = (dot(to_point, half_screen_y) / (depth*half_y_squared) + 1.f) * window_height/2.f;
+      int cell_x = (int)floorf(x + 0.5f);
+      int cell_y = (int)floorf(y + 0.5f);
+      if (cell_x < 0 || cell_x >= window_width || cell_y < 0 || cell_y >= window_height) {continue;}
+      if (std::max(std::fabs(x-cell_x), std::fabs(y-cell_y)) > temporal_error) {continue;}
+      if (cached->primitive < 0) {depth = FLT_MAX;}
+      int cell = window_width*cell_y + cell_x;
+      if (reprojected[cell] == -1 || depth < reprojected_depth[cell]) {
+        reprojected[cell] = i;
+        reprojected_depth[cell] = depth;
+      }
+    }
+  }
+
+  // a cell that got no point but lies between two cells that show the same primitive with the same character
+  // (left and right or above and below) shows that too, its point is put halfway between theirs
+  auto fill_hole = [this](int x, int y, Cached_Cell *filled) {
+    int pairs[2][2][2] = {{{x-1,y}, {x+1,y}}, {{x,y-1}, {x,y+1}}};
+    for (auto& pair : pairs) {
+      if (pair[0][0] < 0 || pair[0][1] < 0 || pair[1][0] >= window_width || pair[1][1] >= window_height) {continue;}
+      int a = reprojected[window_width*pair[0][1]+pair[0][0]];
+      int b = reprojected[window_width*pair[1][1]+pair[1][0]];
+      if (a == -1 || b == -1) {continue;}
+      Cached_Cell *cell_a = &temporal_cache[a];
+      Cached_Cell *cell_b = &temporal_cache[b];
+      if (cell_a->primitive != cell_b->primitive || cell_a->pixel != cell_b->pixel) {continue;}
+      *filled = *cell_a;
+      filled->point = (cell_a->point + cell_b->point) * 0.5f;
+      return true;
+    }
+    return false;
+  };
+
+  // everything that didn't get a point, sits on an edge between two primitives or is due for a refresh is traced again
+  int refresh_period = std::max(1, (int)(1.f/std::max(temporal_refresh, 1e-6f) + 0.5f));
+  retrace_cells.clear();
+  for (int y=0; y<window_height; y++) {
+    for (int x=0; x<window_width; x++) {
+      int cell = window_width*y+x;
+      Cached_Cell filled;
+      Cached_Cell *cached = nullptr;
+      if (reprojected[cell] != -1) {
+        cached = &temporal_cache[reprojected[cell]];
+      } else if (fill_hole(x, y, &filled)) {
+        cached = &filled;
+      }
+      bool retrace = !cached || (cell + temporal_frame) % refresh_period == 0;
+      int neighbours[4][2] = {{x-1,y}, {x+1,y}, {x,y-1}, {x,y+1}};
+      for (int n=0; n<4 && !retrace; n++) {
+        if (neighbours[n][0] < 0 || neighbours[n][0] >= window_width || neighbours[n][1] < 0 || neighbours[n][1] >= window_height) {continue;}
+        int neighbour_source = reprojected[window_width*neighbours[n][1]+neighbours[n][0]];
+        retrace = neighbour_source != -1 && temporal_cache[neighbour_source].primitive != cached->primitive;
+      }
+      if (retrace) {
+        retrace_cells.push_back(cell);
+      } else {
+        next_temporal_cache[cell] = *cached;
+        pixels[cell] = cached->pixel;
+        if (frame_colors) {frame_colors[cell] = cached->color;}
+        if (antialiasing()) {primary_hits[cell] = cached->primitive;}
+      }
+    }
+  }
+  temporal_traced = retrace_cells.size();
+
+  const int cells_per_task = 64;
+  int tasks = (retrace_cells.size() + cells_per_task-1) / cells_per_task;
+  pool.run(tasks, [&](int task, int /*worker*/) {
+    PROFILE_SCOPE("retrace");
+    int end = std::min((int)retrace_cells.size(), (task+1)*cells_per_task);
+    PROFILE_RAYS(PRIMARY_RAY, end - task*cells_per_task);
+    for (int i=task*cells_per_task; i<end; i++) {
+      int cell = retrace_cells[i];
+      Vec3f pixel = pixel0 + pixel_step_x*(cell % window_width) + pixel_step_y*(cell / window_width);
+      Ray ray(camera->view_point, pixel.normalize());
+      Cached_Cell *cached = &next_temporal_cache[cell];
+      intersection_information ii;
+      char c = ' ';
+      cached->color = 0;
+      if (scene->intersection(&ray, &ii)) {
+        c = shade(scene, &ray, &ii, lights, &cached->color);
+        cached->point = ii.point;
+        cached->reusable = !ii.reflective_surface;
+      } else {
+        cached->point = ray.direction;
+        cached->reusable = true;
+      }
+      cached->primitive = ii.primitive;
+      cached->pixel = c;
+      pixels[cell] = c;
+      if (frame_colors) {frame_colors[cell] = cached->color;}
+      if (antialiasing()) {primary_hits[cell] = ii.primitive;}
+    }
+  });
+  std::swap(temporal_cache, next_temporal_cache);
+  temporal_valid = true;
+}
+void Renderer::antialias(Compiled_Scene *scene, Camera *camera, std::vector<Light> *lights, char *pixels,
+                         Vec3f pixel0, Vec3f pixel_step_x, Vec3f pixel_step_y) {
+  const int samples_per_cell = 4;
+  // a different primitive always counts as more contrast than any brightness difference
+  const int primitive_contrast = sizeof(grayscale_ramp);
+  edge_cells.clear();
+  for (int y=0; y<window_height; y++) {
+    for (int x=0; x<window_width; x++) {
+      int cell = window_width*y+x;
+      int brightness = ramp_index(pixels[cell]);
+      int contrast = 0;
+      int neighbours[4][2] = {{x-1,y}, {x+1,y}, {x,y-1}, {x,y+1}};
+      for (auto& n : neighbours) {
+        if (n[0] < 0 || n[0] >= window_width || n[1] < 0 || n[1] >= window_height) {continue;}
+        int neighbour = window_width*n[1]+n[0];
+        if (primary_hits[neighbour] != primary_hits[cell]) {
+          contrast = std::max(contrast, primitive_contrast);
+        } else if (pixels[neighbour] != pixels[cell]) {
+          contrast = std::max(contrast, std::abs(ramp_index(pixels[neighbour]) - brightness));
+        }
+      }
+      edge_contrast[cell] = contrast;
+      if (contrast > 0) {edge_cells.push_back(cell);}
+    }
+  }
+  size_t max_cells = aa_sample_budget / samples_per_cell;
+  if (edge_cells.size() > max_cells) {
+    std::nth_element(edge_cells.begin(), edge_cells.begin() + max_cells, edge_cells.end(),
+                     [this](int a, int b) {return edge_contrast[a] > edge_contrast[b];});
+    edge_cells.resize(max_cells);
+  }
+  aa_samples_traced = edge_cells.size() * samples_per_cell;
+
+  // the new characters only depend on the rays of the cell itself, so writing them while other
+  // threads are still working on their cells is fine
+  const int cells_per_task = 64;
+  int tasks = (edge_cells.size() + cells_per_task-1) / cells_per_task;
+  if (tasks == 0) {return;}
+  int thread_amount = pool.size();
+  Worker_Stats *render_stats = frame_scratch.create_array<Worker_Stats>(thread_amount);
+  std::copy(pool.stats.begin(), pool.stats.end(), render_stats);
+  pool.run(tasks, [&](int task, int /*worker*/) {
+    PROFILE_SCOPE("antialias");
+    int end = std::min((int)edge_cells.size(), (task+1)*cells_per_task);
+    PROFILE_RAYS(ANTIALIAS_RAY, (end - task*cells_per_task)*samples_per_cell);
+    for (int i=task*cells_per_task; i<end; i++) {
+      int cell = edge_cells[i];
+      float x = cell % window_width;
+      float y = cell / window_width;
+      // the ray that was already traced counts as one sample, the others are spread around it in a 2x2 grid
+      int brightness = ramp_index(pixels[cell]);
+      int red = 0, green = 0, blue = 0;
+      if (frame_colors) {
+        red = color_red(frame_colors[cell]);
+        green = color_green(frame_colors[cell]);
+        blue = color_blue(frame_colors[cell]);
+      }
+      const float offsets[samples_per_cell][2] = {{-0.25f,-0.25f}, {0.25f,-0.25f}, {-0.25f,0.25f}, {0.25f,0.25f}};
+      for (auto& offset : offsets) {
+        Vec3f pixel = pixel0 + pixel_step_x*(x+offset[0]) + pixel_step_y*(y+offset[1]);
+        Ray ray(camera->view_point, pixel.normalize());
+        Color color = 0;
+        brightness += ramp_index(trace_ray(scene, &ray, lights, frame_colors ? &color : nullptr));
+        red += color_red(color);
+        green += color_green(color);
+        blue += color_blue(color);
+      }
+      int samples = samples_per_cell+1;
+      pixels[cell] = grayscale_ramp[(brightness + samples/2) / samples];
+      if (frame_colors) {frame_colors[cell] = rgb((red + samples/2) / samples, (green + samples/2) / samples, (blue + samples/2) / samples);}
+    }
+  });
+  // pool.stats should describe the whole frame, not only this pass
   for (int i=0; i<thread_amount; i++) {
-    threads.push_back(std::thread(&Renderer::render_framepart, this, scene, camera, light, pixels, 
-                                  pixel0, pixel_step_x, pixel_step_y, thread_amount, i));
+    pool.stats[i].busy_time += render_stats[i].busy_time;
+    pool.stats[i].tasks += render_stats[i].tasks;
+    pool.stats[i].stolen += render_stats[i].stolen;
   }
-  for (auto& t : threads) t.join();
 }
@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "color.hpp"
+#include "renderer.hpp"
+
+/*
+  Dynamic resolution: when frames take longer than the fps limit allows, fewer rays than there are cells are
+  traced and the picture is scaled up to the size of the terminal, so the frame rate stays the same from an
+  80x24 terminal up to a 400x100 one
+
+  The levels trace every cell, every other column, every other column and row, and every fourth column of every
+  other row. Columns go first because a cell is about twice as high as it is wide, that keeps the rendered pixels
+  close to square. update() is given the worktime of every frame (Clock::worktime, the frame time before the fps
+  limit waits). When the smoothed time has been over the budget for a few frames in a row the next lower
+  resolution is used. It goes back up when the time the higher resolution would need (the time now times how many
+  more rays it traces) has fit into 3/4 of the budget for a second. The gap between the two keeps it from going
+  back and forth, and the first frames after a change, which trace everything again because the temporal cache
+  starts over, don't count
+*/
+class Resolution_Controller {
+private:
+  static const int level_count = 4;
+  double average = 0.;             // smoothed worktime since the last change, 0 before the first frame
+  int frames_over = 0, frames_under = 0;
+  int settling = 0;                // frames that are left out after a change
+  // for upscale(): the two rendered columns (rows) every cell lies between and the weight of the second in 1/256
+  std::vector<int> first_x, second_x, weight_x, first_y, second_y, weight_y;
+  static int level_scale_x(int level) {const int scales[level_count] = {1, 2, 2, 4}; return scales[level];};
+  static int level_scale_y(int level) {const int scales[level_count] = {1, 1, 2, 2}; return scales[level];};
+  // where the rendered pixels of a row (column) of size cells lie between
+  void upscale_table(int size, int scale, std::vector<int> *first, std::vector<int> *second, std::vector<int> *weight);
+public:
+  bool enabled = true;
+  int level = 0;                   // 0 is full resolution
+  double budget;                   // seconds a frame may take
+  Resolution_Controller(int fps_limit) : enabled(fps_limit > 0), budget(fps_limit > 0 ? 1./fps_limit : 0.) {};
+  // every scale_x()-th column and scale_y()-th row of cells gets a ray
+  int scale_x() {return level_scale_x(level);};
+  int scale_y() {return level_scale_y(level);};
+  // the size of the rendered picture for a frame of width x height cells
+  int scaled_width(int width) {return (width + scale_x()-1) / scale_x();};
+  int scaled_height(int height) {return (height + scale_y()-1) / scale_y();};
+  // Renderer::pixel_aspect for the rendered picture
+  float pixel_aspect() {return (float)scale_x() / scale_y();};
+  // called after every frame, true when the level changed and the next frame has to be rendered at another size
+  bool update(double worktime);
+  // forgets the times measured so far, after the terminal was resized
+  void reset();
+  // a line for the stats, empty at full resolution
+  void describe(char *text, size_t size);
+  /*
+    Scales the picture rendered at scaled_width(width) x scaled_height(height) up to width x height cells:
+    brightness and colors are interpolated between the rendered pixels around a cell.
+    scaled_colors and colors are nullptr without colors
+  */
+  void upscale(const char *scaled_pixels, const Color *scaled_colors, char *pixels, Color *colors, int width, int height);
+};
+
+bool Resolution_Controller::update(double worktime) {
+  if (!enabled) {return false;}
+  if (settling > 0) {
+    settling--;
+    return false;
+  }
+  average = average == 0. ? worktime : average*0.8 + worktime*0.2;
+  frames_over = average > budget ? frames_over+1 : 0;
+  if (level > 0) {
+    double higher = average * (scale_x()*scale_y()) / (level_scale_x(level-1)*level_scale_y(level-1));
+    frames_under = higher < budget*0.75 ? frames_under+1 : 0;
+  }
+  int new_level = level;
+  if (frames_over >= 3 && level < level_count-1) {
+    new_level = level+1;
+  } else if (level > 0 && frames_under*budget >= 1.) {
+    new_level = level-1;
+  }
+  if (new_level == level) {return false;}
+  level = new_level;
+  average = 0.;
+  frames_over = frames_under = 0;
+  settling = 3;
+  return true;
+}
+
+void Resolution_Controller::reset() {
+  average = 0.;
+  frames_over = frames_under = 0;
+  settling = 3;
+}
+
+void Resolution_Controller::describe(char *text, size_t size) {
+  if (level == 0) {
+    text[0] = '\0';
+    return;
+  }
+  snprintf(text, size, "Rays: 1/%d  ", scale_x()*scale_y());
+}
+
+void Resolution_Controller::upscale_table(int size, int scale, std::vector<int> *first, std::vector<int> *second,
+                                          std::vector<int> *weight) {
+  int scaled_size = (size + scale-1) / scale;
+  first->resize(size);
+  second->resize(size);
+  weight->resize(size);
+  for (int i=0; i<size; i++) {
+    // the ray of rendered pixel j goes through the middle of the cells j*scale up to (j+1)*scale
+    float position = std::min(std::max((i + 0.5f) / scale - 0.5f, 0.f), (float)(scaled_size-1));
+    int j = (int)position;
+    (*first)[i] = j;
+    (*second)[i] = std::min(j+1, scaled_size-1);
+    (*weight)[i] = (int)((position - j) * 256.f + 0.5f);
+  }
+}
+
+void Resolution_Controller::upscale(const char *scaled_pixels, const Color *scaled_colors, char *pixels, Color *colors,
+                                    int width, int height) {
+  upscale_table(width, scale_x(), &first_x, &second_x, &weight_x);
+  upscale_table(height, scale_y(), &first_y, &second_y, &weight_y);
+  int row_length = scaled_width(width);
+  // the four pixels around a cell weighted in 1/256 along x and then along y, rounded
+  auto blend = [&](int a, int b, int c, int d, int x, int y) {
+    int top = a*(256-weight_x[x]) + b*weight_x[x];
+    int bottom = c*(256-weight_x[x]) + d*weight_x[x];
+    return (top*(256-weight_y[y]) + bottom*weight_y[y] + (1 << 15)) >> 16;
+  };
+  for (int y=0; y<height; y++) {
+    const char *row0 = scaled_pixels + first_y[y]*row_length, *row1 = scaled_pixels + second_y[y]*row_length;
+    for (int x=0; x<width; x++) {
+      int brightness = blend(ramp_index(row0[first_x[x]]), ramp_index(row0[second_x[x]]),
+                             ramp_index(row1[first_x[x]]), ramp_index(row1[second_x[x]]), x, y);
+      pixels[y*width + x] = grayscale_ramp[brightness];
+    }
+  }
+  if (!colors) {return;}
+  for (int y=0; y<height; y++) {
+    const Color *row0 = scaled_colors + first_y[y]*row_length, *row1 = scaled_colors + second_y[y]*row_length;
+    for (int x=0; x<width; x++) {
+      Color a = row0[first_x[x]], b = row0[second_x[x]], c = row1[first_x[x]], d = row1[second_x[x]];
+      colors[y*width + x] = rgb(blend(color_red(a), color_red(b), color_red(c), color_red(d), x, y),
+                                blend(color_green(a), color_green(b), color_green(c), color_green(d), x, y),
+                                blend(color_blue(a), color_blue(b), color_blue(c), color_blue(d), x, y));
+    }
+  }
+}
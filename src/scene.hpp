@@ -1,6 +1,11 @@
 #pragma once
 #include "vector.hpp"
 #include "ray.hpp"
+#include <utility>
+#include <mutex>
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "color.hpp"
 
 /*
   Definition of the Camera class
@@ -25,6 +30,7 @@ struct intersection_information {
   Vec3f point; 
   Vec3f normal;
   bool reflective_surface;
+  int primitive = -1; // index of the primitive in the Compiled_Scene that was hit
 };
 
 
@@ -34,7 +40,19 @@ struct intersection_information {
 */
 class Object {
 public:
+  Color color = white; // only shown by the color output modes of the Window
+  virtual ~Object() {}
   virtual bool intersection(Ray *ray, intersection_information *ii) {return false;}
+  /*
+    Only checks if the object blocks the ray somewhere between ray->min_t and max_t,
+    used for shadow rays which don't need the intersection point or normal
+  */
+  virtual bool occluded(Ray *ray, float max_t) {
+    intersection_information ii;
+    return intersection(ray, &ii) && ii.t < max_t;
+  }
+  // box around the object used to build the BVH, objects that can't be bounded return AABB::infinite()
+  virtual AABB bounds() {return AABB::infinite();}
 };
 
 
@@ -42,7 +60,8 @@ public:
 /*
   Definition of all the objects like spheres and triangles
 
-  Each object only has one function which calculates the intersection between a ray and that object
+  Each object has a function which calculates the intersection between a ray and that object,
+  a cheaper one that only checks if the ray is blocked and a function that returns its bounding box
 */
 class Sphere : public Object {
 public:
@@ -51,15 +70,44 @@ public:
   bool reflective;
   Sphere(Vec3f center, float radius, bool reflective) : center(center), radius(radius), reflective(reflective) {};
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
 };
 
+/*
+  Möller–Trumbore ray triangle intersection, edge1 and edge2 go from p1 to the other two corners.
+  Both sides of the triangle can be hit, the distance of the hit is written to t
+*/
+inline bool ray_triangle(Ray *ray, Vec3f p1, Vec3f edge1, Vec3f edge2, float max_t, float *t) {
+  Vec3f p = cross(ray->direction, edge2);
+  float determinant = dot(edge1, p);
+  if (determinant == 0.f) {return false;} // ray is parallel to the triangle
+  float inverse_determinant = 1.f / determinant;
+  Vec3f origin_to_p1 = ray->origin - p1;
+  // u and v are the barycentric coordinates of the intersection point
+  float u = dot(origin_to_p1, p) * inverse_determinant;
+  if (u < 0.f || u > 1.f) {return false;}
+  Vec3f q = cross(origin_to_p1, edge1);
+  float v = dot(ray->direction, q) * inverse_determinant;
+  if (v < 0.f || u + v > 1.f) {return false;}
+  float distance = dot(edge2, q) * inverse_determinant;
+  if (distance < ray->min_t || distance > max_t) {return false;}
+  *t = distance;
+  return true;
+}
+
 class Triangle : public Object {
 public:
   Vec3f p1, p2, p3;
+  // calculated from the points by precompute(), which has to be called again when the points are changed
+  Vec3f edge1, edge2, normal;
   bool reflective;
-  Triangle(Vec3f p1, Vec3f p2, Vec3f p3, bool reflective) : p1(p1), p2(p2), p3(p3), reflective(reflective) {};
+  Triangle(Vec3f p1, Vec3f p2, Vec3f p3, bool reflective) : p1(p1), p2(p2), p3(p3), reflective(reflective) {precompute();};
   Triangle() : p1(Vec3f()), p2(Vec3f()), p3(Vec3f()), reflective(false) {};
+  void precompute();
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
 };
 
 class Checkerboard : public Object {
@@ -69,14 +117,15 @@ public:
   bool reflective;
   Checkerboard(Vec3f plane_normal, float d) : plane_normal(plane_normal), d(d) {};
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
 };
 
 // Cube made out of 12 triangles
 class Cube : public Object {
 private:
   Vec3f cube_corners[8];
-  Triangle triangles[12];
 public:
+  Triangle triangles[12];
   Vec3f center;
   Vec3f center_to_side1;
   Vec3f center_to_side2;
@@ -84,13 +133,15 @@ public:
   bool reflective;
   Cube(Vec3f center, Vec3f center_to_side1, Vec3f center_to_side2, Vec3f center_to_side3, bool reflective);
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
 };
 Cube::Cube(Vec3f center, Vec3f center_to_side1, Vec3f center_to_side2, Vec3f center_to_side3, bool reflective) {
-  center = center; 
-  center_to_side1 = center_to_side1;
-  center_to_side2 = center_to_side2;
-  center_to_side3 = center_to_side3;
-  reflective = reflective;
+  this->center = center;
+  this->center_to_side1 = center_to_side1;
+  this->center_to_side2 = center_to_side2;
+  this->center_to_side3 = center_to_side3;
+  this->reflective = reflective;
 
   cube_corners[0] = center + center_to_side1 + center_to_side2 + center_to_side3;
   cube_corners[1] = center + center_to_side1 + center_to_side2 - center_to_side3;
@@ -122,8 +173,46 @@ public:
   bool reflective;
   Cube2(Vec3f bound_min, Vec3f bound_max, bool reflective) : bound_min(bound_min), bound_max(bound_max), reflective(reflective) {};
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
 };
 
+/*
+  Triangle mesh with shared vertices, each triangle is three indices into the vertex buffer.
+  Imported models share most vertices between several triangles so this needs a lot less memory
+  than one Triangle object (three points, precomputed data and a vtable pointer) per triangle.
+  The mesh has its own BVH over its triangles
+*/
+class Triangle_Mesh : public Object {
+private:
+  // built the first time a ray is traced against the mesh itself, a Compiled_Scene puts the
+  // triangles in its own BVH and never needs this one
+  BVH bvh;
+  std::once_flag bvh_built;
+  void build_bvh();
+public:
+  std::vector<Vec3f> vertices;
+  std::vector<int> indices; // 3 per triangle
+  bool reflective;
+  Triangle_Mesh(std::vector<Vec3f> vertices, std::vector<int> indices, bool reflective);
+  int triangle_count() {return indices.size()/3;};
+  Vec3f corner(int triangle, int i) {return vertices[indices[3*triangle+i]];};
+  bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
+};
+Triangle_Mesh::Triangle_Mesh(std::vector<Vec3f> vertices, std::vector<int> indices, bool reflective) :
+  vertices(std::move(vertices)), indices(std::move(indices)), reflective(reflective) {}
+void Triangle_Mesh::build_bvh() {
+  std::vector<AABB> boxes(triangle_count());
+  for (int i=0; i<triangle_count(); i++) {
+    boxes[i].grow(corner(i, 0));
+    boxes[i].grow(corner(i, 1));
+    boxes[i].grow(corner(i, 2));
+  }
+  bvh.build(boxes.data(), boxes.size());
+}
+
 
 
 /*
@@ -131,13 +220,24 @@ public:
 
   Advantage of this is that we can just call Object_List.intersection() later on in our program
   and it will check intersections between all objects in our scene itself and return the closest one
+
+  The objects are put into a BVH when the list is created so that a ray only has to test the objects
+  whose bounding boxes it passes through. When objects move call refit() (cheap, same tree) or
+  rebuild() (new tree, use it when objects moved far or were replaced)
 */
 class Object_List : public Object {
+private:
+  std::vector<AABB> object_bounds();
 public:
+  BVH bvh;
   Object **objects;
-  float n; // number of objects
-  Object_List(Object **objects, float n) : objects(objects), n(n) {};
+  int n; // number of objects
+  Object_List(Object **objects, int n) : objects(objects), n(n) {rebuild();};
   bool intersection(Ray *ray, intersection_information *ii);
+  bool occluded(Ray *ray, float max_t);
+  AABB bounds();
+  void rebuild();
+  void refit();
 };
 
 
@@ -151,10 +251,10 @@ bool Sphere::intersection(Ray *ray, intersection_information *ii) {
   float a = dot(ray->direction, ray->direction);
   float b = 2.f * dot(ray->direction, ray->origin - center);
   float c = dot(ray->origin - center, ray->origin - center) - radius*radius;
-  float discriminant = b*b - 4.*a*c;
-  if (discriminant > 0) {
-    float t1 = (-b + sqrt(discriminant)) / 2.*a; 
-    float t2 = (-b - sqrt(discriminant)) / 2.*a; 
+  float discriminant = b*b - 4.f*a*c;
+  if (discriminant > 0.f) {
+    float t1 = (-b + sqrtf(discriminant)) / (2.f*a); 
+    float t2 = (-b - sqrtf(discriminant)) / (2.f*a); 
     float t = std::fmin(t1, t2);
     if (t > ray->min_t && t < ray->max_t) {
       ii->t = t;
@@ -167,30 +267,24 @@ bool Sphere::intersection(Ray *ray, intersection_information *ii) {
   return false;
 }
 
+void Triangle::precompute() {
+  edge1 = p2-p1;
+  edge2 = p3-p1;
+  normal = cross(edge1, edge2).normalize();
+}
+
 bool Triangle::intersection(Ray *ray, intersection_information *ii) {
-  // create a plane using the 3 triangle points
-  Vec3f plane_normal = cross(p2-p1, p3-p1);
-  float d = dot(p1, plane_normal);
-  // calculate intersection between ray and plane
-  if (dot(ray->direction, plane_normal) == 0.) {return false;}
-  float t = (d - dot(ray->origin,plane_normal)) / dot(ray->direction, plane_normal);
-  if (t < ray->min_t || t > ray->max_t) {return false;}
-  // check if that intersection point is inside the triangle
-  Vec3f ii_point = ray->point(t);
-  if (dot(cross(p2-p1, ii_point-p1), plane_normal) >= 0 &&
-      dot(cross(p3-p2, ii_point-p2), plane_normal) >= 0 &&
-      dot(cross(p1-p3, ii_point-p3), plane_normal) >= 0) {
-    ii->t = t;
-    ii->point = ii_point;
-    ii->normal = plane_normal.normalize();
-    ii->reflective_surface = reflective;
-    return true;
-  }
-  return false;
+  float t;
+  if (!ray_triangle(ray, p1, edge1, edge2, ray->max_t, &t)) {return false;}
+  ii->t = t;
+  ii->point = ray->point(t);
+  ii->normal = normal;
+  ii->reflective_surface = reflective;
+  return true;
 }
 
 bool Checkerboard::intersection(Ray *ray, intersection_information *ii) {
-  if (dot(ray->direction, plane_normal) == 0.) {return false;}
+  if (dot(ray->direction, plane_normal) == 0.f) {return false;}
   float t = (d - dot(ray->origin, plane_normal)) / dot(ray->direction, plane_normal);
   Vec3f hitpoint = ray->point(t)/8; // scaling the plane
   // for each balck sqaure its coordinates are either both even or both odd
@@ -208,21 +302,48 @@ bool Checkerboard::intersection(Ray *ray, intersection_information *ii) {
   return false;
 }
 
-// calculates the closest of the 12 triangles
+// calculates the closest of the 12 triangles, only that one fills in the intersection information
 bool Cube::intersection(Ray *ray, intersection_information *ii) {
-  bool any_intersection = false;
-  intersection_information temp_ii;
+  int closest = -1;
   float closest_t = ray->max_t;
+  float t;
   for (int i=0; i<12; i++) {
-    if (triangles[i].intersection(ray, &temp_ii)) {
-      if (temp_ii.t < closest_t) {
-        closest_t = temp_ii.t;
-        *ii = temp_ii;
-      }
-      any_intersection = true;
+    Triangle *triangle = &triangles[i];
+    if (ray_triangle(ray, triangle->p1, triangle->edge1, triangle->edge2, closest_t, &t) && t < closest_t) {
+      closest_t = t;
+      closest = i;
     }
   }
-  return any_intersection;
+  if (closest == -1) {return false;}
+  ii->t = closest_t;
+  ii->point = ray->point(closest_t);
+  ii->normal = triangles[closest].normal;
+  ii->reflective_surface = triangles[closest].reflective;
+  return true;
+}
+
+// the normal is only calculated for the closest triangle
+bool Triangle_Mesh::intersection(Ray *ray, intersection_information *ii) {
+  std::call_once(bvh_built, &Triangle_Mesh::build_bvh, this);
+  Ray closest_ray = *ray;
+  int closest = -1;
+  bvh.intersection(&closest_ray, [this, &closest](int i, Ray *r) {
+    float t;
+    Vec3f p1 = corner(i, 0);
+    if (ray_triangle(r, p1, corner(i, 1)-p1, corner(i, 2)-p1, r->max_t, &t) && t < r->max_t) {
+      r->max_t = t;
+      closest = i;
+      return true;
+    }
+    return false;
+  });
+  if (closest == -1) {return false;}
+  Vec3f p1 = corner(closest, 0);
+  ii->t = closest_ray.max_t;
+  ii->point = ray->point(ii->t);
+  ii->normal = cross(corner(closest, 1)-p1, corner(closest, 2)-p1).normalize();
+  ii->reflective_surface = reflective;
+  return true;
 }
 
 // slab method
@@ -231,26 +352,26 @@ bool Cube2::intersection(Ray *ray, intersection_information *ii) {
   float t_max = ray->max_t; 
 
   Vec3f x_plane_normal(1.,0.,0.);
-  float inverse_x = 1. / dot(ray->direction, x_plane_normal);
+  float inverse_x = 1.f / dot(ray->direction, x_plane_normal);
   float t_x0 = (bound_min.x - dot(ray->origin,x_plane_normal)) * inverse_x;
   float t_x1 = (bound_max.x - dot(ray->origin,x_plane_normal)) * inverse_x;
-  if (dot(ray->direction, x_plane_normal) != 0.) {
+  if (dot(ray->direction, x_plane_normal) != 0.f) {
     t_min = std::fmax(t_min, std::fmin(t_x0, t_x1));
     t_max = std::fmin(t_max, std::fmax(t_x0, t_x1));
   }
   Vec3f y_plane_normal(0.,1.,0.);
-  float inverse_y = 1. / dot(ray->direction, y_plane_normal);
+  float inverse_y = 1.f / dot(ray->direction, y_plane_normal);
   float t_y0 = (bound_min.y - dot(ray->origin,y_plane_normal)) * inverse_y;
   float t_y1 = (bound_max.y - dot(ray->origin,y_plane_normal)) * inverse_y;
-  if (dot(ray->direction, x_plane_normal) != 0.) {
+  if (dot(ray->direction, x_plane_normal) != 0.f) {
     t_min = std::fmax(t_min, std::fmin(t_y0, t_y1));
     t_max = std::fmin(t_max, std::fmax(t_y0, t_y1));
   }
   Vec3f z_plane_normal(0.,0.,1.);
-  float inverse_z = 1. / dot(ray->direction, z_plane_normal);
+  float inverse_z = 1.f / dot(ray->direction, z_plane_normal);
   float t_z0 = (bound_min.z - dot(ray->origin,z_plane_normal)) * inverse_z;
   float t_z1 = (bound_max.z - dot(ray->origin,z_plane_normal)) * inverse_z;
-  if (dot(ray->direction, x_plane_normal) != 0.) {
+  if (dot(ray->direction, x_plane_normal) != 0.f) {
     t_min = std::fmax(t_min, std::fmin(t_z0, t_z1));
     t_max = std::fmin(t_max, std::fmax(t_z0, t_z1));
   }
@@ -263,16 +384,16 @@ bool Cube2::intersection(Ray *ray, intersection_information *ii) {
     Vec3f cti = (ii->point - cube_center).normalize(); // center to intersection (cti)
     if (std::abs(cti.x) >= std::abs(cti.y)) {
       if (std::abs(cti.x) >= std::abs(cti.z)) {
-        ii->normal = Vec3f(round(cti.x),0.,0.); 
+        ii->normal = Vec3f(roundf(cti.x),0.,0.); 
         ii->reflective_surface = false;
       } else {
-        ii->normal = Vec3f(0.,0.,round(cti.z)); 
+        ii->normal = Vec3f(0.,0.,roundf(cti.z)); 
       }
     } else {
       if (std::abs(cti.y) >= std::abs(cti.z)) {
-        ii->normal = Vec3f(0.,round(cti.y),0.); 
+        ii->normal = Vec3f(0.,roundf(cti.y),0.); 
       } else {
-        ii->normal = Vec3f(0.,0.,round(cti.z)); 
+        ii->normal = Vec3f(0.,0.,roundf(cti.z)); 
       }
     }
     return true;
@@ -282,20 +403,147 @@ bool Cube2::intersection(Ray *ray, intersection_information *ii) {
 
 
 /*
-  Goes through all objects and returns the closest intersection
+  Occlusion tests, same math as the intersections above but without
+  computing the intersection point and normal
+*/
+bool Sphere::occluded(Ray *ray, float max_t) {
+  float a = dot(ray->direction, ray->direction);
+  float b = 2.f * dot(ray->direction, ray->origin - center);
+  float c = dot(ray->origin - center, ray->origin - center) - radius*radius;
+  float discriminant = b*b - 4.f*a*c;
+  if (discriminant > 0.f) {
+    float t = (-b - sqrtf(discriminant)) / (2.f*a);
+    return t > ray->min_t && t < max_t;
+  }
+  return false;
+}
+
+bool Triangle::occluded(Ray *ray, float max_t) {
+  float t;
+  return ray_triangle(ray, p1, edge1, edge2, max_t, &t);
+}
+
+bool Checkerboard::occluded(Ray *ray, float max_t) {
+  float denominator = dot(ray->direction, plane_normal);
+  if (denominator == 0.f) {return false;}
+  float t = (d - dot(ray->origin, plane_normal)) / denominator;
+  if (t <= ray->min_t || t >= max_t) {return false;}
+  Vec3f hitpoint = ray->point(t)/8;
+  // only the white squares block the ray
+  return !(((int)hitpoint.x % 2 == 0 && (int)hitpoint.y % 2 == 0) ||
+           ((int)hitpoint.x % 2 != 0 && (int)hitpoint.y % 2 != 0));
+}
+
+bool Cube::occluded(Ray *ray, float max_t) {
+  for (int i=0; i<12; i++) {
+    if (triangles[i].occluded(ray, max_t)) {return true;}
+  }
+  return false;
+}
+
+bool Triangle_Mesh::occluded(Ray *ray, float max_t) {
+  std::call_once(bvh_built, &Triangle_Mesh::build_bvh, this);
+  Ray clipped_ray = *ray;
+  clipped_ray.max_t = std::fmin(ray->max_t, max_t);
+  return bvh.occluded(&clipped_ray, [this](int i, Ray *r) {
+    float t;
+    Vec3f p1 = corner(i, 0);
+    return ray_triangle(r, p1, corner(i, 1)-p1, corner(i, 2)-p1, r->max_t, &t);
+  });
+}
+
+bool Cube2::occluded(Ray *ray, float max_t) {
+  Vec3f inverse_direction(1.f/ray->direction.x, 1.f/ray->direction.y, 1.f/ray->direction.z);
+  return AABB(bound_min, bound_max).hit(ray, &inverse_direction, std::fmin(ray->max_t, max_t)) != FLT_MAX;
+}
+
+
+/*
+  Bounding boxes of the objects
+*/
+AABB Sphere::bounds() {
+  Vec3f r(radius, radius, radius);
+  return AABB(center - r, center + r);
+}
+
+AABB Triangle::bounds() {
+  AABB box;
+  box.grow(p1);
+  box.grow(p2);
+  box.grow(p3);
+  return box;
+}
+
+AABB Cube::bounds() {
+  AABB box;
+  for (int i=0; i<8; i++) {
+    box.grow(cube_corners[i]);
+  }
+  return box;
+}
+
+AABB Triangle_Mesh::bounds() {
+  AABB box;
+  for (int i=0; i<(int)vertices.size(); i++) {
+    box.grow(vertices[i]);
+  }
+  return box;
+}
+
+AABB Cube2::bounds() {
+  return AABB(bound_min, bound_max);
+}
+
+
+/*
+  Goes through the BVH and returns the closest intersection
 */
 bool Object_List::intersection(Ray *ray, intersection_information *ii) {
-  bool any_intersection = false;
-  intersection_information temp_ii;
-  float closest_t = ray->max_t;
-  for (int i=0; i<n; i++) {
-    if (objects[i]->intersection(ray, &temp_ii)) {
-      if (temp_ii.t < closest_t) {
-        closest_t = temp_ii.t;
-        *ii = temp_ii;
-      }
-      any_intersection = true;
+  Object **objects = this->objects;
+  // the BVH shrinks max_t with every hit, so it works on a copy of the ray
+  Ray closest_ray = *ray;
+  return bvh.intersection(&closest_ray, [objects, ii](int i, Ray *r) {
+    intersection_information temp_ii;
+    if (objects[i]->intersection(r, &temp_ii) && temp_ii.t < r->max_t) {
+      r->max_t = temp_ii.t;
+      *ii = temp_ii;
+      return true;
     }
+    return false;
+  });
+}
+
+/*
+  Returns as soon as any object blocks the ray, used for shadow rays
+*/
+bool Object_List::occluded(Ray *ray, float max_t) {
+  Object **objects = this->objects;
+  Ray clipped_ray = *ray;
+  clipped_ray.max_t = std::fmin(ray->max_t, max_t);
+  return bvh.occluded(&clipped_ray, [objects](int i, Ray *r) {
+    return objects[i]->occluded(r, r->max_t);
+  });
+}
+
+std::vector<AABB> Object_List::object_bounds() {
+  std::vector<AABB> boxes;
+  for (int i=0; i<n; i++) {
+    boxes.push_back(objects[i]->bounds());
   }
-  return any_intersection;
+  return boxes;
+}
+AABB Object_List::bounds() {
+  AABB box;
+  for (int i=0; i<n; i++) {
+    box.grow(objects[i]->bounds());
+  }
+  return box;
+}
+void Object_List::rebuild() {
+  std::vector<AABB> boxes = object_bounds();
+  bvh.build(boxes.data(), boxes.size());
+}
+void Object_List::refit() {
+  std::vector<AABB> boxes = object_bounds();
+  bvh.refit(boxes.data());
 }
@@ -0,0 +1,511 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vector.hpp"
+#include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "scenes.hpp"
+
+/*
+  Loads scenes from text files so they can be changed without recompiling.
+  Every line is one thing, numbers are separated by spaces, everything after a # is ignored
+
+    camera  view_point view_direction view_up fov
+    light   position [intensity [range]]
+    spot_light position direction inner_angle outer_angle [intensity [range]]
+    area_light corner edge_u edge_v samples [intensity [range]]
+    sphere  center radius [reflective]
+    triangle p1 p2 p3 [reflective]
+    checkerboard plane_normal d
+    cube    center center_to_side1 center_to_side2 center_to_side3 [reflective]
+    cube2   bound_min bound_max [reflective]
+    mesh    file.obj [reflective]
+    color   red green blue
+    model   name
+    end
+    instance name position [angle [scale]]
+
+  where every point or direction is 3 numbers. The path of a mesh is relative to the scene file.
+  The camera and at least one light have to be there, the camera circles around the z axis when the scene is animated.
+  Lights have intensity 1 and reach everything unless intensity and range are given (see light.hpp), the angles of
+  a spot light are in degrees and an area light traces samples*samples shadow rays.
+  color (components from 0 to 1) is the color of every object after it up to the next color, objects are white
+  before the first one. It only shows in the color output modes of the Window.
+  The objects between model and end are not part of the scene, they become a model that instance places into the
+  scene any number of times, moved to position, turned by angle (degrees) around the z axis and scaled by scale.
+  The model is only stored once however many instances there are (see Instance in compiled_scene.hpp), an instance
+  has one color, the colors inside the model don't show.
+
+  The file is mapped into memory and parsed in place, nothing is allocated per token
+*/
+
+// a file mapped into memory, data is not null terminated
+class Mapped_File {
+public:
+  const char *data = nullptr;
+  size_t size = 0;
+  Mapped_File(const char *path);
+  ~Mapped_File();
+  bool is_open() {return opened;};
+private:
+  bool opened = false;
+  Mapped_File(const Mapped_File&);
+  Mapped_File& operator=(const Mapped_File&);
+};
+
+Mapped_File::Mapped_File(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {return;}
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    size = st.st_size;
+    if (size == 0) {
+      opened = true;
+    } else {
+      void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char*)mapped;
+        opened = true;
+      }
+    }
+  }
+  close(fd);
+}
+Mapped_File::~Mapped_File() {
+  if (data) {munmap((void*)data, size);}
+}
+
+/*
+  Reads words and numbers from a line based text buffer, used for scene files and obj files
+*/
+class Text_Parser {
+public:
+  const char *p, *end;
+  int line = 1;
+  Text_Parser(const char *data, size_t size) : p(data), end(data + size) {};
+  bool done() {return p >= end;};
+  // skips spaces and tabs, a # comment counts as the end of the line
+  void skip_space();
+  bool at_line_end();
+  // goes to the start of the next line
+  void next_line();
+  // the next word, not null terminated
+  bool word(const char **start, int *length);
+  bool is_word(const char *start, int length, const char *keyword);
+  bool number(float *value);
+  bool integer(int *value);
+  bool vector(Vec3f *v);
+};
+
+void Text_Parser::skip_space() {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {p++;}
+  if (p < end && *p == '#') {
+    while (p < end && *p != '\n') {p++;}
+  }
+}
+bool Text_Parser::at_line_end() {
+  skip_space();
+  return p >= end || *p == '\n';
+}
+void Text_Parser::next_line() {
+  while (p < end && *p != '\n') {p++;}
+  if (p < end) {
+    p++;
+    line++;
+  }
+}
+bool Text_Parser::word(const char **start, int *length) {
+  skip_space();
+  *start = p;
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#') {p++;}
+  *length = p - *start;
+  return *length > 0;
+}
+bool Text_Parser::is_word(const char *start, int length, const char *keyword) {
+  return (int)strlen(keyword) == length && memcmp(start, keyword, length) == 0;
+}
+bool Text_Parser::number(float *value) {
+  static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                         1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  skip_space();
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  // the digits are collected into an integer and scaled once at the end
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (mantissa < 100000000000000000ull) {mantissa = mantissa*10 + (*p - '0');} else {exponent++;}
+    p++;
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (mantissa < 100000000000000000ull) {
+        mantissa = mantissa*10 + (*p - '0');
+        exponent--;
+      }
+      p++;
+      digits++;
+    }
+  }
+  if (digits == 0) {
+    p = start;
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int exponent_sign = 1;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exponent_sign = *p == '-' ? -1 : 1;
+      p++;
+    }
+    int e = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (e < 10000) {e = e*10 + (*p - '0');}
+      p++;
+    }
+    exponent += exponent_sign * e;
+  }
+  double result = mantissa;
+  if (exponent < 0) {
+    result /= -exponent <= 22 ? powers_of_ten[-exponent] : pow(10., -exponent);
+  } else if (exponent > 0) {
+    result *= exponent <= 22 ? powers_of_ten[exponent] : pow(10., exponent);
+  }
+  *value = negative ? -result : result;
+  return true;
+}
+bool Text_Parser::integer(int *value) {
+  skip_space();
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  int64_t result = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (result < INT32_MAX) {result = result*10 + (*p - '0');}
+    p++;
+  }
+  if (p == start || (p == start+1 && (*start == '-' || *start == '+'))) {
+    p = start;
+    return false;
+  }
+  *value = (int)std::min<int64_t>(negative ? -result : result, INT32_MAX);
+  return true;
+}
+bool Text_Parser::vector(Vec3f *v) {
+  return number(&v->x) && number(&v->y) && number(&v->z);
+}
+
+
+/*
+  Reads the vertices and faces of an obj file, everything else in it (normals, texture coordinates, materials) is skipped.
+  Faces with more than 3 corners are split into triangles. Returns false and prints the reason if the file can't be used
+*/
+bool load_obj(const char *path, std::vector<Vec3f> *vertices, std::vector<int> *indices) {
+  Mapped_File file(path);
+  if (!file.is_open()) {
+    fprintf(stderr, "%s: can't open file\n", path);
+    return false;
+  }
+  // a rough guess so that big files don't grow the vectors too often, obj lines are about 30 characters
+  vertices->reserve(vertices->size() + file.size/64);
+  indices->reserve(indices->size() + file.size/16);
+  size_t first_vertex = vertices->size();
+  Text_Parser parser(file.data, file.size);
+  while (!parser.done()) {
+    const char *keyword;
+    int length;
+    if (parser.word(&keyword, &length)) {
+      if (parser.is_word(keyword, length, "v")) {
+        Vec3f v;
+        if (!parser.vector(&v)) {
+          fprintf(stderr, "%s:%d: vertex needs 3 numbers\n", path, parser.line);
+          return false;
+        }
+        vertices->push_back(v);
+      } else if (parser.is_word(keyword, length, "f")) {
+        int corners[3];
+        int count = 0;
+        int index;
+        while (parser.integer(&index)) {
+          // indices start at 1, negative ones count back from the last vertex
+          int vertex_count = vertices->size() - first_vertex;
+          index = index < 0 ? vertex_count + index : index - 1;
+          if (index < 0 || index >= vertex_count) {
+            fprintf(stderr, "%s:%d: face uses a vertex that doesn't exist\n", path, parser.line);
+            return false;
+          }
+          // skip texture coordinate and normal indices ("1/2/3", "1//3")
+          while (!parser.done() && *parser.p == '/') {
+            parser.p++;
+            int ignored;
+            parser.integer(&ignored);
+          }
+          index += first_vertex;
+          if (count < 3) {
+            corners[count] = index;
+          } else {
+            // fan triangulation
+            corners[1] = corners[2];
+            corners[2] = index;
+          }
+          count++;
+          if (count >= 3) {
+            indices->push_back(corners[0]);
+            indices->push_back(corners[1]);
+            indices->push_back(corners[2]);
+          }
+        }
+        if (count < 3) {
+          fprintf(stderr, "%s:%d: face needs at least 3 vertices\n", path, parser.line);
+          return false;
+        }
+      }
+    }
+    parser.next_line();
+  }
+  return true;
+}
+
+
+// turns the starting camera around the z axis by cam_angle (radians)
+void animate_orbit(Demo_Scene *demo, float cam_angle) {
+  float s = sin(cam_angle), c = cos(cam_angle);
+  Camera *start = &demo->start_camera;
+  demo->camera.view_point = Vec3f(start->view_point.x*c - start->view_point.y*s, start->view_point.x*s + start->view_point.y*c, start->view_point.z);
+  demo->camera.view_direction = Vec3f(start->view_direction.x*c - start->view_direction.y*s, start->view_direction.x*s + start->view_direction.y*c, start->view_direction.z);
+  demo->camera.view_up = Vec3f(start->view_up.x*c - start->view_up.y*s, start->view_up.x*s + start->view_up.y*c, start->view_up.z);
+}
+
+/*
+  Reads a scene file (see the top of this file), returns nullptr and prints the reason if it can't be loaded.
+  If dependencies isn't nullptr the paths of every file that was read (the scene file and its meshes) are added to it
+*/
+Demo_Scene *load_scene(const char *path, std::vector<std::string> *dependencies = nullptr) {
+  Mapped_File file(path);
+  if (!file.is_open()) {
+    fprintf(stderr, "%s: can't open file\n", path);
+    return nullptr;
+  }
+  if (dependencies) {dependencies->push_back(path);}
+  std::string directory(path);
+  size_t slash = directory.rfind('/');
+  directory = slash == std::string::npos ? "" : directory.substr(0, slash+1);
+
+  // everything the scene is made of goes into one arena, see free_demo_scene()
+  Arena *arena = new Arena();
+  std::vector<Object*> objects;
+  Camera camera(Vec3f(0.,0.,0.), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), 75);
+  std::vector<Light> lights;
+  bool has_camera = false;
+  Color color = white;
+  // models that were closed with end, and the one that is being read
+  std::vector<std::pair<std::string, Compiled_Scene*>> models;
+  std::string model_name;
+  size_t model_start = 0;
+  bool in_model = false;
+  Text_Parser parser(file.data, file.size);
+  const char *error = nullptr;
+  // the only thing that can follow the numbers is the reflective flag
+  auto reflective_flag = [&parser, &error](bool *reflective) {
+    const char *flag;
+    int length;
+    *reflective = false;
+    if (parser.word(&flag, &length)) {
+      if (!parser.is_word(flag, length, "reflective")) {
+        error = "unexpected text at the end of the line";
+        return false;
+      }
+      *reflective = true;
+    }
+    return true;
+  };
+  // intensity and range can be left out at the end of a light
+  auto light_strength = [&parser](float *intensity, float *range) {
+    *intensity = 1.f;
+    *range = 0.f;
+    if (parser.number(intensity)) {parser.number(range);}
+  };
+  while (!parser.done() && !error) {
+    const char *keyword;
+    int length;
+    if (parser.word(&keyword, &length)) {
+      Vec3f a, b, c, d;
+      float f;
+      int i;
+      bool reflective;
+      size_t object_count = objects.size();
+      if (parser.is_word(keyword, length, "camera")) {
+        if (parser.vector(&a) && parser.vector(&b) && parser.vector(&c) && parser.integer(&i)) {
+          camera = Camera(a, b, c, i);
+          has_camera = true;
+        } else {
+          error = "camera needs view_point, view_direction, view_up and fov";
+        }
+      } else if (parser.is_word(keyword, length, "light")) {
+        float intensity, range;
+        if (parser.vector(&a)) {
+          light_strength(&intensity, &range);
+          lights.push_back(point_light(a, intensity, range));
+        } else {
+          error = "light needs a position";
+        }
+      } else if (parser.is_word(keyword, length, "spot_light")) {
+        float inner, outer, intensity, range;
+        if (parser.vector(&a) && parser.vector(&b) && parser.number(&inner) && parser.number(&outer)) {
+          light_strength(&intensity, &range);
+          lights.push_back(spot_light(a, b, inner, outer, intensity, range));
+        } else {
+          error = "spot_light needs position, direction, inner_angle and outer_angle";
+        }
+      } else if (parser.is_word(keyword, length, "area_light")) {
+        float intensity, range;
+        if (parser.vector(&a) && parser.vector(&b) && parser.vector(&c) && parser.integer(&i)) {
+          light_strength(&intensity, &range);
+          lights.push_back(area_light(a, b, c, i, intensity, range));
+        } else {
+          error = "area_light needs corner, edge_u, edge_v and samples";
+        }
+      } else if (parser.is_word(keyword, length, "sphere")) {
+        if (!parser.vector(&a) || !parser.number(&f)) {
+          error = "sphere needs center and radius";
+        } else if (reflective_flag(&reflective)) {
+          objects.push_back(arena->create<Sphere>(a, f, reflective));
+        }
+      } else if (parser.is_word(keyword, length, "triangle")) {
+        if (!parser.vector(&a) || !parser.vector(&b) || !parser.vector(&c)) {
+          error = "triangle needs 3 points";
+        } else if (reflective_flag(&reflective)) {
+          objects.push_back(arena->create<Triangle>(a, b, c, reflective));
+        }
+      } else if (parser.is_word(keyword, length, "checkerboard")) {
+        if (parser.vector(&a) && parser.number(&f)) {
+          objects.push_back(arena->create<Checkerboard>(a, f));
+        } else {
+          error = "checkerboard needs plane_normal and d";
+        }
+      } else if (parser.is_word(keyword, length, "cube")) {
+        if (!parser.vector(&a) || !parser.vector(&b) || !parser.vector(&c) || !parser.vector(&d)) {
+          error = "cube needs center and 3 vectors from the center to the sides";
+        } else if (reflective_flag(&reflective)) {
+          objects.push_back(arena->create<Cube>(a, b, c, d, reflective));
+        }
+      } else if (parser.is_word(keyword, length, "cube2")) {
+        if (!parser.vector(&a) || !parser.vector(&b)) {
+          error = "cube2 needs bound_min and bound_max";
+        } else if (reflective_flag(&reflective)) {
+          objects.push_back(arena->create<Cube2>(a, b, reflective));
+        }
+      } else if (parser.is_word(keyword, length, "mesh")) {
+        const char *name;
+        int name_length;
+        std::vector<Vec3f> vertices;
+        std::vector<int> indices;
+        if (!parser.word(&name, &name_length)) {
+          error = "mesh needs an obj file";
+        } else if (reflective_flag(&reflective)) {
+          std::string mesh_path = directory + std::string(name, name_length);
+          if (dependencies) {dependencies->push_back(mesh_path);}
+          if (load_obj(mesh_path.c_str(), &vertices, &indices)) {
+            objects.push_back(arena->create<Triangle_Mesh>(std::move(vertices), std::move(indices), reflective));
+          } else {
+            error = "mesh could not be loaded";
+          }
+        }
+      } else if (parser.is_word(keyword, length, "model")) {
+        const char *name;
+        int name_length;
+        if (in_model) {
+          error = "models can't be inside other models";
+        } else if (!parser.word(&name, &name_length)) {
+          error = "model needs a name";
+        } else {
+          model_name.assign(name, name_length);
+          model_start = objects.size();
+          in_model = true;
+        }
+      } else if (parser.is_word(keyword, length, "end")) {
+        if (!in_model) {
+          error = "end without model";
+        } else if (objects.size() == model_start) {
+          error = "model has no objects";
+        } else {
+          // the objects of the model get their own list and Compiled_Scene and leave the scene
+          int count = objects.size() - model_start;
+          Object **model_objects = arena->create_array<Object*>(count);
+          std::copy(objects.begin() + model_start, objects.end(), model_objects);
+          objects.resize(model_start);
+          Object_List *model_list = arena->create<Object_List>(model_objects, count);
+          models.push_back(std::make_pair(model_name, arena->create<Compiled_Scene>(model_list)));
+          in_model = false;
+        }
+      } else if (parser.is_word(keyword, length, "instance")) {
+        const char *name;
+        int name_length;
+        float angle = 0.f, scale = 1.f;
+        if (!parser.word(&name, &name_length) || !parser.vector(&a)) {
+          error = "instance needs a model name and a position";
+        } else {
+          if (parser.number(&angle)) {parser.number(&scale);}
+          std::string instance_model(name, name_length);
+          auto model = std::find_if(models.begin(), models.end(),
+                                    [&instance_model](const std::pair<std::string, Compiled_Scene*>& m) {return m.first == instance_model;});
+          if (model == models.end()) {
+            error = "instance of a model that wasn't defined before";
+          } else if (scale == 0.f) {
+            error = "instance can't have a scale of 0";
+          } else {
+            Transform transform = Transform::translate(a) * Transform::rotation_z(angle*M_PI/180.) * Transform::scale(scale);
+            objects.push_back(arena->create<Instance>(model->second, transform));
+          }
+        }
+      } else if (parser.is_word(keyword, length, "color")) {
+        if (parser.vector(&a)) {
+          color = to_color(a);
+        } else {
+          error = "color needs red, green and blue";
+        }
+      } else {
+        error = "unknown keyword";
+      }
+      if (objects.size() > object_count) {objects.back()->color = color;}
+      if (!error && !parser.at_line_end()) {error = "unexpected text at the end of the line";}
+    }
+    if (!error) {parser.next_line();}
+  }
+  if (!error && in_model) {error = "model without end";}
+  if (!error && !has_camera) {error = "the scene has no camera";}
+  if (!error && lights.empty()) {error = "the scene has no light";}
+  if (error) {
+    fprintf(stderr, "%s:%d: %s\n", path, parser.line, error);
+    delete arena;
+    return nullptr;
+  }
+
+  Object **object_array = arena->create_array<Object*>(objects.size());
+  std::copy(objects.begin(), objects.end(), object_array);
+  Object_List *object_list = arena->create<Object_List>(object_array, objects.size());
+  Demo_Scene *demo = new Demo_Scene {arena->copy_string(path), object_list, arena->create<Compiled_Scene>(object_list),
+                                     camera, camera, lights, 0.3f, animate_orbit, arena};
+  return demo;
+}
@@ -0,0 +1,317 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sys/stat.h>
+#include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "scenes.hpp"
+#include "scene_loader.hpp"
+
+/*
+  Binary snapshot of a loaded scene: camera, lights, the arrays of the Compiled_Scene and its BVH
+
+  Building the BVH of a big scene takes much longer than everything else at startup, so after a scene file
+  was loaded the result is written next to it (scene.txt -> scene.txt.snapshot). The next start maps the
+  snapshot into memory and the arrays of the Compiled_Scene point straight into it, nothing is parsed or copied.
+
+  The file starts with a Snapshot_Header, then one Snapshot_Section per Flat_Array (in the order of
+  Compiled_Scene::arrays()), then the files the scene was made from, then the lights, then the array data, every array starting
+  at a multiple of 64 bytes. The snapshot is only used if it has the same version, byte order and element sizes
+  as this build, and if every file it was made from still has the same size and modification time.
+  Scenes with objects that can't be flattened (Compiled_Scene::others) or with instances (their models are
+  separate Compiled_Scenes) can't be stored, see snapshot_supported()
+*/
+const uint32_t snapshot_version = 3;
+
+struct Snapshot_Header {
+  char magic[8];          // "ARTSNAP"
+  uint32_t version;
+  uint32_t byte_order;    // 0x01020304 as written by the machine that made the snapshot
+  uint32_t section_count;
+  uint32_t dependency_count;
+  float view_point[3], view_direction[3], view_up[3];
+  int32_t fov;
+  uint32_t light_count;
+  uint32_t light_size;    // sizeof(Light), the lights are stored as they are in memory
+  float angle_speed;
+  uint32_t padding;       // keeps the sections after the header 8 byte aligned
+};
+
+struct Snapshot_Section {
+  uint64_t offset;        // from the start of the file
+  uint64_t count;
+  uint32_t element_size;
+  uint32_t padding;
+};
+
+// a file the scene was loaded from, the path follows right after it
+struct Snapshot_Dependency {
+  int64_t modified_seconds;
+  int64_t modified_nanoseconds;
+  uint64_t size;
+  uint32_t path_length;
+  uint32_t padding;
+};
+
+const size_t snapshot_alignment = 64;
+
+// fills in the size and modification time of a file, false if it doesn't exist
+bool snapshot_dependency(const char *path, Snapshot_Dependency *dependency) {
+  struct stat st;
+  if (stat(path, &st) != 0) {return false;}
+  dependency->modified_seconds = st.st_mtim.tv_sec;
+  dependency->modified_nanoseconds = st.st_mtim.tv_nsec;
+  dependency->size = st.st_size;
+  dependency->path_length = strlen(path);
+  dependency->padding = 0;
+  return true;
+}
+
+// the visitors for Compiled_Scene::arrays()
+struct Snapshot_Writer {
+  std::vector<Snapshot_Section> sections;
+  std::vector<std::pair<const void*, size_t>> data;
+  uint64_t offset;
+  template <typename T> void operator()(Flat_Array<T>& array) {
+    offset = (offset + snapshot_alignment-1) / snapshot_alignment * snapshot_alignment;
+    Snapshot_Section section = {offset, array.size(), (uint32_t)sizeof(T), 0};
+    sections.push_back(section);
+    data.push_back(std::make_pair((const void*)array.data(), array.size()*sizeof(T)));
+    offset += array.size()*sizeof(T);
+  }
+};
+struct Snapshot_Counter {
+  uint32_t count = 0;
+  template <typename T> void operator()(Flat_Array<T>& /*array*/) {count++;}
+};
+struct Snapshot_Reader {
+  const char *file;
+  size_t file_size;
+  const Snapshot_Section *sections;
+  uint32_t next = 0;
+  bool valid = true;
+  template <typename T> void operator()(Flat_Array<T>& array) {
+    const Snapshot_Section *section = &sections[next++];
+    if (section->element_size != sizeof(T) || section->offset % snapshot_alignment != 0 ||
+        section->offset > file_size || section->count > (file_size - section->offset) / sizeof(T)) {
+      valid = false;
+      return;
+    }
+    array.attach((const T*)(file + section->offset), section->count);
+  }
+};
+
+// the visitor for the arrays of one primitive type, they all have to be as long as the first one
+struct Snapshot_Size_Check {
+  size_t size;
+  bool same = true;
+  Snapshot_Size_Check(size_t size) : size(size) {};
+  template <typename T> void operator()(Flat_Array<T>& array) {same = same && array.size() == size;}
+};
+
+/*
+  Checks the indices of scene arrays that were read from a snapshot or received from the coordinator
+  (distributed.hpp): the file only says how long every array is, a damaged one could still make the
+  traversal read out of bounds
+*/
+bool snapshot_consistent(Compiled_Scene *scene) {
+  Snapshot_Size_Check spheres(scene->spheres.size()), triangles(scene->triangles.size()), planes(scene->planes.size()),
+                      boxes(scene->boxes.size());
+  scene->spheres.arrays(spheres);
+  scene->triangles.arrays(triangles);
+  scene->planes.arrays(planes);
+  scene->boxes.arrays(boxes);
+  if (!spheres.same || !triangles.same || !planes.same || !boxes.same) {return false;}
+  Mesh_Triangle_Array *mesh = &scene->mesh_triangles;
+  size_t vertex_count = mesh->vertex_x.size();
+  size_t triangle_count = mesh->v1.size();
+  if (mesh->vertex_y.size() != vertex_count || mesh->vertex_z.size() != vertex_count || mesh->v2.size() != triangle_count ||
+      mesh->v3.size() != triangle_count || mesh->reflective.size() != triangle_count) {
+    return false;
+  }
+  for (size_t i=0; i<triangle_count; i++) {
+    if (mesh->v1[i] < 0 || (size_t)mesh->v1[i] >= vertex_count || mesh->v2[i] < 0 || (size_t)mesh->v2[i] >= vertex_count ||
+        mesh->v3[i] < 0 || (size_t)mesh->v3[i] >= vertex_count) {
+      return false;
+    }
+  }
+  if (scene->primitive_colors.size() != scene->primitives.size() || scene->primitives.size() > (size_t)INT32_MAX) {return false;}
+  for (size_t i=0; i<scene->primitives.size(); i++) {
+    Primitive_Ref ref = scene->primitives[i];
+    int count;
+    switch (ref.type) {
+      case SPHERE:        count = scene->spheres.size(); break;
+      case TRIANGLE:      count = scene->triangles.size(); break;
+      case MESH_TRIANGLE: count = scene->mesh_triangles.size(); break;
+      case PLANE:         count = scene->planes.size(); break;
+      case BOX:           count = scene->boxes.size(); break;
+      default:            return false; // instances and other objects are never stored
+    }
+    if ((int)ref.index >= count) {return false;}
+  }
+  return scene->bvh.valid(scene->primitives.size());
+}
+
+bool snapshot_supported(Compiled_Scene *scene) {
+  return scene->others.empty() && scene->instances.size() == 0;
+}
+
+/*
+  Writes the scene to path, dependencies are the files it was loaded from.
+  Returns false if the scene can't be stored or the file can't be written
+*/
+bool save_snapshot(const char *path, Demo_Scene *demo, std::vector<std::string> *dependencies) {
+  Compiled_Scene *scene = demo->scene;
+  if (!snapshot_supported(scene)) {return false;}
+
+  Snapshot_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "ARTSNAP", 8);
+  header.version = snapshot_version;
+  header.byte_order = 0x01020304;
+  header.dependency_count = dependencies->size();
+  Camera *camera = &demo->start_camera;
+  Vec3f camera_vectors[3] = {camera->view_point, camera->view_direction, camera->view_up};
+  float *header_vectors[3] = {header.view_point, header.view_direction, header.view_up};
+  for (int i=0; i<3; i++) {
+    header_vectors[i][0] = camera_vectors[i].x;
+    header_vectors[i][1] = camera_vectors[i].y;
+    header_vectors[i][2] = camera_vectors[i].z;
+  }
+  header.fov = camera->FOV;
+  header.light_count = demo->lights.size();
+  header.light_size = sizeof(Light);
+  header.angle_speed = demo->angle_speed;
+
+  std::vector<Snapshot_Dependency> dependency_info(dependencies->size());
+  uint64_t dependencies_size = 0;
+  for (size_t i=0; i<dependencies->size(); i++) {
+    if (!snapshot_dependency((*dependencies)[i].c_str(), &dependency_info[i])) {return false;}
+    dependencies_size += sizeof(Snapshot_Dependency) + dependency_info[i].path_length;
+  }
+  Snapshot_Counter counter;
+  scene->arrays(counter);
+  header.section_count = counter.count;
+  Snapshot_Writer writer;
+  writer.offset = sizeof(Snapshot_Header) + counter.count*sizeof(Snapshot_Section) + dependencies_size + demo->lights.size()*sizeof(Light);
+  scene->arrays(writer);
+
+  // written to a temporary file first so that a crash never leaves a half written snapshot behind
+  std::string temporary_path = std::string(path) + ".tmp";
+  FILE *file = fopen(temporary_path.c_str(), "wb");
+  if (!file) {return false;}
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(writer.sections.data(), sizeof(Snapshot_Section), writer.sections.size(), file) == writer.sections.size();
+  for (size_t i=0; i<dependencies->size() && ok; i++) {
+    ok = fwrite(&dependency_info[i], sizeof(Snapshot_Dependency), 1, file) == 1;
+    ok = ok && fwrite((*dependencies)[i].c_str(), 1, dependency_info[i].path_length, file) == dependency_info[i].path_length;
+  }
+  ok = ok && fwrite(demo->lights.data(), sizeof(Light), demo->lights.size(), file) == demo->lights.size();
+  static const char zeros[snapshot_alignment] = {0};
+  for (size_t i=0; i<writer.data.size() && ok; i++) {
+    long padding = writer.sections[i].offset - ftell(file);
+    ok = padding >= 0 && fwrite(zeros, 1, padding, file) == (size_t)padding;
+    ok = ok && (writer.data[i].second == 0 || fwrite(writer.data[i].first, 1, writer.data[i].second, file) == writer.data[i].second);
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temporary_path.c_str(), path) != 0) {
+    remove(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*
+  Maps a snapshot into memory, returns nullptr if there is none, it was made by a different build
+  or one of the files the scene was loaded from changed since then
+*/
+Demo_Scene *load_snapshot(const char *path) {
+  std::shared_ptr<Mapped_File> file = std::make_shared<Mapped_File>(path);
+  if (!file->is_open() || file->size < sizeof(Snapshot_Header)) {return nullptr;}
+  const Snapshot_Header *header = (const Snapshot_Header*)file->data;
+  if (memcmp(header->magic, "ARTSNAP", 8) != 0 || header->version != snapshot_version || header->byte_order != 0x01020304 ||
+      header->light_size != sizeof(Light)) {
+    return nullptr;
+  }
+  Arena *arena = new Arena();
+  Compiled_Scene *scene = arena->create<Compiled_Scene>();
+  Snapshot_Counter counter;
+  scene->arrays(counter);
+  uint64_t position = sizeof(Snapshot_Header) + (uint64_t)header->section_count*sizeof(Snapshot_Section);
+  if (header->section_count != counter.count || position > file->size) {
+    delete arena;
+    return nullptr;
+  }
+
+  // the snapshot is out of date as soon as any file it was made from is different
+  for (uint32_t i=0; i<header->dependency_count; i++) {
+    if (position + sizeof(Snapshot_Dependency) > file->size) {
+      delete arena;
+      return nullptr;
+    }
+    Snapshot_Dependency stored;
+    memcpy(&stored, file->data + position, sizeof(stored));
+    position += sizeof(Snapshot_Dependency);
+    if (position + stored.path_length > file->size) {
+      delete arena;
+      return nullptr;
+    }
+    std::string dependency_path(file->data + position, stored.path_length);
+    position += stored.path_length;
+    Snapshot_Dependency current;
+    if (!snapshot_dependency(dependency_path.c_str(), &current) || current.size != stored.size ||
+        current.modified_seconds != stored.modified_seconds || current.modified_nanoseconds != stored.modified_nanoseconds) {
+      delete arena;
+      return nullptr;
+    }
+  }
+
+  if (position + (uint64_t)header->light_count*sizeof(Light) > file->size) {
+    delete arena;
+    return nullptr;
+  }
+  std::vector<Light> lights(header->light_count);
+  if (!lights.empty()) {memcpy(lights.data(), file->data + position, lights.size()*sizeof(Light));}
+
+  Snapshot_Reader reader;
+  reader.file = file->data;
+  reader.file_size = file->size;
+  reader.sections = (const Snapshot_Section*)(file->data + sizeof(Snapshot_Header));
+  scene->arrays(reader);
+  if (!reader.valid || !snapshot_consistent(scene)) {
+    delete arena;
+    return nullptr;
+  }
+  scene->snapshot = file;
+
+  Camera camera(Vec3f(), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), header->fov);
+  // the stored vectors are already normalized, normalizing them again could change the last bit
+  camera.view_point = Vec3f(header->view_point[0], header->view_point[1], header->view_point[2]);
+  camera.view_direction = Vec3f(header->view_direction[0], header->view_direction[1], header->view_direction[2]);
+  camera.view_up = Vec3f(header->view_up[0], header->view_up[1], header->view_up[2]);
+  Demo_Scene *demo = new Demo_Scene {arena->copy_string(path), nullptr, scene, camera, camera, lights, header->angle_speed, animate_orbit, arena};
+  return demo;
+}
+
+/*
+  Loads a scene file through its snapshot when there is an up to date one,
+  otherwise loads the scene file and writes a new snapshot for the next time
+*/
+Demo_Scene *load_scene_cached(const char *path) {
+  std::string snapshot_path = std::string(path) + ".snapshot";
+  Demo_Scene *demo = load_snapshot(snapshot_path.c_str());
+  if (demo) {
+    demo->name = demo->arena->copy_string(path);
+    return demo;
+  }
+  std::vector<std::string> dependencies;
+  demo = load_scene(path, &dependencies);
+  if (demo && snapshot_supported(demo->scene) && !save_snapshot(snapshot_path.c_str(), demo, &dependencies)) {
+    fprintf(stderr, "%s: couldn't write snapshot\n", snapshot_path.c_str());
+  }
+  return demo;
+}
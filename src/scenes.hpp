@@ -0,0 +1,179 @@
+#pragma once
+#include <math.h>
+#include "vector.hpp"
+#include "scene.hpp"
+#include "compiled_scene.hpp"
+#include "arena.hpp"
+#include "light.hpp"
+
+/*
+  The built in scenes, used by main.cpp, main2.cpp and the headless benchmark
+
+  animate() moves the camera (and in some scenes the lights) to where it is at cam_angle,
+  angle_speed is how much the main loops increase cam_angle per second
+
+  The objects, the Object_List and the Compiled_Scene all live in arena, free_demo_scene() frees them at once.
+  Copies of a Demo_Scene share the arena
+*/
+struct Demo_Scene {
+  const char *name;
+  Object_List *object_list;
+  Compiled_Scene *scene;
+  Camera camera;
+  Camera start_camera; // where the camera is before the first animate()
+  std::vector<Light> lights;
+  float angle_speed;
+  void (*animate)(Demo_Scene *demo, float cam_angle);
+  Arena *arena;
+};
+
+void free_demo_scene(Demo_Scene *demo) {
+  delete demo->arena;
+  delete demo;
+}
+
+// floor, mirror wall, a box and three spheres, the camera orbits around the box
+void animate_demo_scene1(Demo_Scene *demo, float cam_angle) {
+  demo->camera.view_point.x = sin(cam_angle)*30.;
+  demo->camera.view_point.y = cos(cam_angle)*30.;
+  demo->camera.view_point.z = (cos(cam_angle)+2.0)*5.;
+  demo->camera.view_direction = (Vec3f(0.,0,0.5)-demo->camera.view_point).normalize();
+}
+Demo_Scene demo_scene1() {
+  Arena *arena = new Arena();
+  Object **objects = arena->create_array<Object*>(8);
+  Object *list[8] = {
+    arena->create<Triangle>(Vec3f(-20.,-20.,0.), Vec3f(20.,-20.,0.), Vec3f(20.,20.,0.), false),
+    arena->create<Triangle>(Vec3f(-20.,-20.,0.), Vec3f(20.,20.,0.), Vec3f(-20.,20.,0.), false),
+    arena->create<Triangle>(Vec3f(-20.,20.,2.), Vec3f(20.,20.,2.), Vec3f(20.,20.,10.), true),
+    arena->create<Triangle>(Vec3f(-20.,20.,2.), Vec3f(-20.,20.,10.), Vec3f(20.,20.,10.), true),
+    arena->create<Cube2>(Vec3f(-3.,-3.,0.), Vec3f(3.,3.,6.), false),
+    arena->create<Sphere>(Vec3f(-8.,15.,2.), 2., false),
+    arena->create<Sphere>(Vec3f(13.,10.,2.), 2., false),
+    arena->create<Sphere>(Vec3f(-10.,-14.,2.), 2., false)
+  };
+  // only seen in the color modes of the Window
+  list[4]->color = rgb(230, 120, 40);
+  list[5]->color = rgb(220, 50, 50);
+  list[6]->color = rgb(60, 200, 80);
+  list[7]->color = rgb(70, 110, 240);
+  std::copy(list, list+8, objects);
+  Object_List *object_list = arena->create<Object_List>(objects, 8);
+  Demo_Scene demo = {"scene1", object_list, arena->create<Compiled_Scene>(object_list),
+                     Camera(Vec3f(30.,-30.,10.), Vec3f(-1.,1.,0.), Vec3f(0.,0.,1.), 75),
+                     Camera(Vec3f(30.,-30.,10.), Vec3f(-1.,1.,0.), Vec3f(0.,0.,1.), 75),
+                     {point_light(Vec3f(10.,-20.,30.))}, 0.8f, animate_demo_scene1, arena};
+  return demo;
+}
+
+// reflective cube surrounded by spheres and boxes, camera and light circle around it
+void animate_demo_scene2(Demo_Scene *demo, float cam_angle) {
+  float angle = (cam_angle*3.14159265)/180.;
+  demo->lights[0].position.x = cos(angle)*50;
+  demo->lights[0].position.y = sin(angle)*100;
+  demo->camera.view_point.x = cos(angle)*12;
+  demo->camera.view_point.y = sin(angle)*15;
+  demo->camera.view_point.z = sin(angle)*-5;
+  demo->camera.view_direction = (Vec3f(0.,0.,0.) - demo->camera.view_point).normalize();
+}
+Demo_Scene demo_scene2() {
+  Arena *arena = new Arena();
+  Object **objects = arena->create_array<Object*>(7);
+  Object *list[7] = {
+    arena->create<Cube>(Vec3f(0.,0.,0.), Vec3f(1.,0.,0.), Vec3f(0.,3.,0.), Vec3f(0.,0.,3.), true),
+    arena->create<Cube2>(Vec3f(-5.-0.8,-0.8,-3.-0.8), Vec3f(-5.+0.8,0.8,-3.+0.8), false),
+    arena->create<Cube2>(Vec3f(-5.-0.8,0.-0.8,3.-0.8), Vec3f(-5.+0.8,0.+0.8,3.+0.8), false),
+    arena->create<Sphere>(Vec3f(3.,0.,0.), 1.2, false),
+    arena->create<Sphere>(Vec3f(-5.,-4.,0.), 1.2, false),
+    arena->create<Sphere>(Vec3f(-5.,4.,0.), 1.2, false),
+    arena->create<Sphere>(Vec3f(-5.,0.,0.), 1.2, false)
+  };
+  // only seen in the color modes of the Window
+  list[1]->color = list[2]->color = rgb(240, 200, 60);
+  list[3]->color = rgb(220, 50, 50);
+  list[4]->color = rgb(60, 200, 80);
+  list[5]->color = rgb(70, 110, 240);
+  list[6]->color = rgb(200, 80, 220);
+  std::copy(list, list+7, objects);
+  Object_List *object_list = arena->create<Object_List>(objects, 7);
+  Demo_Scene demo = {"scene2", object_list, arena->create<Compiled_Scene>(object_list),
+                     Camera(Vec3f(0.,0.,0.), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), 75),
+                     Camera(Vec3f(0.,0.,0.), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), 75),
+                     {point_light(Vec3f(0.,0.,20.))}, 70.f, animate_demo_scene2, arena};
+  return demo;
+}
+
+// torus around the z axis through the origin, segments around the z axis and sides around the tube
+Triangle_Mesh *torus_mesh(Arena *arena, float major_radius, float minor_radius, int segments, int sides) {
+  std::vector<Vec3f> vertices;
+  std::vector<int> indices;
+  for (int i=0; i<segments; i++) {
+    float u = 2.f*M_PI*i / segments;
+    for (int j=0; j<sides; j++) {
+      float v = 2.f*M_PI*j / sides;
+      float r = major_radius + minor_radius*cos(v);
+      vertices.push_back(Vec3f(r*cos(u), r*sin(u), minor_radius*sin(v)));
+      int a = i*sides + j, b = ((i+1)%segments)*sides + j;
+      int c = ((i+1)%segments)*sides + (j+1)%sides, d = i*sides + (j+1)%sides;
+      int quad[6] = {a, b, c, a, c, d};
+      indices.insert(indices.end(), quad, quad+6);
+    }
+  }
+  return arena->create<Triangle_Mesh>(std::move(vertices), std::move(indices), false);
+}
+
+/*
+  A field of 32x32 spinning tori over a checkerboard, every torus is an Instance of the same model
+  so the 590000 triangles are only stored once and moving them only refits the top level BVH
+*/
+const int scene3_grid = 32;
+// where torus i is at cam_angle, the tori only bob and spin in place so refitting the BVH keeps working
+Transform scene3_transform(int i, float cam_angle) {
+  float x = (i%scene3_grid - (scene3_grid-1)*0.5f) * 4.f;
+  float y = (i/scene3_grid - (scene3_grid-1)*0.5f) * 4.f;
+  float phase = i*0.7f;
+  Transform placement = Transform::translate(Vec3f(x, y, 2.f + 0.5f*sin(cam_angle*3.f + phase)));
+  return placement * Transform::rotation_z(cam_angle*4.f + phase) * Transform::rotation_x(1.f);
+}
+void animate_demo_scene3(Demo_Scene *demo, float cam_angle) {
+  demo->camera.view_point = Vec3f(sin(cam_angle)*70., cos(cam_angle)*70., 30.);
+  demo->camera.view_direction = (Vec3f(0.,0.,0.)-demo->camera.view_point).normalize();
+  // object 0 is the floor, the instances follow row by row
+  for (int i=0; i<scene3_grid*scene3_grid; i++) {
+    static_cast<Instance*>(demo->object_list->objects[1+i])->set_transform(scene3_transform(i, cam_angle));
+  }
+  demo->scene->update_instances();
+}
+Demo_Scene demo_scene3() {
+  Arena *arena = new Arena();
+  // the model is a scene of its own
+  Object **model_objects = arena->create_array<Object*>(1);
+  model_objects[0] = torus_mesh(arena, 1.2f, 0.4f, 24, 12);
+  Object_List *model_list = arena->create<Object_List>(model_objects, 1);
+  Compiled_Scene *model = arena->create<Compiled_Scene>(model_list);
+
+  int n = 1 + scene3_grid*scene3_grid;
+  Object **objects = arena->create_array<Object*>(n);
+  objects[0] = arena->create<Checkerboard>(Vec3f(0.,0.,1.), 0.);
+  for (int i=0; i<scene3_grid*scene3_grid; i++) {
+    objects[1+i] = arena->create<Instance>(model, scene3_transform(i, 0.f));
+    // only seen in the color modes of the Window
+    objects[1+i]->color = rgb(80 + 170*(i%scene3_grid)/scene3_grid, 80 + 170*(i/scene3_grid)/scene3_grid, 200);
+  }
+  Object_List *object_list = arena->create<Object_List>(objects, n);
+  Demo_Scene demo = {"scene3", object_list, arena->create<Compiled_Scene>(object_list),
+                     Camera(Vec3f(0.,70.,30.), Vec3f(0.,-1.,0.), Vec3f(0.,0.,1.), 75),
+                     Camera(Vec3f(0.,70.,30.), Vec3f(0.,-1.,0.), Vec3f(0.,0.,1.), 75),
+                     {point_light(Vec3f(20.,-30.,60.))}, 0.4f, animate_demo_scene3, arena};
+  return demo;
+}
+
+// number is 1, 2 or 3, returns nullptr for any other number, free it with free_demo_scene()
+Demo_Scene *demo_scene(int number) {
+  switch (number) {
+    case 1: return new Demo_Scene(demo_scene1());
+    case 2: return new Demo_Scene(demo_scene2());
+    case 3: return new Demo_Scene(demo_scene3());
+    default: return nullptr;
+  }
+}
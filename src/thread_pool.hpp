@@ -0,0 +1,171 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+/*
+  Time each worker spent on the last run() and how many tasks it did,
+  stolen counts the tasks it took from another worker's range
+*/
+struct Worker_Stats {
+  double busy_time = 0; // seconds
+  int tasks = 0;
+  int stolen = 0;
+};
+
+/*
+  Persistent pool of worker threads
+
+  The threads are created once and sleep between runs. run() splits the tasks into one range per worker,
+  a worker takes tasks from the front of its own range and when that is empty it steals from the ranges
+  of the other workers. Taking a task is a single atomic fetch_add on the range, so no locks are needed
+  while the tasks are being worked on.
+*/
+class Thread_Pool {
+private:
+  // padded to a cache line so that workers taking tasks from their ranges don't slow each other down
+  struct alignas(64) Task_Range {
+    std::atomic<int> next;
+    int end;
+  };
+  std::vector<std::thread> threads;
+  // one range per worker, allocated with posix_memalign because std::allocator doesn't align to 64 bytes in C++11
+  Task_Range *ranges = nullptr;
+  int range_count = 0;
+  // the task of the current run, a pointer to the caller's function object so that run() doesn't allocate
+  void (*call_task)(void *task, int task_index, int worker_id) = nullptr;
+  void *task = nullptr;
+  std::mutex mutex;
+  std::condition_variable start_condition, done_condition;
+  uint64_t generation = 0; // increased for every run, tells the workers that there is new work
+  int running = 0;         // workers that haven't finished the current run yet
+  bool stopping = false;
+  void worker(int id);
+  void run(int task_count, void (*call_task)(void*, int, int), void *task);
+  template <typename Task> static void call(void *task, int task_index, int worker_id) {
+    (*static_cast<Task*>(task))(task_index, worker_id);
+  }
+  bool take_task(int id, int *task_index, bool *stolen);
+public:
+  std::vector<Worker_Stats> stats;
+  Thread_Pool() {};
+  Thread_Pool(int thread_amount) {resize(thread_amount);};
+  ~Thread_Pool() {resize(0);};
+  int size() {return threads.size();};
+  void resize(int thread_amount);
+  /*
+    Calls task(task_index, worker_id) for every task_index in [0, task_count) and returns when all are done
+  */
+  template <typename Task> void run(int task_count, Task task) {run(task_count, &call<Task>, &task);};
+  /*
+    Busy time of the slowest worker divided by the average, 1 means the work was perfectly balanced
+  */
+  double imbalance();
+};
+
+void Thread_Pool::resize(int thread_amount) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_condition.notify_all();
+  for (auto& t : threads) t.join();
+  threads.clear();
+  stopping = false;
+  for (int i=0; i<range_count; i++) ranges[i].~Task_Range();
+  free(ranges);
+  ranges = nullptr;
+  range_count = 0;
+  if (thread_amount > 0) {
+    void *memory = nullptr;
+    if (posix_memalign(&memory, alignof(Task_Range), thread_amount * sizeof(Task_Range)) != 0) {throw std::bad_alloc();}
+    ranges = static_cast<Task_Range*>(memory);
+    for (int i=0; i<thread_amount; i++) new (&ranges[i]) Task_Range();
+    range_count = thread_amount;
+  }
+  stats = std::vector<Worker_Stats>(thread_amount);
+  for (int i=0; i<thread_amount; i++) {
+    threads.push_back(std::thread(&Thread_Pool::worker, this, i));
+  }
+}
+
+void Thread_Pool::run(int task_count, void (*call_task)(void*, int, int), void *task) {
+  int thread_amount = threads.size();
+  for (int i=0; i<thread_amount; i++) {
+    ranges[i].next = (int64_t)task_count * i / thread_amount;
+    ranges[i].end = (int64_t)task_count * (i+1) / thread_amount;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  this->call_task = call_task;
+  this->task = task;
+  running = thread_amount;
+  generation++;
+  start_condition.notify_all();
+  done_condition.wait(lock, [this] {return running == 0;});
+}
+
+bool Thread_Pool::take_task(int id, int *task_index, bool *stolen) {
+  int thread_amount = range_count;
+  for (int i=0; i<thread_amount; i++) {
+    // start with our own range, then go through the others
+    Task_Range *range = &ranges[(id+i) % thread_amount];
+    if (range->next.load(std::memory_order_relaxed) >= range->end) {continue;}
+    int t = range->next.fetch_add(1, std::memory_order_relaxed);
+    if (t < range->end) {
+      *task_index = t;
+      *stolen = i != 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Thread_Pool::worker(int id) {
+  uint64_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_condition.wait(lock, [this, seen_generation] {return stopping || generation != seen_generation;});
+      if (stopping) {return;}
+      seen_generation = generation;
+    }
+    Worker_Stats worker_stats;
+    auto t_start = std::chrono::high_resolution_clock::now();
+    int task_index;
+    bool stolen;
+    while (take_task(id, &task_index, &stolen)) {
+      call_task(task, task_index, id);
+      worker_stats.tasks++;
+      worker_stats.stolen += stolen;
+    }
+    auto t_end = std::chrono::high_resolution_clock::now();
+    worker_stats.busy_time = std::chrono::duration_cast<std::chrono::microseconds>(t_end-t_start).count()/1000000.;
+    stats[id] = worker_stats;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running--;
+      if (running == 0) {done_condition.notify_one();}
+    }
+  }
+}
+
+// busiest worker divided by the mean, 1 is a perfect balance
+double worker_imbalance(std::vector<Worker_Stats> *stats) {
+  double max_time = 0, total_time = 0;
+  for (auto& s : *stats) {
+    max_time = std::max(max_time, s.busy_time);
+    total_time += s.busy_time;
+  }
+  if (total_time == 0) {return 1;}
+  return max_time / (total_time / stats->size());
+}
+double Thread_Pool::imbalance() {
+  return worker_imbalance(&stats);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <math.h>
+#include "vector.hpp"
+
+/*
+  Affine transformation, a 3x3 matrix followed by a translation
+
+  The matrix is stored as its columns x, y and z, which are where the x, y and z axes end up,
+  so a point p goes to x*p.x + y*p.y + z*p.z + translation. Used to place instances of a model in the scene
+*/
+struct Transform {
+  Vec3f x, y, z;
+  Vec3f translation;
+  Transform() : x(1.,0.,0.), y(0.,1.,0.), z(0.,0.,1.), translation() {};
+  Transform(Vec3f x, Vec3f y, Vec3f z, Vec3f translation) : x(x), y(y), z(z), translation(translation) {};
+  static Transform translate(Vec3f t) {return Transform(Vec3f(1.,0.,0.), Vec3f(0.,1.,0.), Vec3f(0.,0.,1.), t);};
+  static Transform scale(float s) {return Transform(Vec3f(s,0.,0.), Vec3f(0.,s,0.), Vec3f(0.,0.,s), Vec3f());};
+  // angles in radians, counterclockwise when looking down the axis
+  static Transform rotation_x(float angle);
+  static Transform rotation_z(float angle);
+  Vec3f apply_point(Vec3f p) {return x*p.x + y*p.y + z*p.z + translation;};
+  Vec3f apply_vector(Vec3f v) {return x*v.x + y*v.y + z*v.z;};
+  /*
+    Multiplies with the transposed matrix. Normals have to be moved with the inverse transpose of the matrix
+    that moves the points, so to_model.apply_transposed(n) turns a normal of the model into one in the scene
+  */
+  Vec3f apply_transposed(Vec3f v) {return Vec3f(dot(x, v), dot(y, v), dot(z, v));};
+  // the matrix must not be singular (no scale of 0)
+  Transform inverse();
+};
+
+// a after b: (a*b).apply_point(p) == a.apply_point(b.apply_point(p))
+Transform operator * (Transform a, Transform b) {
+  return Transform(a.apply_vector(b.x), a.apply_vector(b.y), a.apply_vector(b.z), a.apply_point(b.translation));
+}
+
+Transform Transform::rotation_x(float angle) {
+  float s = sin(angle), c = cos(angle);
+  return Transform(Vec3f(1.,0.,0.), Vec3f(0.,c,s), Vec3f(0.,-s,c), Vec3f());
+}
+Transform Transform::rotation_z(float angle) {
+  float s = sin(angle), c = cos(angle);
+  return Transform(Vec3f(c,s,0.), Vec3f(-s,c,0.), Vec3f(0.,0.,1.), Vec3f());
+}
+
+Transform Transform::inverse() {
+  // the rows of the inverse are the cross products of the other two columns divided by the determinant
+  Vec3f row_x = cross(y, z), row_y = cross(z, x), row_z = cross(x, y);
+  float inverse_determinant = 1.f / dot(x, row_x);
+  row_x = row_x * inverse_determinant;
+  row_y = row_y * inverse_determinant;
+  row_z = row_z * inverse_determinant;
+  Transform result(Vec3f(row_x.x, row_y.x, row_z.x), Vec3f(row_x.y, row_y.y, row_z.y), Vec3f(row_x.z, row_y.z, row_z.z), Vec3f());
+  result.translation = result.apply_vector(translation) * -1.f;
+  return result;
+}
@@ -1,60 +1,132 @@
 #pragma once
 #include <iostream>
 #include <math.h>
+#if (defined(__SSE2__) || defined(__x86_64__)) && !defined(NO_SIMD)
+#include <xmmintrin.h>
+#define VECTOR_SSE
+#endif
 
+/*
+  The vector math under everything else
+
+  Every operation is inline and float only, a double literal in an expression (2. instead of 2.f) turns the
+  whole expression into double math and back, so intersection code keeps the f on its constants.
+  normalize() multiplies with one reciprocal square root instead of dividing three times. Built with
+  -DFAST_NORMALIZE (and SSE) that reciprocal square root is the estimate of rsqrtss refined by one Newton-Raphson
+  step, accurate to about 2^-22 instead of exact, which is faster but can flip a cell on the edge between two
+  characters now and then, so it is off by default.
+
+  Vec3f stays 12 bytes: it is part of every AABB and so of every BVH node, which are 32 bytes now and would be
+  48 with a padded Vec3f. Vec4f is the padded 16 byte version held in one SSE register, for code that does the
+  same thing to all three components many times over (make vector_benchmark compares the two)
+*/
 class Vec3f {
 public:
   float x,y,z;
-  Vec3f() : x(0.), y(0.), z(0.) {};
-  Vec3f(float x, float y, float z) : x(x), y(y), z(z) {};
-  Vec3f friend operator + (Vec3f v1, Vec3f v2);
-  Vec3f friend operator - (Vec3f v1, Vec3f v2);
-  Vec3f friend operator * (Vec3f v, float s);
-  Vec3f friend operator * (Vec3f v, int s);
-  Vec3f friend operator / (Vec3f v, float s);
-  Vec3f friend operator / (Vec3f v, int s);
-  float length();
-  Vec3f normalize();
-  void values();
+  constexpr Vec3f() : x(0.f), y(0.f), z(0.f) {};
+  constexpr Vec3f(float x, float y, float z) : x(x), y(y), z(z) {};
+  float length() const;
+  constexpr float length_squared() const {return x*x + y*y + z*z;};
+  Vec3f normalize() const;
+  void values() const;
 };
-float dot(Vec3f v1, Vec3f v2);
-Vec3f cross(Vec3f v1, Vec3f v2);
 
-Vec3f operator + (Vec3f v1, Vec3f v2) {
-  return Vec3f(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
-}
-Vec3f operator - (Vec3f v1, Vec3f v2) {
-  return Vec3f(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
-}
-Vec3f operator * (Vec3f v, float s) {
-  return Vec3f(v.x * s, v.y * s, v.z * s);
-}
-Vec3f operator * (Vec3f v, int s) {
-  return Vec3f(v.x * s, v.y * s, v.z * s);
+constexpr Vec3f operator + (Vec3f v1, Vec3f v2) {return Vec3f(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);}
+constexpr Vec3f operator - (Vec3f v1, Vec3f v2) {return Vec3f(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);}
+constexpr Vec3f operator - (Vec3f v) {return Vec3f(-v.x, -v.y, -v.z);}
+constexpr Vec3f operator * (Vec3f v, float s) {return Vec3f(v.x * s, v.y * s, v.z * s);}
+constexpr Vec3f operator * (Vec3f v, int s) {return Vec3f(v.x * s, v.y * s, v.z * s);}
+constexpr Vec3f operator / (Vec3f v, float s) {return Vec3f(v.x / s, v.y / s, v.z / s);}
+constexpr Vec3f operator / (Vec3f v, int s) {return Vec3f(v.x / s, v.y / s, v.z / s);}
+
+constexpr float dot(Vec3f v1, Vec3f v2) {
+  return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
 }
-Vec3f operator / (Vec3f v, float s) {
-  return Vec3f(v.x / s, v.y / s, v.z / s);
+constexpr Vec3f cross(Vec3f v1, Vec3f v2) {
+  return Vec3f(v1.y*v2.z - v1.z*v2.y,
+               v1.z*v2.x - v1.x*v2.z,
+               v1.x*v2.y - v1.y*v2.x);
 }
-Vec3f operator / (Vec3f v, int s) {
-  return Vec3f(v.x / s, v.y / s, v.z / s);
+
+// 1/sqrt(x), see FAST_NORMALIZE above
+inline float reciprocal_sqrt(float x) {
+#if defined(FAST_NORMALIZE) && defined(VECTOR_SSE)
+  float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+  // one Newton-Raphson step takes the 12 bits of the estimate to about 22
+  return estimate * (1.5f - 0.5f*x*estimate*estimate);
+#else
+  return 1.f / sqrtf(x);
+#endif
 }
 
-float Vec3f::length() {
-  return sqrt(x*x + y*y + z*z);
+inline float Vec3f::length() const {
+  return sqrtf(length_squared());
 }
-Vec3f Vec3f::normalize() {
-  float l = length();
-  return Vec3f(x/l, y/l, z/l);
+inline Vec3f Vec3f::normalize() const {
+  return *this * reciprocal_sqrt(length_squared());
 }
-void Vec3f::values() {
+inline void Vec3f::values() const {
   std::cout << "(" << x << "," << y << "," << z << ")" << std::endl;
 }
 
-float dot(Vec3f v1, Vec3f v2) {
-  return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
+/*
+  Four floats in one SSE register (or an array of four without SSE), w is 0 unless it is set.
+  The 3 component functions leave w out of their results
+*/
+struct alignas(16) Vec4f {
+#ifdef VECTOR_SSE
+  __m128 v;
+  Vec4f() : v(_mm_setzero_ps()) {};
+  Vec4f(__m128 v) : v(v) {};
+  Vec4f(float x, float y, float z, float w = 0.f) : v(_mm_set_ps(w, z, y, x)) {};
+  float x() const {return _mm_cvtss_f32(v);};
+  float y() const {return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1,1,1,1)));};
+  float z() const {return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2,2,2,2)));};
+#else
+  float v[4];
+  Vec4f() : v{0.f, 0.f, 0.f, 0.f} {};
+  Vec4f(float x, float y, float z, float w = 0.f) : v{x, y, z, w} {};
+  float x() const {return v[0];};
+  float y() const {return v[1];};
+  float z() const {return v[2];};
+#endif
+  explicit Vec4f(Vec3f a) : Vec4f(a.x, a.y, a.z) {};
+  Vec3f xyz() const {return Vec3f(x(), y(), z());};
+};
+
+#ifdef VECTOR_SSE
+inline Vec4f operator + (Vec4f a, Vec4f b) {return _mm_add_ps(a.v, b.v);}
+inline Vec4f operator - (Vec4f a, Vec4f b) {return _mm_sub_ps(a.v, b.v);}
+inline Vec4f operator * (Vec4f a, Vec4f b) {return _mm_mul_ps(a.v, b.v);}
+inline Vec4f operator * (Vec4f a, float s) {return _mm_mul_ps(a.v, _mm_set1_ps(s));}
+inline Vec4f component_min(Vec4f a, Vec4f b) {return _mm_min_ps(a.v, b.v);}
+inline Vec4f component_max(Vec4f a, Vec4f b) {return _mm_max_ps(a.v, b.v);}
+inline float dot3(Vec4f a, Vec4f b) {
+  __m128 p = _mm_mul_ps(a.v, b.v);
+  // x+y+z without w: add y to x, then z
+  __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1)));
+  return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
 }
-Vec3f cross(Vec3f v1, Vec3f v2) {
-  return Vec3f(v1.y*v2.z - v1.z*v2.y,
-               v1.z*v2.x - v1.x*v2.z,
-               v1.x*v2.y - v1.y*v2.x);
+inline Vec4f cross3(Vec4f a, Vec4f b) {
+  // a.yzx*b.zxy - a.zxy*b.yzx, computed as (a*b.yzx - a.yzx*b).yzx which needs one shuffle less
+  __m128 a_yzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3,0,2,1));
+  __m128 b_yzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3,0,2,1));
+  __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, b_yzx), _mm_mul_ps(a_yzx, b.v));
+  return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1));
+}
+#else
+inline Vec4f operator + (Vec4f a, Vec4f b) {return Vec4f(a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2], a.v[3]+b.v[3]);}
+inline Vec4f operator - (Vec4f a, Vec4f b) {return Vec4f(a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2], a.v[3]-b.v[3]);}
+inline Vec4f operator * (Vec4f a, Vec4f b) {return Vec4f(a.v[0]*b.v[0], a.v[1]*b.v[1], a.v[2]*b.v[2], a.v[3]*b.v[3]);}
+inline Vec4f operator * (Vec4f a, float s) {return Vec4f(a.v[0]*s, a.v[1]*s, a.v[2]*s, a.v[3]*s);}
+inline Vec4f component_min(Vec4f a, Vec4f b) {
+  return Vec4f(fminf(a.v[0], b.v[0]), fminf(a.v[1], b.v[1]), fminf(a.v[2], b.v[2]), fminf(a.v[3], b.v[3]));
 }
+inline Vec4f component_max(Vec4f a, Vec4f b) {
+  return Vec4f(fmaxf(a.v[0], b.v[0]), fmaxf(a.v[1], b.v[1]), fmaxf(a.v[2], b.v[2]), fmaxf(a.v[3], b.v[3]));
+}
+inline float dot3(Vec4f a, Vec4f b) {return a.v[0]*b.v[0] + a.v[1]*b.v[1] + a.v[2]*b.v[2];}
+inline Vec4f cross3(Vec4f a, Vec4f b) {return Vec4f(cross(a.xyz(), b.xyz()));}
+#endif
+
+inline Vec4f normalize3(Vec4f a) {return a * reciprocal_sqrt(dot3(a, a));}
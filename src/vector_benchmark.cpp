@@ -0,0 +1,144 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "vector.hpp"
+
+/*
+  Times the vector math of vector.hpp against the Vec3f it replaced (copied below as Old_Vec3f): normalizing,
+  a cross product followed by a dot product and the ray sphere test, over arrays of random vectors, with
+  Vec3f and with the padded Vec4f. make vector_benchmark runs it once as is and once with -DFAST_NORMALIZE
+*/
+namespace old_math {
+  class Old_Vec3f {
+  public:
+    float x,y,z;
+    Old_Vec3f() : x(0.), y(0.), z(0.) {};
+    Old_Vec3f(float x, float y, float z) : x(x), y(y), z(z) {};
+    float length() {return sqrt(x*x + y*y + z*z);};
+    Old_Vec3f normalize() {
+      float l = length();
+      return Old_Vec3f(x/l, y/l, z/l);
+    };
+  };
+  Old_Vec3f operator - (Old_Vec3f v1, Old_Vec3f v2) {return Old_Vec3f(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);}
+  float dot(Old_Vec3f v1, Old_Vec3f v2) {return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;}
+  Old_Vec3f cross(Old_Vec3f v1, Old_Vec3f v2) {
+    return Old_Vec3f(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
+  }
+  // the sphere test as it was, with the double constants
+  float sphere(Old_Vec3f origin, Old_Vec3f direction, Old_Vec3f center, float radius) {
+    float a = dot(direction, direction);
+    float b = 2.f * dot(direction, origin - center);
+    float c = dot(origin - center, origin - center) - radius*radius;
+    float discriminant = b*b - 4.*a*c;
+    if (discriminant <= 0) {return -1.f;}
+    return (-b - sqrt(discriminant)) / 2.*a;
+  }
+}
+
+float sphere(Vec3f origin, Vec3f direction, Vec3f center, float radius) {
+  Vec3f oc = origin - center;
+  float a = dot(direction, direction);
+  float b = 2.f * dot(direction, oc);
+  float c = dot(oc, oc) - radius*radius;
+  float discriminant = b*b - 4.f*a*c;
+  if (discriminant <= 0.f) {return -1.f;}
+  return (-b - sqrtf(discriminant)) / (2.f*a);
+}
+float sphere(Vec4f origin, Vec4f direction, Vec4f center, float radius) {
+  Vec4f oc = origin - center;
+  float a = dot3(direction, direction);
+  float b = 2.f * dot3(direction, oc);
+  float c = dot3(oc, oc) - radius*radius;
+  float discriminant = b*b - 4.f*a*c;
+  if (discriminant <= 0.f) {return -1.f;}
+  return (-b - sqrtf(discriminant)) / (2.f*a);
+}
+
+const int count = 1 << 14;
+const int repeats = 2000;
+
+// nanoseconds per vector
+template <typename F>
+double measure(F kernel) {
+  kernel(); // warm up the caches
+  auto t_start = std::chrono::high_resolution_clock::now();
+  for (int r=0; r<repeats; r++) {kernel();}
+  auto t_end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t_end-t_start).count() / ((double)repeats * count);
+}
+
+float random_float() {return rand() / (float)RAND_MAX * 2.f - 1.f;}
+
+int main() {
+  std::vector<old_math::Old_Vec3f> old_a(count), old_b(count);
+  std::vector<Vec3f> a(count), b(count), result(count);
+  std::vector<Vec4f> a4(count), b4(count), result4(count);
+  std::vector<old_math::Old_Vec3f> old_result(count);
+  for (int i=0; i<count; i++) {
+    a[i] = Vec3f(random_float(), random_float(), random_float());
+    b[i] = Vec3f(random_float(), random_float(), random_float());
+    old_a[i] = old_math::Old_Vec3f(a[i].x, a[i].y, a[i].z);
+    old_b[i] = old_math::Old_Vec3f(b[i].x, b[i].y, b[i].z);
+    a4[i] = Vec4f(a[i]);
+    b4[i] = Vec4f(b[i]);
+  }
+  volatile float sink = 0.f;
+
+  printf("%d vectors, ns per vector, normalize is %s\n", count,
+#if defined(FAST_NORMALIZE) && defined(VECTOR_SSE)
+         "rsqrtss + Newton-Raphson"
+#else
+         "1/sqrt"
+#endif
+  );
+  printf("%-22s %10s %10s %10s\n", "", "old Vec3f", "Vec3f", "Vec4f");
+
+  double old_time = measure([&]() {for (int i=0; i<count; i++) {old_result[i] = old_a[i].normalize();}});
+  double new_time = measure([&]() {for (int i=0; i<count; i++) {result[i] = a[i].normalize();}});
+  double time4 = measure([&]() {for (int i=0; i<count; i++) {result4[i] = normalize3(a4[i]);}});
+  printf("%-22s %10.3f %10.3f %10.3f\n", "normalize", old_time, new_time, time4);
+  // how far from 1 the lengths of the normalized vectors are
+  double worst_error = 0.;
+  for (int i=0; i<count; i++) {
+    double x = result[i].x, y = result[i].y, z = result[i].z;
+    worst_error = std::max(worst_error, std::abs(sqrt(x*x + y*y + z*z) - 1.));
+  }
+
+  old_time = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += old_math::dot(old_math::cross(old_a[i], old_b[i]), old_a[(i+1) % count]);}
+    sink = sink + sum;
+  });
+  new_time = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += dot(cross(a[i], b[i]), a[(i+1) % count]);}
+    sink = sink + sum;
+  });
+  time4 = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += dot3(cross3(a4[i], b4[i]), a4[(i+1) % count]);}
+    sink = sink + sum;
+  });
+  printf("%-22s %10.3f %10.3f %10.3f\n", "dot(cross(a, b), c)", old_time, new_time, time4);
+
+  // rays from a[i] in the direction of b[i] against a sphere of radius 0.5 at the origin
+  old_time = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += old_math::sphere(old_a[i], old_b[i], old_math::Old_Vec3f(), 0.5f);}
+    sink = sink + sum;
+  });
+  new_time = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += sphere(a[i], b[i], Vec3f(), 0.5f);}
+    sink = sink + sum;
+  });
+  time4 = measure([&]() {
+    float sum = 0.f;
+    for (int i=0; i<count; i++) {sum += sphere(a4[i], b4[i], Vec4f(), 0.5f);}
+    sink = sink + sum;
+  });
+  printf("%-22s %10.3f %10.3f %10.3f\n", "ray sphere", old_time, new_time, time4);
+  printf("worst length error after normalize: %.2e\n", worst_error);
+}
@@ -1,20 +1,99 @@
+#pragma once
 #include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include "color.hpp"
+#include "profiler.hpp"
 
+/*
+  Displays the framebuffer in the terminal
+
+  The window keeps a copy of the last frame it displayed and only rewrites the cells that changed since then.
+  Every run of changed cells is written as a cursor positioning escape followed by the new characters,
+  the whole frame is built in one buffer and sent to the terminal with a single write()
+
+  With a color mode every character is drawn in the color the renderer stored for its cell. With half_blocks
+  a cell shows two pixels instead of a character: the upper half block (U+2580) in the color of the upper
+  pixel on the background color of the lower one, so the picture has twice as many rows as the terminal.
+  Colors are set with SGR escapes, which would make every cell 10 times bigger, so the window remembers which
+  colors the terminal is set to and only sends the ones that change, across runs too. A space only needs its
+  background color, and when the terminal colors fit a lower half block better than an upper one that is drawn instead
+*/
 class Window {
+private:
+  std::vector<uint64_t> previous_cells; // what the terminal currently shows, see cell_key()
+  std::vector<uint64_t> cells;          // the same for the frame that is being encoded
+  std::vector<char> output;             // escape sequences and characters for the next frame
+  size_t output_size = 0;
+  bool full_redraw = true;
+  // the colors the terminal is set to (palette index or 0xRRGGBB), -1 when we don't know
+  int64_t foreground = -1, background = -1;
+  bool colored = false; // the frame that is being encoded has colors
+  void append(const char *data, size_t length);
+  void append_number(int number);
+  void move_cursor(int x, int y);
+  void set_colors(int64_t new_foreground, int64_t new_background);
+  void append_color(int64_t color, bool is_background);
+  int64_t encode_color(Color color) {return color_mode == COLOR_256 ? color_256(color) : color;};
+  uint64_t cell_key(char *pixels, Color *colors, int x, int y);
+  void write_cell(uint64_t key);
+  void flush();
 public:
   int window_width, window_height;
-  Window(int window_width, int window_height) : window_width(window_width), window_height(window_height) {};
+  Color_Mode color_mode;
+  bool half_blocks;
+  size_t bytes_written = 0; // bytes sent to the terminal by the last display()
+  uint64_t total_bytes = 0; // bytes sent by every display() so far
+  int fd = STDOUT_FILENO;   // where display() writes, the terminal unless something else is measured
+  Window(int window_width, int window_height, Color_Mode color_mode = COLOR_OFF, bool half_blocks = false);
   void show_cursor(bool show);
   void fill(char *pixels);
-  void display(char *pixels);
+  /*
+    pixels has a character for every cell. In a color mode colors has the color of every cell,
+    with half_blocks it has two rows of pixels for every row of cells and pixels is only text that is drawn
+    over the picture (a space shows the picture)
+  */
+  void display(char *pixels, Color *colors = nullptr);
+  // builds the output of display() without sending it, returns how many bytes it would have been
+  size_t encode(char *pixels, Color *colors = nullptr);
+  // makes the next display() rewrite every cell, needed when something else wrote to the terminal
+  void invalidate() {full_redraw = true;};
+  // for a terminal that was resized, the next display() rewrites every cell.
+  // Must not be called while display() runs (Frame_Pipeline::resize() waits for that)
+  void resize(int window_width, int window_height);
 };
 
+Window::Window(int window_width, int window_height, Color_Mode color_mode, bool half_blocks) :
+  window_width(window_width), window_height(window_height), color_mode(color_mode), half_blocks(half_blocks) {
+  previous_cells.resize(window_width * window_height);
+  cells.resize(window_width * window_height);
+  // worst case: every cell is its own run which needs an escape sequence ("\033[yyyyy;xxxxxH") and the character,
+  // in color modes also both colors ("\033[38;2;rrr;ggg;bbb;48;2;rrr;ggg;bbbm") and 3 bytes for a half block
+  output.resize(window_width * window_height * (color_mode == COLOR_OFF ? 16 : 64) + 64);
+}
+
+void Window::resize(int window_width, int window_height) {
+  this->window_width = window_width;
+  this->window_height = window_height;
+  previous_cells.assign(window_width * window_height, 0);
+  cells.assign(window_width * window_height, 0);
+  output.resize(window_width * window_height * (color_mode == COLOR_OFF ? 16 : 64) + 64);
+  full_redraw = true;
+}
+
 void Window::show_cursor(bool show) {
   if (show) {
-    printf("\033[?25h");
+    // the terminal gets its own colors back too
+    printf(color_mode == COLOR_OFF ? "\033[?25h" : "\033[0m\033[?25h");
   } else {
     printf("\033[?25l");
   }
+  fflush(stdout);
 }
 
 void Window::fill(char *pixels) {
@@ -25,14 +104,180 @@ void Window::fill(char *pixels) {
   }
 }
 
-void Window::display(char *pixels) {
-  // displaying pixels
+void Window::append(const char *data, size_t length) {
+  memcpy(output.data() + output_size, data, length);
+  output_size += length;
+}
+
+void Window::append_number(int number) {
+  char digits[12];
+  int length = 0;
+  do {
+    digits[length++] = '0' + number % 10;
+    number /= 10;
+  } while (number > 0);
+  while (length > 0) {output[output_size++] = digits[--length];}
+}
+
+void Window::move_cursor(int x, int y) {
+  // terminal rows and columns start at 1
+  char escape[24];
+  int length = snprintf(escape, sizeof(escape), "\033[%d;%dH", y+1, x+1);
+  append(escape, length);
+}
+
+void Window::append_color(int64_t color, bool is_background) {
+  append(is_background ? "48;" : "38;", 3);
+  if (color_mode == COLOR_256) {
+    append("5;", 2);
+    append_number(color);
+  } else {
+    append("2;", 2);
+    append_number(color_red(color));
+    output[output_size++] = ';';
+    append_number(color_green(color));
+    output[output_size++] = ';';
+    append_number(color_blue(color));
+  }
+}
+
+// -1 leaves a color as it is
+void Window::set_colors(int64_t new_foreground, int64_t new_background) {
+  bool change_foreground = new_foreground != -1 && new_foreground != foreground;
+  bool change_background = new_background != -1 && new_background != background;
+  if (!change_foreground && !change_background) {return;}
+  append("\033[", 2);
+  if (change_foreground) {
+    append_color(new_foreground, false);
+    foreground = new_foreground;
+  }
+  if (change_background) {
+    if (change_foreground) {output[output_size++] = ';';}
+    append_color(new_background, true);
+    background = new_background;
+  }
+  output[output_size++] = 'm';
+}
+
+/*
+  Everything that decides how a cell looks packed into 64 bits, so comparing two frames is one comparison per cell.
+  Without colors it is the character, in color mode the character and its color (a space has no color),
+  with half blocks the colors of both pixels or bit 63 and the character for text
+*/
+const uint64_t text_cell = 1ull << 63;
+uint64_t Window::cell_key(char *pixels, Color *colors, int x, int y) {
+  unsigned char c = pixels[y*window_width + x];
+  if (!colored) {return c;}
+  if (half_blocks) {
+    if (c != ' ') {return text_cell | c;}
+    uint64_t top = encode_color(colors[2*y*window_width + x]);
+    uint64_t bottom = encode_color(colors[(2*y+1)*window_width + x]);
+    return top << 24 | bottom;
+  }
+  if (c == ' ') {return ' ';}
+  return (uint64_t)c << 32 | encode_color(colors[y*window_width + x]);
+}
+
+void Window::write_cell(uint64_t key) {
+  if (!colored) {
+    output[output_size++] = (char)key;
+  } else if (!half_blocks) {
+    char c = (char)(key >> 32);
+    if (key == ' ') {
+      output[output_size++] = ' ';
+      return;
+    }
+    set_colors(key & 0xFFFFFFFF, -1);
+    output[output_size++] = c;
+  } else if (key & text_cell) {
+    set_colors(encode_color(white), encode_color(0));
+    output[output_size++] = (char)key;
+  } else {
+    int64_t top = (key >> 24) & 0xFFFFFF, bottom = key & 0xFFFFFF;
+    if (top == bottom) {
+      // both halves are the same, that is only a background
+      set_colors(-1, top);
+      output[output_size++] = ' ';
+    } else if ((foreground != bottom) + (background != top) < (foreground != top) + (background != bottom)) {
+      // the lower half block with swapped colors looks the same and needs fewer colors changed
+      set_colors(bottom, top);
+      append("\xE2\x96\x84", 3);
+    } else {
+      set_colors(top, bottom);
+      append("\xE2\x96\x80", 3);
+    }
+  }
+}
+
+void Window::flush() {
+  size_t written = 0;
+  while (written < output_size) {
+    ssize_t result = write(fd, output.data() + written, output_size - written);
+    if (result < 0 && errno == EINTR) {continue;}
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // a non blocking terminal that is full, wait a while for it to take more
+      pollfd wait_writable = {fd, POLLOUT, 0};
+      if (poll(&wait_writable, 1, 1000) > 0) {continue;}
+    }
+    if (result <= 0) {break;}
+    written += result;
+  }
+  // previous_cells already says the whole frame is shown, when it isn't the next frame has to draw everything
+  if (written < output_size) {full_redraw = true;}
+  bytes_written = written;
+  total_bytes += written;
+  output_size = 0;
+}
+
+size_t Window::encode(char *pixels, Color *colors) {
+  output_size = 0;
+  bool was_colored = colored;
+  colored = color_mode != COLOR_OFF && colors;
+  // the cells of the last frame mean something else now
+  if (colored != was_colored) {full_redraw = true;}
+  if (full_redraw) {foreground = background = -1;}
   for (int y=0; y<window_height; y++) {
     for (int x=0; x<window_width; x++) {
-      std::cout << pixels[y*window_width + x];
+      cells[y*window_width + x] = cell_key(pixels, colors, x, y);
     }
-    std::cout << "\n";
   }
-  // set cursor position to top left corner
-  printf("\033[%d;%dH",0,0);
+  for (int y=0; y<window_height; y++) {
+    uint64_t *row = cells.data() + y*window_width;
+    uint64_t *previous_row = previous_cells.data() + y*window_width;
+    int x = 0;
+    while (x < window_width) {
+      if (!full_redraw && row[x] == previous_row[x]) {
+        x++;
+        continue;
+      }
+      // extend the run until there are enough unchanged cells in a row that a new escape sequence
+      // would be shorter than just writing them again
+      int run_end = x+1;
+      int unchanged = 0;
+      while (run_end < window_width && unchanged < 8) {
+        if (full_redraw || row[run_end] != previous_row[run_end]) {
+          unchanged = 0;
+        } else {
+          unchanged++;
+        }
+        run_end++;
+      }
+      run_end -= unchanged;
+      move_cursor(x, y);
+      for (int i=x; i<run_end; i++) {write_cell(row[i]);}
+      x = run_end;
+    }
+  }
+  std::swap(cells, previous_cells);
+  full_redraw = false;
+  return output_size;
+}
+
+void Window::display(char *pixels, Color *colors) {
+  PROFILE_SCOPE("display");
+  // anything still sitting in the stdio buffers has to reach the terminal before our write()
+  std::cout.flush();
+  fflush(stdout);
+  encode(pixels, colors);
+  flush();
 }